@@ -5,12 +5,22 @@ int dump_file_named(char*);
 int dump_file(FILE*);
 int ctrl_byte(FILE*);
 int tempo(FILE*);
+int dictionary(FILE*);
+int table(FILE*, int, uint8_t*, int*);
+int packed_tables(FILE*);
 int waves(FILE*);
-int pattern_table(FILE*);
+int pattern_table(FILE*, int);
+int successor_table(FILE*, int);
+int channel_tables(FILE*);
 int instrument_table(FILE*);
+int tracks(FILE*);
+int track(FILE*);
 int patterns(FILE*);
 int instruments(FILE*);
 
+/* which of the tables are compressed */
+int packed;
+
 int main(int argc, char **argv) {
   if(argc != 2) {
     return 255;
@@ -42,15 +52,15 @@ int dump_file(FILE *fp) {
     return ret;
   }
 
-  if((ret = tempo(fp))) {
+  if((ret = dictionary(fp))) {
     return ret;
   }
 
-  if((ret = waves(fp))) {
+  if((ret = packed_tables(fp))) {
     return ret;
   }
 
-  if((ret = pattern_table(fp))) {
+  if((ret = waves(fp))) {
     return ret;
   }
 
@@ -58,6 +68,10 @@ int dump_file(FILE *fp) {
     return ret;
   }
 
+  if((ret = tracks(fp))) {
+    return ret;
+  }
+
   if((ret = patterns(fp))) {
     return ret;
   }
@@ -90,20 +104,107 @@ int tempo(FILE *fp) {
   return 0;
 }
 
-int waves(FILE *fp) {
-  int waveBytes;
-  uint8_t wave[16];
+int dictionary(FILE *fp) {
+  int dictionary_bytes;
+
+  if((dictionary_bytes = fgetc(fp)) == EOF) {
+    fprintf(stderr, "unexpected EOF\n");
+    return EOF;
+  }
+  printf("Dictionary bytes: %d\n", dictionary_bytes);
 
-  if((waveBytes = fgetc(fp)) == EOF) {
+  printf("Skipping dictionary\n");
+  fseek(fp, dictionary_bytes, SEEK_CUR);
+
+  return 0;
+}
+
+/* reads a table's length byte and then the table, decompressing it if it's packed */
+int table(FILE *fp, int packed, uint8_t *out, int *bytes) {
+  int length, flags, i, c;
+
+  if((length = fgetc(fp)) == EOF) {
     fprintf(stderr, "unexpected EOF\n");
     return EOF;
   }
-  waveBytes = waveBytes ? waveBytes : 256;
+  *bytes = length ? length : 256;
+
+  if(!packed) {
+    if(fread(out, *bytes, 1, fp) != 1) {
+      fprintf(stderr, "unexpected EOF\n");
+      return EOF;
+    }
+    return 0;
+  }
+
+  /* the same LZ as the patterns; see Decompress */
+  length = 0;
+  for(;;) {
+    if((flags = fgetc(fp)) == EOF) {
+      fprintf(stderr, "unexpected EOF\n");
+      return EOF;
+    }
+    for(i = 0; i < 8; i++, flags >>= 1) {
+      int count, offset;
+      if((c = fgetc(fp)) == EOF) {
+	fprintf(stderr, "unexpected EOF\n");
+	return EOF;
+      }
+      if(flags & 1) {
+	count = 1;
+	offset = -1;
+      } else if(c == 0) {
+	if(length != *bytes) {
+	  fprintf(stderr, "table unpacks to %d bytes, not %d\n", length, *bytes);
+	  return 1;
+	}
+	return 0;
+      } else {
+	count = c;
+	if((offset = fgetc(fp)) == EOF) {
+	  fprintf(stderr, "unexpected EOF\n");
+	  return EOF;
+	}
+	offset -= 256;
+	if(length + offset < 0) {
+	  fprintf(stderr, "match reaches before the start of the table\n");
+	  return 1;
+	}
+      }
+      if(length + count > 256) {
+	fprintf(stderr, "table unpacks to more than 256 bytes\n");
+	return 1;
+      }
+      while(count--) {
+	out[length] = offset < 0 && (flags & 1) ? c : out[length + offset];
+	length++;
+      }
+    }
+  }
+}
+
+int packed_tables(FILE *fp) {
+  if((packed = fgetc(fp)) == EOF) {
+    fprintf(stderr, "unexpected EOF\n");
+    return EOF;
+  }
+  printf("Packed tables: %s%s\n",
+	 packed & 1 ? "waves " : "",
+	 packed & 2 ? "instruments" : "");
+  return 0;
+}
+
+int waves(FILE *fp) {
+  int ret, waveBytes, w;
+  uint8_t wave[256];
+
+  if((ret = table(fp, packed & 1, wave, &waveBytes))) {
+    return ret;
+  }
   printf("Wave bytes: %d\n", waveBytes);
 
   /* special case for no waves */
   if(waveBytes == 1) {
-    fgetc(fp);
     return 0;
   }
 
@@ -112,33 +213,26 @@ int waves(FILE *fp) {
     return 1;
   }
 
-  while(waveBytes) {
+  for(w = 0; w < waveBytes; w += 16) {
     int i;
-    int cnt = fread(wave, 16, 1, fp);
-    if(cnt != 1) {
-      fprintf(stderr, "failed to read wave\n");
-      return EOF;
-    }
     for(i = 0; i < 16; i++) {
-      uint8_t high = wave[i] >> 4;
-      uint8_t low = wave[i] & 0x0F;
+      uint8_t high = wave[w + i] >> 4;
+      uint8_t low = wave[w + i] & 0x0F;
       printf("%2X %2X ", high, low);
     }
     printf("\n");
-    waveBytes -= 16;
   }
 
   return 0;
 }
 
-int pattern_table(FILE *fp) {
-  int pattern_bytes;
+int pattern_table(FILE *fp, int packed) {
+  int ret, pattern_bytes;
+  uint8_t pattern_table[256];
 
-  if((pattern_bytes = fgetc(fp)) == EOF) {
-    fprintf(stderr, "unexpected EOF\n");
-    return EOF;
+  if((ret = table(fp, packed, pattern_table, &pattern_bytes))) {
+    return ret;
   }
-  pattern_bytes = pattern_bytes ? pattern_bytes : 256;
   printf("Pattern bytes: %d\n", pattern_bytes);
 
   if(pattern_bytes % 2 != 0) {
@@ -146,20 +240,34 @@ int pattern_table(FILE *fp) {
     return 1;
   }
 
-  printf("Skipping pattern table\n");
-  fseek(fp, pattern_bytes, SEEK_CUR);
+  return successor_table(fp, pattern_bytes / 2);
+}
+
+int successor_table(FILE *fp, int pattern_count) {
+  int i, successor;
+
+  for(i = 0; i < pattern_count; i++) {
+    if((successor = fgetc(fp)) == EOF) {
+      fprintf(stderr, "unexpected EOF\n");
+      return EOF;
+    }
+    if(successor == 0xFF) {
+      printf("Pattern %d: then stop\n", i);
+    } else {
+      printf("Pattern %d: then pattern %d\n", i, successor / 2);
+    }
+  }
 
   return 0;
 }
 
 int instrument_table(FILE *fp) {
-  int instrument_bytes;
+  int ret, instrument_bytes;
+  uint8_t instrument_table[256];
 
-  if((instrument_bytes = fgetc(fp)) == EOF) {
-    fprintf(stderr, "unexpected EOF\n");
-    return EOF;
+  if((ret = table(fp, packed & 2, instrument_table, &instrument_bytes))) {
+    return ret;
   }
-  instrument_bytes = instrument_bytes ? instrument_bytes : 256;
   printf("Instrument bytes: %d\n", instrument_bytes);
 
   if(instrument_bytes % 2 != 0) {
@@ -167,8 +275,84 @@ int instrument_table(FILE *fp) {
     return 1;
   }
 
-  printf("Skipping instrument table\n");
-  fseek(fp, instrument_bytes, SEEK_CUR);
+  return 0;
+}
+
+/* the track directory gives where each track is, from the end of the directory; the tracks
+   themselves come after the instruments, so we come back here afterwards */
+int tracks(FILE *fp) {
+  int ret, track_count, i;
+  long base;
+  uint16_t offsets[256];
+
+  if((track_count = fgetc(fp)) == EOF) {
+    fprintf(stderr, "unexpected EOF\n");
+    return EOF;
+  }
+  printf("Tracks: %d\n", track_count);
+
+  for(i = 0; i < track_count; i++) {
+    int lo, hi;
+    if((lo = fgetc(fp)) == EOF || (hi = fgetc(fp)) == EOF) {
+      fprintf(stderr, "unexpected EOF\n");
+      return EOF;
+    }
+    offsets[i] = lo | hi << 8;
+  }
+
+  base = ftell(fp);
+  for(i = 0; i < track_count; i++) {
+    printf("Track %d:\n", i);
+    fseek(fp, base + offsets[i], SEEK_SET);
+    if((ret = track(fp))) {
+      return ret;
+    }
+  }
+  fseek(fp, base, SEEK_SET);
+
+  return 0;
+}
+
+int track(FILE *fp) {
+  int ret, track_packed;
+
+  if((ret = tempo(fp))) {
+    return ret;
+  }
+
+  if((track_packed = fgetc(fp)) == EOF) {
+    fprintf(stderr, "unexpected EOF\n");
+    return EOF;
+  }
+
+  if((ret = pattern_table(fp, track_packed & 1))) {
+    return ret;
+  }
+
+  if(track_packed & 2) {
+    return channel_tables(fp);
+  }
+
+  return 0;
+}
+
+/* a per-channel song's track then has a table of patterns for each channel */
+int channel_tables(FILE *fp) {
+  int channel, pattern_count, i;
+
+  for(channel = 0; channel < 4; channel++) {
+    if((pattern_count = fgetc(fp)) == EOF) {
+      fprintf(stderr, "unexpected EOF\n");
+      return EOF;
+    }
+    printf("Channel %d patterns: %d\n", channel, pattern_count);
+    for(i = 0; i < pattern_count * 2; i++) {
+      if(fgetc(fp) == EOF) {
+        fprintf(stderr, "unexpected EOF\n");
+        return EOF;
+      }
+    }
+  }
 
   return 0;
 }
@@ -1,153 +1,453 @@
 #include "Compressor.h"
 
+#include <algorithm>
 #include <experimental/optional>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace std::experimental;
 
-class BlockImpl {
-public:
-  BlockImpl() : commandCount(0), flagByte(0) {}
-  
-  void addMatch(const Match& match) {
-    this->data.push_back(match.length);
-    this->data.push_back(-match.delta);
-    this->commandCount++;
+/* returns how many bytes starting at a and b are equal, up to limit */
+static size_t matchLength(const uint8_t *a, const uint8_t *b, size_t limit) {
+  size_t len = 0;
+
+#ifdef __SSE2__
+  /* compare 16 bytes at a time; the first clear bit in the mask is the first mismatch */
+  while (len + 16 <= limit) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + len));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + len));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+    if (mask) {
+      return len + __builtin_ctz(mask);
+    }
+    len += 16;
   }
+#endif
 
-  void addLiteral(char c) {
-    this->data.push_back(c);
-    /* raise the literal flag */
-    this->flagByte |= (1 << this->commandCount);
-    this->commandCount++;
+  while (len < limit && a[len] == b[len]) {
+    len++;
   }
+  return len;
+}
 
-  void addEOF(void) {
-    this->data.push_back(0);
+/* Finds the longest match at each position using hash chains over 3-byte prefixes
+   (the shortest match we ever emit). Every position in the window with the same prefix
+   hash is linked, most recent first, so walking a chain visits candidates in order of
+   increasing delta - exactly the order the old brute-force scan used, which keeps ties
+   going to the nearest match and the output byte-identical. */
+class MatchFinder {
+public:
+  static const size_t MIN_MATCH = 3;
+  /* the furthest a plain LZ command can reach */
+  static const size_t NEAR_DELTA = 255;
+
+  /* the chains are kept in head and prev, which the caller can hang on to between inputs */
+  MatchFinder(const uint8_t *data, size_t size, size_t maxDelta, size_t maxLength,
+	      std::vector<int32_t>& head, std::vector<int32_t>& prev) :
+    data(data), size(size), maxDelta(maxDelta), maxLength(maxLength), head(head), prev(prev), insertedUpTo(0)
+  {
+    head.assign(HASH_SIZE, -1);
+    prev.assign(size, -1);
   }
 
-  bool isFull(void) const {
-    return this->commandCount == COMMANDS_PER_BLOCK;
-  }
+  /* if near is given, it gets the longest match no further back than NEAR_DELTA, too */
+  optional<Match> longestMatchAt(size_t pos, optional<Match> *near = nullptr) {
+    optional<Match> longestMatch;
+    if (near) {
+      *near = longestMatch;
+    }
 
-  uint8_t getFlagByte(void) const {
-    return this->flagByte;
-  }
+    if (pos + MIN_MATCH > size) {
+      return longestMatch;
+    }
+    insertUpTo(pos);
 
-  uint16_t sizeIncludingFlagByte(void) const {
-    return this->data.size() + 1;
-  }
+    size_t limit = std::min(maxLength, size - pos);
+    const uint8_t *cur = data + pos;
+    size_t bestLen = MIN_MATCH - 1;
+    bool pastNear = false;
 
-  uint16_t sizeNoFlagByte(void) const {
-    return this->data.size();
-  }
+    for (int32_t cand = head[hashAt(pos)]; cand >= 0 && pos - cand <= maxDelta; cand = prev[cand]) {
+      const uint8_t *candPtr = data + cand;
+
+      if (near && !pastNear && pos - cand > NEAR_DELTA) {
+	*near = longestMatch;
+	pastNear = true;
+      }
+
+      /* a candidate can only do better if it also matches the byte that ended the best so far */
+      if (candPtr[bestLen] != cur[bestLen]) {
+	continue;
+      }
+
+      size_t len = matchLength(cur, candPtr, limit);
+      if (len > bestLen) {
+	bestLen = len;
+	longestMatch.emplace();
+	longestMatch->delta = pos - cand;
+	longestMatch->length = len;
+	if (len == limit) {
+	  break;
+	}
+      }
+    }
 
-  const char* begin(void) const {
-    return &this->data[0];
+    if (near && !pastNear) {
+      *near = longestMatch;
+    }
+    return longestMatch;
   }
 
 private:
-  std::vector<char> data;
-  uint8_t commandCount;
-  uint8_t flagByte;
+  static const int HASH_BITS = 12;
+  static const size_t HASH_SIZE = 1 << HASH_BITS;
+
+  const uint8_t *data;
+  size_t size;
+  size_t maxDelta;
+  size_t maxLength;
+  std::vector<int32_t>& head;
+  std::vector<int32_t>& prev;
+  size_t insertedUpTo;
+
+  size_t hashAt(size_t pos) const {
+    uint32_t prefix = data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16);
+    return (prefix * 2654435761u) >> (32 - HASH_BITS);
+  }
 
-  const int COMMANDS_PER_BLOCK = 8;
+  /* link every position before pos into its chain */
+  void insertUpTo(size_t pos) {
+    for (; insertedUpTo < pos; insertedUpTo++) {
+      size_t h = hashAt(insertedUpTo);
+      prev[insertedUpTo] = head[h];
+      head[h] = insertedUpTo;
+    }
+  }
 };
 
-Block::Block() : impl(std::make_unique<BlockImpl>()) {}
-Block::Block(const BlockImpl& impl) : impl(std::make_unique<BlockImpl>(impl)) {}
-Block::Block(Block&& block) : impl(std::move(block.impl)) {}
-Block::~Block() {}
+class CompressorImpl {
+public:
+  CompressorImpl(const CompressionOptions& options) :
+    options(options),
+    maxDelta(options.extended ? MAX_FAR_DELTA : options.window - 1),
+    maxLength(options.extended ? MAX_FAR_LENGTH : MAX_LENGTH)
+  {}
+
+  uint32_t compress(ByteSpan input, std::vector<char>& output, ByteSpan dictionary) {
+    // the dictionary is history that matches can reach back into, but we never encode it
+    window.assign(dictionary.data, dictionary.data + dictionary.size);
+    window.insert(window.end(), input.data, input.data + input.size);
+    start = dictionary.size;
+
+    switch(options.mode) {
+    case COMPRESSION_GREEDY:
+      parseGreedy();
+      break;
+    case COMPRESSION_OPTIMAL:
+      findLongestMatches();
+      parseWeighted(SIZE_FIRST, 1, parse);
+      break;
+    case COMPRESSION_FAST_DECODE:
+      parseFastDecode(options.extraByteBudget);
+      break;
+    }
 
-uint8_t Block::getFlagByte(void) const {
-  return impl->getFlagByte();
-}
+    ParseCost cost = measure(parse);
+    output.reserve(output.size() + cost.bytes);
+    emit(output);
+    return cost.cycles;
+  }
 
-uint16_t Block::sizeIncludingFlagByte(void) const {
-  return impl->sizeIncludingFlagByte();
-}
+private:
+  /* in the parse, a step of length 1 is a literal, with the byte itself stored in delta */
+  static const uint16_t LITERAL = 1;
+  /* the longest a plain LZ command can copy */
+  static const size_t MAX_LENGTH = 255;
+  /* a far match's offset is two bytes, and it can take at most 255 passes of the copy loop */
+  static const size_t MAX_FAR_DELTA = 0xFFFF;
+  static const size_t MAX_FAR_LENGTH = 255 * 256;
+  /* what a far match's length byte is replaced with */
+  static const uint8_t FAR_MATCH = 1;
+  static const uint8_t LONG_FAR_MATCH = 2;
+  static const int COMMANDS_PER_BLOCK = 8;
+  /* a byte weight that makes any saving in size outweigh any saving in cycles */
+  static const uint64_t SIZE_FIRST = uint64_t(1) << 32;
+
+  struct ParseCost {
+    uint32_t bytes;
+    uint32_t cycles;
+  };
+
+  const CompressionOptions options;
+  /* the furthest back a match may reach, and the most it can copy */
+  const size_t maxDelta;
+  const size_t maxLength;
+
+  /* the dictionary followed by the input; only the bytes from start on get encoded */
+  std::vector<char> window;
+  size_t start;
+
+  /* working memory, kept between inputs so that it's only allocated once */
+  std::vector<Match> parse;
+  std::vector<Match> candidate;
+  std::vector<Match> longest;
+  std::vector<Match> nearest;
+  std::vector<int32_t> head;
+  std::vector<int32_t> prev;
+
+  struct State {
+    uint64_t cost;
+    uint16_t stepLength;
+    uint8_t prevSlot;
+  };
+  std::vector<State> states;
+
+  const uint8_t *data(void) const {
+    return reinterpret_cast<const uint8_t*>(window.data());
+  }
 
-uint16_t Block::sizeNoFlagByte(void) const {
-  return impl->sizeNoFlagByte();
-}
+  void emit(std::vector<char>& output) const {
+    size_t flagByte = 0;
+    for (size_t i = 0; i < parse.size(); i++) {
+      if (i % COMMANDS_PER_BLOCK == 0) {
+	flagByte = output.size();
+	output.push_back(0);
+      }
+      const Match& step = parse[i];
+      if (step.length == LITERAL) {
+	/* raise the literal flag */
+	output[flagByte] |= 1 << (i % COMMANDS_PER_BLOCK);
+	output.push_back(step.delta);
+      } else if (isNear(step)) {
+	output.push_back(step.length);
+	output.push_back(-step.delta);
+      } else {
+	unsigned passes = (step.length - 1) / 256 + 1;
+	output.push_back(passes == 1 ? FAR_MATCH : LONG_FAR_MATCH);
+	output.push_back(step.length);
+	if (passes > 1) {
+	  output.push_back(passes);
+	}
+	uint16_t offset = -step.delta;
+	output.push_back(offset);
+	output.push_back(offset >> 8);
+      }
+    }
 
-const char* Block::begin(void) const {
-  return impl->begin();
-}
+    /* the EOF marker takes up a command slot, so if the last block came out full
+       it has to go in a block of its own */
+    if (parse.size() % COMMANDS_PER_BLOCK == 0) {
+      output.push_back(0);
+    }
+    output.push_back(0);
+  }
 
-class CompressorImpl {
-public:
-  CompressorImpl(const std::vector<char>& inputBuffer) : inputBuffer(inputBuffer) {
-    this->i = this->inputBuffer.cbegin();
+  /* whether a match fits in a plain LZ command, rather than needing a far one */
+  static bool isNear(const Match& match) {
+    return match.length <= MAX_LENGTH && match.delta <= MatchFinder::NEAR_DELTA;
+  }
+
+  unsigned matchBytes(const Match& match) const {
+    if (isNear(match)) {
+      return 2;
+    }
+    return match.length <= 256 ? 4 : 5;
+  }
+
+  unsigned matchCycles(const Match& match) const {
+    if (!options.extended) {
+      return DecompressCycles::match(match.length);
+    }
+    if (isNear(match)) {
+      return DecompressXCycles::match(match.length);
+    }
+    return DecompressXCycles::farMatch(match.length);
   }
 
-  bool isDone(void) const {
-    return (this->i == this->inputBuffer.cend());
+  Match literalAt(size_t pos) const {
+    Match literal;
+    literal.length = LITERAL;
+    literal.delta = data()[pos];
+    return literal;
   }
 
-  Block getNextBlock(void) {
-    BlockImpl nextBlock;
+  void parseGreedy(void) {
+    MatchFinder matchFinder(data(), window.size(), maxDelta, maxLength, head, prev);
 
-    while(!nextBlock.isFull() && !this->isDone()) {
-      optional<Match> longestMatch = getNextLongestMatch();
+    parse.clear();
+    size_t i = start;
+    while (i < window.size()) {
+      optional<Match> longestMatch = matchFinder.longestMatchAt(i);
       if (longestMatch) {
-	nextBlock.addMatch(*longestMatch);
+	parse.push_back(*longestMatch);
 	i += longestMatch->length;
       } else {
-	nextBlock.addLiteral(*this->i);
+	parse.push_back(literalAt(i));
 	i++;
       }
     }
+  }
 
-    if(this->isDone()) {
-      nextBlock.addEOF();
+  /* the longest match at every position, and the longest a plain LZ command can reach, or a
+     zero length where there is none */
+  void findLongestMatches(void) {
+    const size_t n = window.size();
+    longest.resize(n);
+    nearest.resize(n);
+    MatchFinder matchFinder(data(), n, maxDelta, maxLength, head, prev);
+    for (size_t pos = start; pos < n; pos++) {
+      optional<Match> near;
+      optional<Match> match = matchFinder.longestMatchAt(pos, &near);
+      longest[pos] = match ? *match : Match{0, 0};
+      nearest[pos] = near ? *near : Match{0, 0};
     }
-
-    return Block(nextBlock);
   }
 
-private:
-  const int COMMANDS_PER_BLOCK = 8;
-  const std::vector<char> inputBuffer;
-  std::vector<char>::const_iterator i;
+  /* a step of the given length from pos, which takes the nearest match that's long enough */
+  Match matchAt(size_t pos, size_t length) const {
+    const Match& match = length <= nearest[pos].length ? nearest[pos] : longest[pos];
+    return Match{uint16_t(length), match.delta};
+  }
 
-  optional<Match> getNextLongestMatch() const {
-    optional<Match> longestMatch;
+  ParseCost measure(const std::vector<Match>& parse) const {
+    ParseCost cost = {0, 0};
+    for (size_t i = 0; i < parse.size(); i++) {
+      if (i % COMMANDS_PER_BLOCK == 0) {
+	cost.bytes += 1;
+	cost.cycles += DecompressCycles::BLOCK;
+      }
+      if (parse[i].length == LITERAL) {
+	cost.bytes += 1;
+	cost.cycles += DecompressCycles::LITERAL;
+      } else {
+	cost.bytes += matchBytes(parse[i]);
+	cost.cycles += matchCycles(parse[i]);
+      }
+    }
+    if (parse.size() % COMMANDS_PER_BLOCK == 0) {
+      cost.bytes += 1;
+      cost.cycles += DecompressCycles::BLOCK;
+    }
+    cost.bytes += 1;
+    cost.cycles += DecompressCycles::END;
+    return cost;
+  }
 
-    /* walk backwards from the read head */
-    for (uint8_t j = 1; this->i - j >= inputBuffer.cbegin(); j++) {
-      uint8_t matchLen;
-
-      /* find the biggest match from this starting point */
-      for(matchLen = 0;
-	  this->i + matchLen < inputBuffer.cend() && *(this->i + matchLen) == *(this->i + matchLen - j);
-	  matchLen++)
-	{
-	  if (matchLen == 255) {
-	    break;
-	  }
+  /* Dynamic programming over (input position, commands already in the current block),
+     minimizing byteWeight * size + cycleWeight * decode cycles. A literal costs one byte and
+     a match two, whichever command starts a block also pays for its flag byte, and the EOF
+     marker at the end counts as a command too. Since any prefix of a match is also a match at
+     the same delta, every length from the minimum up to the longest match at a position is a
+     candidate step - taken from the nearest match long enough, which in the extended format
+     may well be cheaper than the longest one. */
+  void parseWeighted(uint64_t byteWeight, uint64_t cycleWeight, std::vector<Match>& out) {
+    const size_t n = window.size();
+    const uint64_t UNREACHED = UINT64_MAX;
+
+    const uint64_t blockCost = byteWeight + cycleWeight * DecompressCycles::BLOCK;
+    const uint64_t literalCost = byteWeight + cycleWeight * DecompressCycles::LITERAL;
+    const uint64_t endCost = byteWeight + cycleWeight * DecompressCycles::END;
+
+    states.assign((n + 1) * COMMANDS_PER_BLOCK, State{UNREACHED, 0, 0});
+    auto at = [&](size_t pos, int slot) -> State& { return states[pos * COMMANDS_PER_BLOCK + slot]; };
+
+    auto relax = [&](size_t pos, int slot, uint64_t cost, uint16_t stepLength, int prevSlot) {
+      State& state = at(pos, slot);
+      if (cost < state.cost) {
+	state.cost = cost;
+	state.stepLength = stepLength;
+	state.prevSlot = prevSlot;
+      }
+    };
+
+    at(start, 0).cost = 0;
+    for (size_t pos = start; pos < n; pos++) {
+      for (int slot = 0; slot < COMMANDS_PER_BLOCK; slot++) {
+	const State& state = at(pos, slot);
+	if (state.cost == UNREACHED) {
+	  continue;
 	}
-
-      /* update it if this is the best */
-      if ((longestMatch && matchLen > longestMatch->length) ||
-	  (!longestMatch && matchLen > 2))
-	{
-	  longestMatch.emplace();
-	  longestMatch->delta = j; 
-	  longestMatch->length = matchLen;
+	uint64_t base = state.cost + (slot == 0 ? blockCost : 0);
+	int nextSlot = (slot + 1) % COMMANDS_PER_BLOCK;
+
+	relax(pos + 1, nextSlot, base + literalCost, LITERAL, slot);
+	for (size_t len = MatchFinder::MIN_MATCH; len <= longest[pos].length; len++) {
+	  Match match = matchAt(pos, len);
+	  uint64_t matchCost = byteWeight * matchBytes(match) + cycleWeight * matchCycles(match);
+	  relax(pos + len, nextSlot, base + matchCost, len, slot);
 	}
+      }
+    }
 
-      if (j == 255) {
-	break;
+    int bestSlot = 0;
+    uint64_t bestCost = UNREACHED;
+    for (int slot = 0; slot < COMMANDS_PER_BLOCK; slot++) {
+      const State& state = at(n, slot);
+      if (state.cost == UNREACHED) {
+	continue;
+      }
+      uint64_t cost = state.cost + (slot == 0 ? blockCost : 0) + endCost;
+      if (cost < bestCost) {
+	bestCost = cost;
+	bestSlot = slot;
       }
     }
 
-    return longestMatch;
+    /* walk the chosen path backwards, then flip it around */
+    out.clear();
+    size_t pos = n;
+    int slot = bestSlot;
+    while (pos > start) {
+      const State& state = at(pos, slot);
+      pos -= state.stepLength;
+      if (state.stepLength == LITERAL) {
+	out.push_back(literalAt(pos));
+      } else {
+	out.push_back(matchAt(pos, state.stepLength));
+      }
+      slot = state.prevSlot;
+    }
+    std::reverse(out.begin(), out.end());
+  }
+
+  /* Matches are slower to decode than literals until they get about ten bytes long, so the
+     fastest parse to decode is rarely the smallest. Trading cycles against bytes at a rate
+     lambda and searching for the cheapest rate whose parse still fits in the byte budget
+     gives the fastest parse within the budget (up to the granularity of the search). */
+  void parseFastDecode(unsigned extraByteBudget) {
+    findLongestMatches();
+
+    parseWeighted(SIZE_FIRST, 1, parse);
+    const uint32_t byteLimit = measure(parse).bytes + extraByteBudget;
+
+    /* lambda is in 1/LAMBDA_SCALE cycles per byte; past MAX_LAMBDA bytes always win */
+    const uint64_t LAMBDA_SCALE = 16;
+    const uint64_t MAX_LAMBDA = 256 * LAMBDA_SCALE;
+
+    uint64_t lo = 0;
+    uint64_t hi = MAX_LAMBDA;
+    while (lo < hi) {
+      uint64_t lambda = (lo + hi) / 2;
+      parseWeighted(lambda, LAMBDA_SCALE, candidate);
+      if (measure(candidate).bytes <= byteLimit) {
+	hi = lambda;
+	if (measure(candidate).cycles < measure(parse).cycles) {
+	  std::swap(parse, candidate);
+	}
+      } else {
+	lo = lambda + 1;
+      }
+    }
   }
 };
 
-Compressor::Compressor(const std::vector<char>& inputBuffer) : impl(std::make_unique<CompressorImpl>(inputBuffer)) {}
+Compressor::Compressor(const CompressionOptions& options) :
+  impl(std::make_unique<CompressorImpl>(options)) {}
 Compressor::Compressor(Compressor&& compressor) : impl(std::move(compressor.impl)) {}
 Compressor::~Compressor() {}
 
-bool Compressor::isDone(void) const { return impl->isDone(); }
-Block Compressor::getNextBlock(void) { return impl->getNextBlock(); }
+uint32_t Compressor::compress(ByteSpan input, std::vector<char>& output, ByteSpan dictionary) {
+  return impl->compress(input, output, dictionary);
+}
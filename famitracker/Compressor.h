@@ -6,37 +6,113 @@
 #include <vector>
 
 struct Match {
-  uint8_t length;
-  uint8_t delta;
+  uint16_t length;
+  uint16_t delta;
 };
 
-/* we can think of the compressed output as being a sequence of "blocks", with each block
-   containing eight "commands". A command can be either a literal byte or compressed; each command
-   has a corresponding bit in the flag_byte that tells us which (it's 1 if literal or 0 if not) */
-struct BlockImpl;
-class Block {
- public:
-  Block();
-  Block(Block&&);
-  Block(const BlockImpl&);
-  ~Block();
-
-  uint8_t getFlagByte(void) const;
-  uint16_t sizeIncludingFlagByte(void) const;
-  uint16_t sizeNoFlagByte(void) const;
-  const char *begin(void) const;
- private:
-  std::unique_ptr<BlockImpl> impl;
+/* GREEDY always takes the longest match at the read head; OPTIMAL searches every way of
+   parsing the input for the one with the smallest encoded size; FAST_DECODE looks for the
+   parse that Decompress unpacks in the fewest cycles, within a byte budget */
+enum CompressionMode {
+  COMPRESSION_GREEDY,
+  COMPRESSION_OPTIMAL,
+  COMPRESSION_FAST_DECODE
+};
+
+struct CompressionOptions {
+  CompressionOptions() : mode(COMPRESSION_GREEDY), extraByteBudget(0), window(MAX_WINDOW), streaming(false), extended(false), threads(1), lowMemory(false), perChannel(false), waits(false), rowMasks(false), holds(false) {}
+
+  /* an offset is a single byte, so no match can ever reach further back than this - except in
+     the extended format */
+  static const unsigned MAX_WINDOW = 256;
+
+  CompressionMode mode;
+  /* FAST_DECODE only: how many bytes larger than the optimal parse a pattern may get */
+  unsigned extraByteBudget;
+  /* how many bytes of history the decoder keeps - matches (and the dictionary) have to fit
+     in it. The streaming engine only remembers GBSOUND_STREAM_WINDOW bytes. */
+  unsigned window;
+  /* for the streaming engine, which can only decode LZ patterns */
+  bool streaming;
+  /* the extended format (see DecompressX) also has far matches, with two byte offsets and
+     lengths, that can reach anywhere back in the pattern and the dictionary */
+  bool extended;
+  /* how many threads compress patterns (and, in the importer, read ROW lines); the output is the
+     same whatever this is */
+  unsigned threads;
+  /* compress each pattern as soon as it's been read and keep it in a temporary file rather than
+     in memory, so the memory a conversion needs doesn't grow with the song. There's no
+     dictionary then, since that's built from every pattern at once. */
+  bool lowMemory;
+  /* for the per-channel engine: each channel's part of a pattern is compressed on its own, and
+     unpacked right after the last one, so there's no dictionary for any of them to refer to */
+  bool perChannel;
+  /* play each run of empty rows as one wait command. The patterns are smaller before they're
+     compressed, and the engine doesn't have to read the empty rows, but the runs of zeros they
+     replace compress so well that the song usually comes out a little bigger. */
+  bool waits;
+  /* start each row with a mask of the channels that have notes in it, and leave out the rest,
+     for the engine assembled with GBSOUND_ROW_MASK */
+  bool rowMasks;
+  /* merge each run of instrument frames that change nothing into one hold, which the engine
+     assembled with GBSOUND_INSTR_HOLD counts down without reading the instrument */
+  bool holds;
+};
+
+/* What each command costs Decompress (src/decompress.asm), in SM83 machine cycles.
+   BLOCK is reading the flag byte plus the jump back to the top of the loop; a match pays
+   for saving and restoring the read pointer, then ten cycles per byte copied. */
+struct DecompressCycles {
+  static const unsigned BLOCK = 7;
+  static const unsigned LITERAL = 13;
+  static const unsigned END = 12;
+  static unsigned match(unsigned length) { return 29 + 10 * length; }
 };
 
+/* DecompressX spends another four cycles on every match checking whether it's a far one. Far
+   matches go through CopyFarMatch, which costs a call and some shuffling of registers, and
+   three more cycles for every extra 256 bytes copied. */
+struct DecompressXCycles {
+  static unsigned match(unsigned length) { return DecompressCycles::match(length) + 4; }
+  static unsigned farMatch(unsigned length) {
+    unsigned passes = (length - 1) / 256 + 1;
+    return 68 + 10 * length + (passes > 1 ? 1 + 3 * (passes - 1) : 0);
+  }
+};
+
+/* A view of some contiguous bytes owned by someone else */
+struct ByteSpan {
+  ByteSpan() : data(nullptr), size(0) {}
+  ByteSpan(const char *data, size_t size) : data(data), size(size) {}
+  ByteSpan(const std::vector<char>& bytes) : data(bytes.data()), size(bytes.size()) {}
+
+  const char *data;
+  size_t size;
+};
+
+/* we can think of the compressed output as being a sequence of "blocks", with each block
+   containing a flag byte and eight "commands". A command can be either a literal byte or compressed;
+   each command has a corresponding bit in the flag_byte that tells us which (it's 1 if literal or 0
+   if not). The stream ends with a compressed command of length 0.
+
+   A compressed command is a length (3-255) followed by -offset, one byte each. In the extended
+   format, a "length" of 1 or 2 instead starts a far match: 1 for a one byte length (with 0
+   meaning 256), 2 for a two byte one - the low byte, then how many passes of the copy loop that
+   takes, (length - 1) / 256 + 1. Either way -offset follows as two bytes, low byte first.
+
+   A Compressor holds on to its working memory between calls, so once it's warmed up, compressing
+   pattern after pattern with the same one allocates nothing but the room the output grows into. */
 struct CompressorImpl;
 class Compressor {
  public:
-  explicit Compressor(const std::vector<char>&);
+  explicit Compressor(const CompressionOptions& = CompressionOptions());
   Compressor(Compressor&&);
   ~Compressor();
-  Block getNextBlock(void);
-  bool isDone(void) const;
+
+  /* appends the compressed input to output, and returns an estimate of how long Decompress takes
+     to unpack it. The dictionary is treated as if it had been decompressed immediately before the
+     input, so matches can refer back into it. */
+  uint32_t compress(ByteSpan input, std::vector<char>& output, ByteSpan dictionary = ByteSpan());
  private:
   std::unique_ptr<CompressorImpl> impl;
 };
@@ -0,0 +1,87 @@
+#include "Dictionary.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+
+/* strings are scored by the short substrings (d-mers) they contain... */
+static const size_t DMER_LENGTH = 4;
+/* ...and picked a segment at a time */
+static const size_t SEGMENT_LENGTH = 16;
+/* how far into a sample a match can still reach the dictionary */
+static const size_t REACH = 255;
+
+static uint32_t dmerAt(const std::vector<char>& sample, size_t pos) {
+  uint32_t dmer = 0;
+  for (size_t i = 0; i < DMER_LENGTH; i++) {
+    dmer = (dmer << 8) | (uint8_t)sample[pos + i];
+  }
+  return dmer;
+}
+
+std::vector<char> buildDictionary(const std::vector<std::vector<char>>& samples, size_t maxSize) {
+  // count how many samples each d-mer appears in (within reach of the dictionary)
+  std::unordered_map<uint32_t, unsigned> frequency;
+  for (const auto& sample : samples) {
+    std::unordered_set<uint32_t> seen;
+    size_t end = std::min(sample.size(), REACH);
+    for (size_t pos = 0; pos + DMER_LENGTH <= end; pos++) {
+      seen.insert(dmerAt(sample, pos));
+    }
+    for (uint32_t dmer : seen) {
+      frequency[dmer]++;
+    }
+  }
+
+  // greedily take the segment whose not-yet-covered d-mers are shared by the most samples
+  std::vector<std::vector<char>> segments;
+  size_t size = 0;
+  while (size < maxSize) {
+    size_t segmentLength = std::min(SEGMENT_LENGTH, maxSize - size);
+    if (segmentLength < DMER_LENGTH) {
+      break;
+    }
+
+    unsigned bestScore = 0;
+    const std::vector<char> *bestSample = nullptr;
+    size_t bestPos = 0;
+    for (const auto& sample : samples) {
+      size_t end = std::min(sample.size(), REACH);
+      for (size_t pos = 0; pos + segmentLength <= end; pos++) {
+	unsigned score = 0;
+	for (size_t i = pos; i + DMER_LENGTH <= pos + segmentLength; i++) {
+	  auto f = frequency.find(dmerAt(sample, i));
+	  if (f != frequency.end()) {
+	    score += f->second;
+	  }
+	}
+	if (score > bestScore) {
+	  bestScore = score;
+	  bestSample = &sample;
+	  bestPos = pos;
+	}
+      }
+    }
+
+    // a segment nothing else shares is just dead weight
+    unsigned dmersPerSegment = segmentLength - DMER_LENGTH + 1;
+    if (!bestSample || bestScore <= dmersPerSegment) {
+      break;
+    }
+
+    auto first = bestSample->cbegin() + bestPos;
+    segments.emplace_back(first, first + segmentLength);
+    size += segmentLength;
+    for (size_t i = bestPos; i + DMER_LENGTH <= bestPos + segmentLength; i++) {
+      frequency.erase(dmerAt(*bestSample, i));
+    }
+  }
+
+  // the best segments were picked first, and belong closest to the end
+  std::vector<char> dictionary;
+  for (auto segment = segments.crbegin(); segment != segments.crend(); ++segment) {
+    dictionary.insert(dictionary.end(), segment->cbegin(), segment->cend());
+  }
+  return dictionary;
+}
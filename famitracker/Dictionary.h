@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+/* Builds a preset dictionary out of the byte strings that show up in the most samples.
+   Decompress can only reach 255 bytes behind where it's writing, so only the beginning of
+   each sample can ever use the dictionary; the most useful strings go at the end, where
+   they stay within reach the longest. */
+std::vector<char> buildDictionary(const std::vector<std::vector<char>>& samples, size_t maxSize);
@@ -0,0 +1,452 @@
+#include "FtmFile.h"
+
+#include "APUTypes.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <tuple>
+
+static const char FILE_HEADER_ID[] = "FamiTracker Module";
+static const char FILE_END_ID[] = "END";
+static const size_t BLOCK_ID_SIZE = 16;
+
+// FamiTracker 0.4 saves 0x0440; anything from 0.3.7 on lays its blocks out the same way
+static const unsigned MIN_VERSION = 0x0420;
+static const unsigned MAX_VERSION = 0x0440;
+
+static std::string fileError(const std::string& what) {
+  return "Bad FamiTracker module: " + what;
+}
+
+static uint32_t readLittleEndian(const char *data) {
+  const uint8_t *bytes = reinterpret_cast<const uint8_t*>(data);
+  return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+/* One block's data, read from the front; running off the end of it is an error */
+class FtmFile::Block {
+public:
+  Block(std::string_view name, unsigned version, std::string_view data) :
+    name(name), version(version), data(data), pos(0) {}
+
+  std::string_view getName(void) const { return name; }
+  unsigned getVersion(void) const { return version; }
+  bool isDone(void) const { return pos == data.size(); }
+
+  uint8_t readChar(void) {
+    need(1);
+    return data[pos++];
+  }
+
+  int32_t readInt(void) {
+    need(4);
+    int32_t i = readLittleEndian(data.data() + pos);
+    pos += 4;
+    return i;
+  }
+
+  // FamiTracker's strings are either in a fixed size field or end with a NUL
+  std::string readString(size_t size) {
+    need(size);
+    std::string_view field = data.substr(pos, size);
+    pos += size;
+    return std::string(field.substr(0, field.find('\0')));
+  }
+
+  std::string readString(void) {
+    size_t end = data.find('\0', pos);
+    if (end == std::string_view::npos) {
+      tooShort();
+    }
+    std::string s(data.substr(pos, end - pos));
+    pos = end + 1;
+    return s;
+  }
+
+  void skip(size_t size) {
+    need(size);
+    pos += size;
+  }
+
+  // a count or an index read from the file, checked before anything's sized by it
+  int readCount(int min, int max, const char *what) {
+    return check(readInt(), min, max, what);
+  }
+
+  int check(int value, int min, int max, const char *what) const {
+    if (value < min || value > max) {
+      std::ostringstream err;
+      err << what << " " << value << " out of range in " << name << " block";
+      throw fileError(err.str());
+    }
+    return value;
+  }
+
+  void checkVersion(unsigned min, unsigned max) const {
+    if (version < min || version > max) {
+      std::ostringstream err;
+      err << "unsupported " << name << " block version " << version;
+      throw fileError(err.str());
+    }
+  }
+private:
+  std::string_view name;
+  unsigned version;
+  std::string_view data;
+  size_t pos;
+
+  void need(size_t size) const {
+    if (data.size() - pos < size) {
+      tooShort();
+    }
+  }
+
+  [[noreturn]] void tooShort(void) const {
+    throw fileError(std::string(name) + " block is cut short");
+  }
+};
+
+bool FtmCell::isEmpty(void) const {
+  if (note != NONE || instrument != MAX_INSTRUMENTS || volume != MAX_VOLUME) {
+    return false;
+  }
+  return std::all_of(effects, effects + MAX_EFFECT_COLUMNS, [](uint8_t effect) { return effect == EF_NONE; });
+}
+
+const std::vector<FtmCell> *FtmTrack::getPattern(int channel, int pattern) const {
+  const auto& rows = patterns.at(channel * MAX_PATTERN + pattern);
+  return rows.empty() ? nullptr : &rows;
+}
+
+bool FtmFile::isFtm(std::string_view data) {
+  return data.substr(0, strlen(FILE_HEADER_ID)) == FILE_HEADER_ID;
+}
+
+FtmFile::FtmFile(std::string_view data) :
+  expansionChip(SNDCHIP_NONE), channelCount(0), machine(NTSC), engineSpeed(0), speedSplitPoint(0),
+  n163Channels(0), sampleCount(0)
+{
+  if (!isFtm(data)) {
+    throw fileError("no FamiTracker Module header");
+  }
+  size_t pos = strlen(FILE_HEADER_ID);
+  if (data.size() - pos < 4) {
+    throw fileError("file is cut short");
+  }
+  unsigned fileVersion = readLittleEndian(data.data() + pos);
+  pos += 4;
+  if (fileVersion < MIN_VERSION || fileVersion > MAX_VERSION) {
+    std::ostringstream err;
+    err << "unsupported version " << std::hex << fileVersion << "; save it with FamiTracker 0.4";
+    throw fileError(err.str());
+  }
+
+  bool seenParams = false;
+  for (;;) {
+    if (data.substr(pos, strlen(FILE_END_ID)) == FILE_END_ID) {
+      break;
+    }
+    if (data.size() - pos < BLOCK_ID_SIZE + 8) {
+      throw fileError("file is cut short");
+    }
+    std::string_view name = data.substr(pos, BLOCK_ID_SIZE);
+    name = name.substr(0, name.find('\0'));
+    unsigned version = readLittleEndian(data.data() + pos + BLOCK_ID_SIZE);
+    size_t size = readLittleEndian(data.data() + pos + BLOCK_ID_SIZE + 4);
+    pos += BLOCK_ID_SIZE + 8;
+    if (data.size() - pos < size) {
+      throw fileError(std::string(name) + " block is cut short");
+    }
+    Block block(name, version, data.substr(pos, size));
+    pos += size;
+
+    // everything after PARAMS depends on how many channels it says there are
+    if (name != "PARAMS" && !seenParams) {
+      throw fileError(std::string(name) + " block before PARAMS");
+    }
+
+    if (name == "PARAMS") {
+      readParams(block);
+      seenParams = true;
+    } else if (name == "INFO") {
+      readInfo(block);
+    } else if (name == "HEADER") {
+      readHeader(block);
+    } else if (name == "INSTRUMENTS") {
+      readInstruments(block);
+    } else if (name == "SEQUENCES") {
+      readSequences(block, SNDCHIP_NONE);
+    } else if (name == "SEQUENCES_VRC6") {
+      readSequences(block, SNDCHIP_VRC6);
+    } else if (name == "SEQUENCES_N163") {
+      readSequences(block, SNDCHIP_N163);
+    } else if (name == "SEQUENCES_S5B") {
+      readSequences(block, SNDCHIP_S5B);
+    } else if (name == "FRAMES") {
+      readFrames(block);
+    } else if (name == "PATTERNS") {
+      readPatterns(block);
+    } else if (name == "DSAMPLES") {
+      readSamples(block);
+    } else if (name == "COMMENTS") {
+      // nothing the Game Boy needs
+    } else {
+      throw fileError("unknown block " + std::string(name));
+    }
+  }
+
+  if (tracks.empty()) {
+    throw fileError("no HEADER block");
+  }
+
+  // the text export lists them this way, and the importer meets them in the same order
+  std::stable_sort(sequences.begin(), sequences.end(), [](const FtmSequence& a, const FtmSequence& b) {
+    return std::make_tuple(a.chip, a.type, a.index) < std::make_tuple(b.chip, b.type, b.index);
+  });
+}
+
+void FtmFile::readParams(Block& block) {
+  block.checkVersion(2, 6);
+  expansionChip = block.readChar();
+  channelCount = block.readCount(1, MAX_CHANNELS, "channel count");
+  machine = block.readInt();
+  engineSpeed = block.readInt();
+  if (block.getVersion() >= 3) {
+    // vibrato style
+    block.readInt();
+  }
+  if (block.getVersion() >= 4) {
+    // row highlights
+    block.readInt();
+    block.readInt();
+  }
+  // FamiTracker does the same; some files have the expansion chip set to $FF
+  if (channelCount == CHANNELS_DEFAULT) {
+    expansionChip = SNDCHIP_NONE;
+  }
+  if (block.getVersion() >= 5 && (expansionChip & SNDCHIP_N163)) {
+    n163Channels = block.readInt();
+  }
+  if (block.getVersion() >= 6) {
+    speedSplitPoint = block.readInt();
+  }
+}
+
+void FtmFile::readInfo(Block& block) {
+  block.checkVersion(1, 1);
+  title = block.readString(32);
+  author = block.readString(32);
+  copyright = block.readString(32);
+}
+
+void FtmFile::readHeader(Block& block) {
+  block.checkVersion(2, 3);
+  int trackCount = block.readChar() + 1;
+  tracks.resize(trackCount);
+  if (block.getVersion() >= 3) {
+    for (int i = 0; i < trackCount; i++) {
+      // the track's name
+      block.readString();
+    }
+  }
+  for (auto& track : tracks) {
+    track.extraEffectColumns.resize(channelCount);
+    track.patterns.resize(channelCount * MAX_PATTERN);
+  }
+  for (int channel = 0; channel < channelCount; channel++) {
+    // which chip's channel it is
+    block.readChar();
+    for (auto& track : tracks) {
+      track.extraEffectColumns[channel] = block.check(block.readChar(), 0, MAX_EFFECT_COLUMNS - 1, "effect column count");
+    }
+  }
+}
+
+void FtmFile::readInstruments(Block& block) {
+  block.checkVersion(2, 6);
+  int count = block.readCount(0, MAX_INSTRUMENTS, "instrument count");
+  for (int i = 0; i < count; i++) {
+    FtmInstrument instrument;
+    instrument.index = block.readCount(0, MAX_INSTRUMENTS - 1, "instrument");
+    instrument.type = (FtmInstrument::Type)block.readChar();
+    instrument.hasSamples = false;
+    instrument.waveSize = 0;
+    instrument.wavePos = 0;
+    std::fill(instrument.sequences, instrument.sequences + SEQ_COUNT, -1);
+
+    switch (instrument.type) {
+    case FtmInstrument::INST_2A03:
+    case FtmInstrument::INST_VRC6:
+    case FtmInstrument::INST_N163:
+    case FtmInstrument::INST_S5B: {
+      int sequenceCount = block.readCount(0, SEQ_COUNT, "sequence count");
+      for (int s = 0; s < sequenceCount; s++) {
+	bool enabled = block.readChar();
+	int index = block.check(block.readChar(), 0, MAX_SEQUENCES - 1, "sequence");
+	instrument.sequences[s] = enabled ? index : -1;
+      }
+      break;
+    }
+    case FtmInstrument::INST_VRC7:
+      // the patch, and the custom patch's registers
+      block.readInt();
+      block.skip(8);
+      break;
+    default:
+      // there's no telling how big it is, so this is as far as we can go - but the importer
+      // turns down the module as soon as it gets to this instrument anyway
+      instruments.push_back(instrument);
+      return;
+    }
+
+    if (instrument.type == FtmInstrument::INST_2A03) {
+      for (int key = 0; key < OCTAVE_RANGE * NOTE_RANGE; key++) {
+	uint8_t sample = block.readChar();
+	// pitch and, in later versions, the delta counter's starting value
+	block.skip(block.getVersion() > 5 ? 2 : 1);
+	if (sample) {
+	  instrument.hasSamples = true;
+	}
+      }
+    } else if (instrument.type == FtmInstrument::INST_N163) {
+      instrument.waveSize = block.readCount(0, 256, "wave size");
+      instrument.wavePos = block.readInt();
+      int waveCount = block.readCount(0, 64, "wave count");
+      instrument.waves.resize(waveCount);
+      for (auto& wave : instrument.waves) {
+	for (int sample = 0; sample < instrument.waveSize; sample++) {
+	  wave.push_back(block.readChar());
+	}
+      }
+    }
+
+    // the instrument's name
+    int nameSize = block.readCount(0, 256, "instrument name length");
+    block.skip(nameSize);
+
+    instruments.push_back(instrument);
+  }
+
+  std::stable_sort(instruments.begin(), instruments.end(), [](const FtmInstrument& a, const FtmInstrument& b) {
+    return a.index < b.index;
+  });
+}
+
+void FtmFile::readSequences(Block& block, uint8_t chip) {
+  // N163 and S5B sequences have always had their release point and setting alongside them;
+  // the others have had them in a few different places over the years
+  bool settingsInline = chip == SNDCHIP_N163 || chip == SNDCHIP_S5B || block.getVersion() == 4;
+  if (chip == SNDCHIP_N163 || chip == SNDCHIP_S5B) {
+    block.checkVersion(1, 1);
+  } else {
+    block.checkVersion(3, 6);
+  }
+
+  size_t first = sequences.size();
+  int count = block.readCount(0, MAX_SEQUENCES * SEQ_COUNT, "sequence count");
+  for (int i = 0; i < count; i++) {
+    FtmSequence sequence;
+    sequence.chip = chip;
+    sequence.index = block.readCount(0, MAX_SEQUENCES - 1, "sequence");
+    sequence.type = block.readCount(0, SEQ_COUNT - 1, "sequence type");
+    int length = block.readChar();
+    sequence.loopPoint = block.readInt();
+    // FamiTracker has the same work-around, for some older files
+    if (sequence.loopPoint == length) {
+      sequence.loopPoint = -1;
+    }
+    sequence.releasePoint = -1;
+    sequence.setting = 0;
+    if (settingsInline) {
+      sequence.releasePoint = block.readInt();
+      sequence.setting = block.readInt();
+    }
+    for (int item = 0; item < length; item++) {
+      sequence.items.push_back(block.readChar());
+    }
+    sequences.push_back(sequence);
+  }
+
+  if (!settingsInline && block.getVersion() == 5) {
+    // version 5 saved them for every sequence there could be, in a table of their own
+    for (int index = 0; index < MAX_SEQUENCES; index++) {
+      for (int type = 0; type < SEQ_COUNT; type++) {
+	int releasePoint = block.readInt();
+	int setting = block.readInt();
+	for (size_t i = first; i < sequences.size(); i++) {
+	  if (sequences[i].index == index && sequences[i].type == type) {
+	    sequences[i].releasePoint = releasePoint;
+	    sequences[i].setting = setting;
+	  }
+	}
+      }
+    }
+  } else if (!settingsInline && block.getVersion() >= 6) {
+    for (size_t i = first; i < sequences.size(); i++) {
+      sequences[i].releasePoint = block.readInt();
+      sequences[i].setting = block.readInt();
+    }
+  }
+}
+
+void FtmFile::readFrames(Block& block) {
+  block.checkVersion(3, 3);
+  for (auto& track : tracks) {
+    int frameCount = block.readCount(1, MAX_FRAMES, "frame count");
+    track.speed = block.readInt();
+    track.tempo = block.readInt();
+    track.patternLength = block.readCount(1, MAX_PATTERN_LENGTH, "pattern length");
+    track.frames.resize(frameCount);
+    for (auto& frame : track.frames) {
+      for (int channel = 0; channel < channelCount; channel++) {
+	frame.push_back(block.check(block.readChar(), 0, MAX_PATTERN - 1, "pattern"));
+      }
+    }
+  }
+}
+
+void FtmFile::readPatterns(Block& block) {
+  block.checkVersion(2, 5);
+  while (!block.isDone()) {
+    int trackIndex = block.readCount(0, tracks.size() - 1, "track");
+    int channel = block.readCount(0, channelCount - 1, "channel");
+    int pattern = block.readCount(0, MAX_PATTERN - 1, "pattern");
+    int items = block.readCount(0, MAX_PATTERN_LENGTH, "row count");
+
+    FtmTrack& track = tracks[trackIndex];
+    auto& rows = track.patterns[channel * MAX_PATTERN + pattern];
+    if (rows.empty()) {
+      rows.resize(MAX_PATTERN_LENGTH);
+    }
+    for (int i = 0; i < items; i++) {
+      FtmCell& cell = rows[block.readCount(0, MAX_PATTERN_LENGTH - 1, "row")];
+      cell.note = block.readChar();
+      cell.octave = block.readChar();
+      cell.instrument = block.readChar();
+      cell.volume = block.readChar();
+      for (int column = 0; column <= track.extraEffectColumns[channel]; column++) {
+	cell.effects[column] = block.readChar();
+	cell.params[column] = block.readChar();
+      }
+      // FamiTracker does this too
+      if (cell.volume > MAX_VOLUME) {
+	cell.volume &= 0x0F;
+      }
+    }
+  }
+
+  // a pattern can be written down with nothing in it
+  for (auto& track : tracks) {
+    for (auto& rows : track.patterns) {
+      if (std::all_of(rows.begin(), rows.end(), [](const FtmCell& cell) { return cell.isEmpty(); })) {
+	rows = std::vector<FtmCell>();
+      }
+    }
+  }
+}
+
+void FtmFile::readSamples(Block& block) {
+  block.checkVersion(1, 1);
+  sampleCount = block.readChar();
+}
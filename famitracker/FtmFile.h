@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "FamiTrackerTypes.h"
+
+/* A module in FamiTracker's own binary format (.ftm), as saved by FamiTracker 0.4. The file is
+   a header followed by blocks - PARAMS, INFO, HEADER, INSTRUMENTS, SEQUENCES, FRAMES, PATTERNS
+   and so on - each with a name, a version and a size. This only reads what's there; it's the
+   Importer that decides what the Game Boy can make of it, just as it does with a text export. */
+
+struct FtmSequence {
+  uint8_t chip;
+  int type;
+  int index;
+  int loopPoint;
+  int releasePoint;
+  int setting;
+  std::vector<int8_t> items;
+};
+
+struct FtmInstrument {
+  // INST_2A03 and so on
+  enum Type {
+    INST_NONE,
+    INST_2A03,
+    INST_VRC6,
+    INST_VRC7,
+    INST_FDS,
+    INST_N163,
+    INST_S5B
+  };
+
+  int index;
+  Type type;
+  // -1 for a sequence that's switched off
+  int sequences[SEQ_COUNT];
+  // 2A03 only: whether any key plays a DPCM sample
+  bool hasSamples;
+  // N163 only
+  int waveSize;
+  int wavePos;
+  std::vector<std::vector<uint8_t>> waves;
+};
+
+struct FtmCell {
+  FtmCell() : note(NONE), octave(0), instrument(MAX_INSTRUMENTS), volume(MAX_VOLUME), effects{}, params{} {}
+
+  bool isEmpty(void) const;
+
+  uint8_t note;
+  uint8_t octave;
+  uint8_t instrument;
+  uint8_t volume;
+  uint8_t effects[MAX_EFFECT_COLUMNS];
+  uint8_t params[MAX_EFFECT_COLUMNS];
+};
+
+struct FtmTrack {
+  int patternLength;
+  int speed;
+  int tempo;
+  // how many effect columns each channel has, less the one it always has
+  std::vector<int> extraEffectColumns;
+  // the pattern each channel plays in each frame
+  std::vector<std::vector<uint8_t>> frames;
+  // channel * MAX_PATTERN + pattern; a pattern that was never written to is left empty
+  std::vector<std::vector<FtmCell>> patterns;
+
+  /* nullptr if the pattern has nothing in it */
+  const std::vector<FtmCell> *getPattern(int channel, int pattern) const;
+};
+
+class FtmFile {
+ public:
+  /* reads the whole module; throws a string if it isn't one, or is damaged */
+  explicit FtmFile(std::string_view data);
+
+  static bool isFtm(std::string_view data);
+
+  const std::string& getTitle(void) const { return title; }
+  const std::string& getAuthor(void) const { return author; }
+  const std::string& getCopyright(void) const { return copyright; }
+  uint8_t getExpansionChip(void) const { return expansionChip; }
+  int getChannelCount(void) const { return channelCount; }
+  int getMachine(void) const { return machine; }
+  int getEngineSpeed(void) const { return engineSpeed; }
+  int getSpeedSplitPoint(void) const { return speedSplitPoint; }
+  int getN163Channels(void) const { return n163Channels; }
+  // every sequence with something in it, for each chip, by type and then by number
+  const std::vector<FtmSequence>& getSequences(void) const { return sequences; }
+  // in order of their numbers
+  const std::vector<FtmInstrument>& getInstruments(void) const { return instruments; }
+  int getSampleCount(void) const { return sampleCount; }
+  const std::vector<FtmTrack>& getTracks(void) const { return tracks; }
+ private:
+  class Block;
+
+  void readParams(Block&);
+  void readInfo(Block&);
+  void readHeader(Block&);
+  void readInstruments(Block&);
+  void readSequences(Block&, uint8_t chip);
+  void readFrames(Block&);
+  void readPatterns(Block&);
+  void readSamples(Block&);
+
+  std::string title;
+  std::string author;
+  std::string copyright;
+  uint8_t expansionChip;
+  int channelCount;
+  int machine;
+  int engineSpeed;
+  int speedSplitPoint;
+  int n163Channels;
+  std::vector<FtmSequence> sequences;
+  std::vector<FtmInstrument> instruments;
+  int sampleCount;
+  std::vector<FtmTrack> tracks;
+};
@@ -22,16 +22,22 @@
 
 #include "APUTypes.h"
 #include "FamiTrackerTypes.h"
+#include "FtmFile.h"
 #include "hash.h"
+#include "ThreadPool.h"
 
+#include <algorithm>
+#include <array>
 #include <cstdio>
-#include <fstream>
+#include <cstring>
 #include <iostream>
 #include <math.h>
 #include <strings.h>
 #include <sstream>
+#include <string_view>
 #include <tuple>
 #include <unordered_map>
+#include <vector>
 
 const bool debug = false;
 
@@ -192,6 +198,7 @@ struct Effect {
 
 class Cell {
 public:
+  Cell() : note(0, 0), instrumentId(MAX_INSTRUMENTS), effect{EFFECT_NO_EFFECT, 0} {}
   Cell(Note note, int instrumentId, Effect effect) :
     note(note), instrumentId(instrumentId), effect(effect)
   {}
@@ -247,59 +254,48 @@ class InstrSequence {
 
 const InstrSequence InstrSequence::emptySequence = InstrSequence();
 
-class ImporterImpl {
-public:
-  ImporterImpl(const std::string& text) :
-    isExpired(false), t(text), track(0), patternNumber(-1), hasN163(false),
-    lastWaveRead(-1)
-  {}
+static bool isCommand(std::string_view token, Command c) {
+  return token.size() == strlen(CT[c]) && 0 == strncasecmp(token.data(), CT[c], token.size());
+}
 
-  Song runImport(void) {
-    if(isExpired) {
-      throw std::logic_error("Cannot run the same Importer multiple times");
-    }
-    isExpired = true;
+// a ROW line read ahead of time, by one of the threads reading them in parallel
+struct ParsedRow {
+  explicit ParsedRow(size_t position) : position(position), ok(false), channelCount(0) {}
+
+  // where the line carries on after its ROW command
+  size_t position;
+  // if reading it threw, the importer reads it again itself, to report why
+  bool ok;
+  int channelCount;
+  // only the Game Boy channels' cells are kept
+  Cell cells[N163_INDEX + 1];
+};
 
-    // parse the file
-    while (!t.finished()) {
-      // read first token on line
-      if (t.isEOL()) {
-	continue; // blank line
-      }
-    
-      std::string command = t.readToken();
-      Command c = getCommandEnum(command);
+/* Reads cells - and the other little bits of syntax the importer shares with them - from a
+   tokenizer. The importer reads with its own; reading ROW lines in parallel, each thread has
+   one over the same text. */
+class CellReader {
+public:
+  explicit CellReader(Tokenizer& t) : t(t), channel(0) {}
 
-      importCommand(c);
+  // reads the rest of a ROW line, keeping the Game Boy channels' cells; the importer checks it
+  // has the right number of channels when it gets to the line
+  void readRow(ParsedRow& row) {
+    t.readHex(0, MAX_PATTERN_LENGTH - 1);
+    for (channel = 0; !t.isEOL(); channel++) {
+      checkColon();
+      Cell cell = importCell();
+      if (channel <= N163_INDEX) {
+	row.cells[channel] = cell;
+      }
     }
-
-    this->pattern.terminate();
-    song.addPattern(this->pattern);
-
-    return std::move(song);
+    row.channelCount = channel;
   }
 
-private:
-  bool isExpired;
-  Tokenizer t;
-  unsigned int track;
-  // this is used both to track the current pattern we're on as we read orders
-  // and also to track the pattern we're on as we read patterns
-  PatternNumber patternNumber;
-  Pattern pattern;
-  std::unordered_map<PatternNumber, PatternNumber> jumps;
+protected:
+  Tokenizer& t;
+  // the channel of the cell being read
   int channel;
-  uint8_t currentInstruments[6]; // two dummy channels, one for triangle, one for DPCM
-  bool hasN163;
-  std::unordered_map<InstrSequenceIndex, InstrSequence> instrSequenceTable;
-  Song song;
-  uint8_t speedSplitPoint;
-  enum {
-    IMPORTING_ORDERS,
-    IMPORTING_PATTERNS
-  } state;
-  std::unordered_map<int, int> waveForInstrument;
-  int lastWaveRead;
 
   std::stringstream makeError() const {
     std::stringstream errMsg;
@@ -308,7 +304,7 @@ private:
   }
   
   void ignoreVolId() {
-    std::string sVol = t.readToken();
+    std::string_view sVol = t.readToken();
 
     if(sVol != ".") {
       auto err = makeError();
@@ -317,7 +313,7 @@ private:
     }
   }
   
-  int getInstrumentId(const std::string& sInst) const {
+  int getInstrumentId(std::string_view sInst) const {
     if (sInst.size() != 2) {
       auto errMsg = makeError();
       errMsg << "column should be 2 characters wide, '" << sInst << "' found.";
@@ -338,7 +334,7 @@ private:
   }
 
   Note readNote() {
-    std::string sNote = t.readToken();
+    std::string_view sNote = t.readToken();
     if (sNote.size() != 3) {
       auto errMsg = makeError();
       errMsg << "note column should be 3 characters wide, '" << sNote << "' found.";
@@ -366,7 +362,7 @@ private:
       throw errMsg;
     } else {
       int n;
-      switch (sNote.at(0)) {
+      switch (sNote[0]) {
       case 'c': case 'C': n = 0; break;
       case 'd': case 'D': n = 2; break;
       case 'e': case 'E': n = 4; break;
@@ -380,7 +376,7 @@ private:
 	throw errMsg;
       }
 
-      switch (sNote.at(1)) {
+      switch (sNote[1]) {
       case '-': case '.': break;
       case '#': case '+': n += 1; break;
       case 'b': case 'f': n -= 1; break;
@@ -393,7 +389,7 @@ private:
       while (n <   0) n += 12;
       while (n >= 12) n -= 12;
 
-      int o = sNote.at(2) - '0';
+      int o = sNote[2] - '0';
       if (o < 0 || o >= OCTAVE_RANGE) {
 	auto errMsg = makeError();
 	errMsg << "unrecognized octave '" << sNote << "'.";
@@ -404,8 +400,8 @@ private:
     }
   }
 
-  std::string readEffectColumn(void) {
-    std::string effectColumn = t.readToken();
+  std::string_view readEffectColumn(void) {
+    std::string_view effectColumn = t.readToken();
     
     if (effectColumn.size() != 3) {
       auto errMsg = makeError();
@@ -416,8 +412,8 @@ private:
     return effectColumn;
   }
 
-  EffectType getEffectType(const std::string& effectColumn) const {
-    char c = toupper(effectColumn.at(0));
+  EffectType getEffectType(std::string_view effectColumn) const {
+    char c = toupper(effectColumn[0]);
     for (int i = 0; i < EF_COUNT; i++) {
       if (EFF_CHAR[i] == c) {
 	return effectTypeOfId(i);
@@ -432,7 +428,7 @@ private:
   Effect readEffect(void) {
     Effect effect;
 
-    std::string effectColumn = readEffectColumn();
+    std::string_view effectColumn = readEffectColumn();
     if (effectColumn == "...") {
       effect.type = EFFECT_NO_EFFECT;
     } else {
@@ -455,15 +451,12 @@ private:
   }
 
   int hexCharVal(char c) const {
-    const char HEX_TEXT[16] = {
-      '0', '1', '2', '3', '4', '5', '6', '7',
-      '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
-    };
-
-    for (int i = 0; i < 16; i++) {
-      if (toupper(c) == HEX_TEXT[i]) {
-	return i;
-      }
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    }
+    char upper = toupper(c);
+    if (upper >= 'A' && upper <= 'F') {
+      return upper - 'A' + 10;
     }
 
     auto errMsg = makeError();
@@ -471,19 +464,278 @@ private:
     throw errMsg;
   }
 
-  int importHex(const std::string& sToken) const {
+  int importHex(std::string_view sToken) const {
     int n = 0;
     for (size_t i = 0; i < sToken.size(); i++) {
       n <<= 4;
-      n += hexCharVal(sToken.at(i));
+      n += hexCharVal(sToken[i]);
     }
 
     return n;
   }
-  
-  Command getCommandEnum(const std::string& command) const {
+
+  void checkColon(void) {
+    checkSymbol(":");
+  }
+    
+  void checkSymbol(std::string_view x) {
+    std::string_view symbol = t.readToken();
+    if (symbol != x) {
+      auto errMsg = makeError();
+      errMsg << "expected '" << x << "', '" << symbol << "' found.";
+      throw errMsg;
+    }
+  }
+};
+
+class ImporterImpl : private CellReader {
+public:
+  ImporterImpl(SourceFile source_) :
+    CellReader(tokenizer), isExpired(false), source(std::move(source_)), tokenizer(source.getText()),
+    track(0), patternNumber(-1), hasN163(false), threads(1), lowMemory(false), perChannel(false), patternLength(0),
+    ftmPart("Module"), ftmNumber(-1), ftmRow(-1), ftmTrackNumber(-1), checkErrors(nullptr), nextParsedRow(0)
+  {
+    // no instrument yet, so every channel's first note sets one
+    memset(currentInstruments, 0xFF, sizeof currentInstruments);
+  }
+
+  Song runImport(void) {
+    startImport();
+
+    if (ftm) {
+      importFtm();
+    } else {
+      // parse the file
+      while (!t.finished()) {
+	importLine();
+      }
+    }
+
+    finishImport();
+    song.compressPatterns();
+
+    return std::move(song);
+  }
+
+  /* Goes through the whole file, but rather than stopping at the first error, skips the rest
+     of the line it's on and carries on, so every problem gets reported in one go. Nothing's
+     compressed. */
+  std::vector<std::string> runCheck(void) {
+    std::vector<std::string> errors;
+    try {
+      startImport();
+    } catch (const std::string& err) {
+      // a damaged binary module can't be read any further
+      errors.push_back(err);
+      return errors;
+    }
+
+    if (ftm) {
+      // a binary module's checked a part at a time instead
+      checkErrors = &errors;
+      importFtm();
+    } else {
+      while (!t.finished()) {
+	int line = t.getLine();
+	try {
+	  importLine();
+	} catch (...) {
+	  errors.push_back(describeError(lineLocation(line)));
+	  // some errors only turn up once the line's been read to the end
+	  if (t.getLine() == line) {
+	    t.finishLine();
+	  }
+	}
+      }
+    }
+
+    try {
+      finishImport();
+    } catch (...) {
+      errors.push_back(describeError(ftm ? ftmLocation() : lineLocation(t.getLine())));
+    }
+
+    return errors;
+  }
+
+  void setCompressionOptions(const CompressionOptions& options) {
+    song.setCompressionOptions(options);
+    threads = options.threads;
+    lowMemory = options.lowMemory;
+    perChannel = options.perChannel;
+  }
+
+private:
+  void startImport(void) {
+    if(isExpired) {
+      throw std::logic_error("Cannot run the same Importer multiple times");
+    }
+    isExpired = true;
+
+    if (FtmFile::isFtm(source.getText())) {
+      ftm.emplace(source.getText());
+      return;
+    }
+
+    // reading ahead keeps every row in memory at once
+    if (threads > 1 && !lowMemory) {
+      readRowsAhead();
+    }
+  }
+
+  void importLine(void) {
+    // read first token on line
+    if (t.isEOL()) {
+      return; // blank line
+    }
+
+    std::string_view command = t.readToken();
+    Command c = getCommandEnum(command);
+
+    importCommand(c);
+  }
+
+  void finishImport(void) {
+    if (track == 0) {
+      auto errMsg = makeError();
+      errMsg << "no TRACK defined.";
+      throw errMsg;
+    }
+    finishTrack();
+
+    // the instruments came before their waves did, so only now can they say where they are
+    for(const auto& instrumentWaves : wavesForInstrument) {
+      song.setInstrumentWaves(instrumentWaves.first, instrumentWaves.second);
+    }
+  }
+
+  // the message for the error being handled; the song's own don't say where they happened
+  static std::string describeError(const std::string& location) {
+    std::string message;
+    try {
+      throw;
+    } catch (const std::stringstream& err) {
+      return err.str();
+    } catch (const std::string& err) {
+      message = err;
+    } catch (const char *err) {
+      message = err;
+    } catch (const std::exception& err) {
+      message = err.what();
+    }
+    if (message.compare(0, 5, "Line ") == 0) {
+      return message;
+    }
+    return location + ": " + message;
+  }
+
+  static std::string lineLocation(int line) {
+    std::ostringstream location;
+    location << "Line " << line;
+    return location.str();
+  }
+
+  // errors in a binary module say which part of it they're in, rather than where on a line
+  std::stringstream makeError() const {
+    if (!ftm) {
+      return CellReader::makeError();
+    }
+    std::stringstream errMsg;
+    errMsg << ftmLocation() << ": ";
+    return errMsg;
+  }
+
+  [[noreturn]] void unsupported(const char *feature) const {
+    auto err = makeError();
+    err << feature << " not supported on the Game Boy.";
+    throw err;
+  }
+
+  bool isExpired;
+  // the tokenizer reads the source in place, so it has to come first
+  SourceFile source;
+  Tokenizer tokenizer;
+  unsigned int track;
+  // this is used both to track the current pattern we're on as we read orders
+  // and also to track the pattern we're on as we read patterns
+  PatternNumber patternNumber;
+  Pattern pattern;
+  std::unordered_map<PatternNumber, PatternNumber> jumps;
+  uint8_t currentInstruments[6]; // two dummy channels, one for triangle, one for DPCM
+  bool hasN163;
+  std::unordered_map<InstrSequenceIndex, InstrSequence> instrSequenceTable;
+  Song song;
+  uint8_t speedSplitPoint;
+  enum {
+    IMPORTING_ORDERS,
+    IMPORTING_PATTERNS
+  } state;
+  // where each N163 instrument's waves ended up in the song's wave table
+  std::unordered_map<int, std::vector<uint8_t>> wavesForInstrument;
+  unsigned threads;
+  bool lowMemory;
+  /* In per-channel mode, each channel's patterns go into the song separately, and a frame can
+     have its channels play different ones. Nothing's added until the end of the track: these
+     are the rows of each channel's patterns (by Game Boy channel, and then pattern number), and
+     the patterns each frame plays, as they're read. */
+  bool perChannel;
+  int patternLength;
+  std::vector<Cell> channelCells[GB_CHANNEL_COUNT][MAX_PATTERN];
+  std::vector<std::array<uint8_t, GB_CHANNEL_COUNT>> frames;
+  // set if the module's a binary one
+  optional<FtmFile> ftm;
+  // where the import of a binary module has got to: what it's reading, which one, and in a
+  // pattern, which row (the channel's the one being read)
+  const char *ftmPart;
+  int ftmNumber;
+  int ftmRow;
+  // the track whose frames and patterns are being read, if there's more than one
+  int ftmTrackNumber;
+  // while checking a binary module, where its errors go
+  std::vector<std::string> *checkErrors;
+  // every ROW line in the file, in order, if they were read ahead
+  std::vector<ParsedRow> parsedRows;
+  size_t nextParsedRow;
+
+  // The ROW lines are nearly all of a module, and what's in one only depends on where it is, so
+  // they can all be read at once: a quick pass finds them, and then each pattern's are read on
+  // a thread of their own. importRow picks them up from there as it gets to them.
+  void readRowsAhead(void) {
+    Tokenizer index(source.getText());
+    std::vector<size_t> patternStarts(1, 0);
+    while (!index.finished()) {
+      if (index.isEOL()) {
+	continue;
+      }
+      std::string_view command = index.readToken();
+      if (isCommand(command, CT_PATTERN)) {
+	patternStarts.push_back(parsedRows.size());
+      } else if (isCommand(command, CT_ROW)) {
+	parsedRows.emplace_back(index.getPosition());
+      }
+      index.finishLine();
+    }
+    patternStarts.push_back(parsedRows.size());
+
+    ThreadPool pool(threads);
+    pool.forEach(patternStarts.size() - 1, [&](unsigned, size_t pattern) {
+      Tokenizer tokens(source.getText());
+      CellReader reader(tokens);
+      for (size_t i = patternStarts[pattern]; i < patternStarts[pattern + 1]; i++) {
+	tokens.seek(parsedRows[i].position);
+	try {
+	  reader.readRow(parsedRows[i]);
+	  parsedRows[i].ok = true;
+	} catch (...) {
+	  // left for the importer to find again, so errors come out in file order
+	}
+      }
+    });
+  }
+
+  Command getCommandEnum(std::string_view command) const {
     for (int c = 0; c <= CT_LAST; ++c) {
-      if (0 == strcasecmp(command.c_str(), CT[c])) {
+      if (isCommand(command, (Command)c)) {
         return (Command)c;
       }
     }
@@ -541,35 +793,20 @@ private:
     case CT_INSTFDS:
     case CT_FDSWAVE:
     case CT_FDSMOD:
-    case CT_FDSMACRO: {
-      auto err = makeError();
-      err << "FDS not supported on the Game Boy.";
-      throw err;
-    }
+    case CT_FDSMACRO:
+      unsupported("FDS");
     case CT_KEYDPCM:
     case CT_DPCMDEF:
-    case CT_DPCM: {
-      auto err = makeError();
-      err << "DPCM not supported on the Game Boy.";
-      throw err;
-    }
+    case CT_DPCM:
+      unsupported("DPCM");
     case CT_INSTVRC6:
-    case CT_MACROVRC6: {
-      auto err = makeError();
-      err << "VRC6 not supported on the Game Boy.";
-      throw err;
-    }
-    case CT_INSTVRC7: {
-      auto err = makeError();
-      err << "VRC7 not supported on the Game Boy.";
-      throw err;
-    }
+    case CT_MACROVRC6:
+      unsupported("VRC6");
+    case CT_INSTVRC7:
+      unsupported("VRC7");
     case CT_INSTS5B:
-    case CT_MACROS5B: {
-      auto err = makeError();
-      err << "S5B not supported on the Game Boy.";
-      throw err;
-    }
+    case CT_MACROS5B:
+      unsupported("S5B");
     case CT_INSTN163:
       importN163Instrument();
       return;
@@ -602,18 +839,25 @@ private:
 
   sequence_t readSequenceType(void) {
     sequence_t sequenceType = (sequence_t)t.readInt(0, SEQ_COUNT - 1);
+    checkSequenceType(sequenceType);
+    return sequenceType;
+  }
+
+  void checkSequenceType(sequence_t sequenceType) const {
     if (sequenceType == SEQ_ARPEGGIO) {
       auto err = makeError();
       err << "arpeggio sequences are not supported";
       throw err;
     } 
-    return sequenceType;
   }
 
   void checkArpeggioType(void) {
     // TODO: is the + 1 correct?
-    ArpeggioType arpeggioType = (ArpeggioType)(t.readInt(0, 255));
-    if(arpeggioType != NON_ARPEGGIO) {
+    checkArpeggioType(t.readInt(0, 255));
+  }
+
+  void checkArpeggioType(int arpeggioType) const {
+    if((ArpeggioType)arpeggioType != NON_ARPEGGIO) {
       auto err = makeError();
       err << "all sequences must have a non-arpeggio arpeggio type";
       throw err;
@@ -621,7 +865,10 @@ private:
   }
 
   void ignoreReleasePoint(void) {
-    int releasePoint = t.readInt(-1, MAX_SEQUENCE_ITEMS);
+    checkReleasePoint(t.readInt(-1, MAX_SEQUENCE_ITEMS));
+  }
+
+  void checkReleasePoint(int releasePoint) const {
     if(releasePoint != -1) {
       auto err = makeError();
       err << "Instrument has release point, unsupported.";
@@ -658,8 +905,10 @@ private:
   }
 
   void readArpeggioSequenceNumber(void) {
-    int arpeggio  = readSequenceNumber();
+    checkNoArpeggio(readSequenceNumber());
+  }
 
+  void checkNoArpeggio(int arpeggio) const {
     if(arpeggio != -1) {
       auto err = makeError();
       err << "instruments shouldn't specify arpeggio sequence; arpeggios are not supported";
@@ -683,42 +932,153 @@ private:
   }
 
   // thanks to the magic of std::vector, we don't need to know the pattern length
-  // in advance
-  void ignorePatternLength(void) {
-    t.readInt(0, MAX_PATTERN_LENGTH);
+  // in advance - but knowing it, each pattern can make room for its rows up front, and in
+  // per-channel mode the frames are put together from it
+  int readPatternLength(void) {
+    return t.readInt(0, MAX_PATTERN_LENGTH);
   }
 
   void importTrack(void) {
-    if (track != 0) {
-      auto err = makeError();
-      err << "Multiple tracks are not supported.";
-      throw err;
-    }
+    checkTrackCount();
 
-    ignorePatternLength();
+    int patternLength = readPatternLength();
     
     int speed = t.readInt(0, MAX_TEMPO);
     int tempo = t.readInt(0, MAX_TEMPO);
-    song.setTempo(computeTempo(speed, tempo));
 
     skipTrackTitle();
     t.readEOL();
+    startTrack(computeTempo(speed, tempo), patternLength);
+  }
+
+  void checkTrackCount(void) const {
+    if (track == MAX_TRACKS) {
+      auto err = makeError();
+      err << "Too many tracks; at most " << MAX_TRACKS << " are allowed.";
+      throw err;
+    }
+  }
+
+  // every track gets its own patterns, numbered from 0, and starts out with no instruments
+  void startTrack(uint8_t tempo, int patternLength) {
+    if (track != 0) {
+      finishTrack();
+    }
+    song.addTrack(tempo);
     ++track;
+
+    this->patternNumber = PatternNumber();
+    this->pattern = Pattern();
+    this->jumps.clear();
+    this->patternLength = patternLength;
+    for (auto& patterns : channelCells) {
+      for (auto& cells : patterns) {
+	cells.clear();
+      }
+    }
+    frames.clear();
+    state = IMPORTING_ORDERS;
+    memset(currentInstruments, 0xFF, sizeof currentInstruments);
+  }
+
+  void finishTrack(void) {
+    if (perChannel) {
+      addFrames();
+      return;
+    }
+    // the order list might loop back from the last pattern, too
+    if(this->jumps.count(this->patternNumber)) {
+      this->pattern.addJump(this->jumps[this->patternNumber]);
+    } else {
+      this->pattern.terminate();
+    }
+    song.addPattern(this->pattern);
+  }
+
+  /* Each frame becomes one of the song's patterns, with a row for every row of the frame (followed
+     by its flow control effect, if there is one), and which has each channel play the channel
+     pattern made from the FamiTracker pattern it plays in the frame. Those are added the first
+     time a frame uses them. The frames play one after another, and the song stops at the end of
+     the last. */
+  void addFrames(void) {
+    optional<uint8_t> channelPatterns[GB_CHANNEL_COUNT][MAX_PATTERN];
+    for (size_t frame = 0; frame < frames.size(); frame++) {
+      uint8_t numbers[GB_CHANNEL_COUNT];
+      for (size_t gbChannel = 0; gbChannel < GB_CHANNEL_COUNT; gbChannel++) {
+	auto& number = channelPatterns[gbChannel][frames[frame][gbChannel]];
+	if (!number) {
+	  number = addChannelPattern(gbChannel, frames[frame][gbChannel]);
+	}
+	numbers[gbChannel] = *number;
+      }
+
+      Pattern framePattern;
+      framePattern.reserve(patternLength + 1);
+      framePattern.playChannelPatterns(numbers);
+      for (int row = 0; row < patternLength; row++) {
+	Row flowControlRow;
+	for (size_t gbChannel = 0; gbChannel < GB_CHANNEL_COUNT; gbChannel++) {
+	  addFlowControl(flowControlRow, getChannelCell(gbChannel, frames[frame][gbChannel], row).getEffect());
+	}
+	framePattern.addRow(Row());
+	addFlowControlRow(framePattern, std::move(flowControlRow));
+      }
+      if (frame + 1 == frames.size()) {
+	framePattern.terminate();
+      } else {
+	Row row;
+	row.endOfPattern();
+	framePattern.addRow(std::move(row));
+      }
+      song.addPattern(framePattern);
+    }
+  }
+
+  // a channel pattern starts out with no instrument, like a track, so that it plays the same
+  // whatever was played before it; one with no notes at all isn't added, and plays nothing
+  uint8_t addChannelPattern(size_t gbChannel, int patternNumber) {
+    this->channel = GB_CHANNELS[gbChannel];
+    uint8_t currentInstrument = 0xFF;
+    ChannelPattern channelPattern;
+    channelPattern.reserve(patternLength);
+    bool empty = true;
+    for (int row = 0; row < patternLength; row++) {
+      auto note = makeGbNote(getChannelCell(gbChannel, patternNumber, row), currentInstrument);
+      if (note) {
+	channelPattern.addNote(std::move(*note));
+	empty = false;
+      } else {
+	channelPattern.addNote(GbNote());
+      }
+    }
+    if (empty) {
+      return ChannelPattern::NONE;
+    }
+    return song.addChannelPattern(gbChannel, channelPattern);
+  }
+
+  // a pattern that was never read, or that's short of rows, is empty
+  Cell getChannelCell(size_t gbChannel, int patternNumber, int row) const {
+    const auto& cells = channelCells[gbChannel][patternNumber];
+    return (size_t)row < cells.size() ? cells[row] : Cell();
   }
     
   void importColumns(void) {
     checkColon();
     for (int c = 0; c < getChannelCount(); ++c) {
-      int i = t.readInt(1, MAX_EFFECT_COLUMNS);
-      if(i != 1) {
-	auto err = makeError();
-	err << "All channels must have 1 effect column, not " << i;
-	throw err;
-      }
+      checkEffectColumns(t.readInt(1, MAX_EFFECT_COLUMNS));
     }
     t.readEOL();
   }
 
+  void checkEffectColumns(int columns) const {
+    if(columns != 1) {
+      auto err = makeError();
+      err << "All channels must have 1 effect column, not " << columns;
+      throw err;
+    }
+  }
+
   void addJump(PatternNumber from, PatternNumber to) {
     jumps[from] = to;
   }
@@ -728,20 +1088,58 @@ private:
 
     skipFrameNumber();
 
+    if (perChannel) {
+      std::vector<uint8_t> patterns;
+      for (int c = 0; c < getChannelCount(); ++c) {
+	patterns.push_back(readPatternNumber().toInt());
+      }
+      t.readEOL();
+      addFrame(patterns);
+      return;
+    }
+
     PatternNumber patternNumber = readPatternNumber();
 
-    // unlike in Famitracker, in our driver there's only one
-    // pattern per frame
     for (int c = 1; c < getChannelCount(); ++c) {
-      PatternNumber patternNumber_ = readPatternNumber();
-      if(patternNumber != patternNumber_) {
-	auto errMsg = makeError();
-	errMsg << "Mismatched pattern number, expected " << patternNumber << " got " << patternNumber_;
-	throw errMsg;
-      }
+      checkSamePattern(patternNumber, readPatternNumber());
     }
     t.readEOL();
 
+    addOrder(patternNumber);
+  }
+
+  // unlike in Famitracker, in our driver there's only one
+  // pattern per frame
+  void checkSamePattern(PatternNumber patternNumber, PatternNumber patternNumber_) const {
+    if(patternNumber != patternNumber_) {
+      auto errMsg = makeError();
+      errMsg << "Mismatched pattern number, expected " << patternNumber << " got " << patternNumber_
+	     << " (convert with --per-channel to allow this)";
+      throw errMsg;
+    }
+  }
+
+  // the patterns a frame's Game Boy channels play, in per-channel mode
+  void addFrame(const std::vector<uint8_t>& patterns) {
+    if (frames.size() == MAX_FRAMES) {
+      auto err = makeError();
+      err << "Too many frames; at most " << MAX_FRAMES << " are allowed.";
+      throw err;
+    }
+    // without the N163 there's nothing for the wave channel to play, and no cells are ever read
+    // for it, so it plays an empty pattern 0
+    std::array<uint8_t, GB_CHANNEL_COUNT> frame = {};
+    for (size_t gbChannel = 0; gbChannel < GB_CHANNEL_COUNT; gbChannel++) {
+      if ((size_t)GB_CHANNELS[gbChannel] < patterns.size()) {
+	frame[gbChannel] = patterns[GB_CHANNELS[gbChannel]];
+      }
+    }
+    frames.push_back(frame);
+  }
+
+  void addOrder(PatternNumber patternNumber) {
+    state = IMPORTING_ORDERS;
+
     if(patternNumber != this->patternNumber.next()) {
       addJump(this->patternNumber, patternNumber);
     }
@@ -756,97 +1154,461 @@ private:
       throw errMsg;
     }
 
-    Row row;
+    // read ahead, in parallel - unless the line wasn't what the importer expects, in which case
+    // it goes the long way round below to say what was wrong with it
+    if (nextParsedRow < parsedRows.size() && parsedRows[nextParsedRow].position == t.getPosition()) {
+      const ParsedRow& parsed = parsedRows[nextParsedRow++];
+      if (parsed.ok && parsed.channelCount == getChannelCount()) {
+	Row row, flowControlRow;
+	for (this->channel = 0; channel < getChannelCount(); channel++) {
+	  if (isGbChannel(channel)) {
+	    addCell(row, flowControlRow, parsed.cells[channel]);
+	  }
+	}
+	t.finishLine();
 
-    int i = t.readHex(0, MAX_PATTERN_LENGTH - 1);
-    int gbChannel = 0;
+	addRow(std::move(row), std::move(flowControlRow));
+	return;
+      }
+    }
+
+    Row row, flowControlRow;
+
+    t.readHex(0, MAX_PATTERN_LENGTH - 1);
     for (this->channel = 0; channel < getChannelCount(); channel++) {
       // read the cell - we need to actually read the data for all
       // channels, even if we're going to ignore some (non GB ones)
       checkColon();
       Cell cell = importCell();
-      Note note = cell.getNote();
-      int instrument = cell.getInstrumentId();
-      Effect effect = cell.getEffect();
 
       // don't actually do anything if this isn't a GB channel
+      if (!isGbChannel(channel)) {
+	continue;
+      }
+
+      addCell(row, flowControlRow, cell);
+    }
+    t.readEOL();
+
+    addRow(std::move(row), std::move(flowControlRow));
+  }
+
+  // in per-channel mode, the cells have all gone to their channels' patterns instead
+  void addRow(Row row, Row flowControlRow) {
+    if (!perChannel) {
+      pattern.addRow(std::move(row));
+      addFlowControlRow(pattern, std::move(flowControlRow));
+    }
+  }
+
+  /* A row that ends a pattern holds nothing but its flow control command, and the engine goes
+     straight on to the next pattern when it gets to it, so it goes after the row whose effect it
+     was; that row's notes still play */
+  static void addFlowControlRow(Pattern& pattern, Row flowControlRow) {
+    if (flowControlRow.getFlowControlCommand()) {
+      pattern.addRow(std::move(flowControlRow));
+    }
+  }
+
+  // the FamiTracker channels that the Game Boy's square 1, square 2, wave and noise channels play
+  static const int GB_CHANNELS[GB_CHANNEL_COUNT];
+
+  static bool isGbChannel(int channel) {
+    switch(channel) {
+    case CHANID_SQUARE1:
+    case CHANID_SQUARE2:
+    case N163_INDEX:
+    case CHANID_NOISE:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // adds a Game Boy channel's cell to the row, and its effect to the flow control row - or in
+  // per-channel mode, to the channel's pattern
+  void addCell(Row& row, Row& flowControlRow, const Cell& cell) {
+    if (perChannel) {
+      addChannelCell(cell);
+      return;
+    }
+
+    addFlowControl(flowControlRow, cell.getEffect());
+
+    auto gbNote = makeGbNote(cell, currentInstruments[channel]);
+    if(gbNote) {
       switch(channel) {
       case CHANID_SQUARE1:
+	row.setSquareNote1(std::move(*gbNote));
+	break;
       case CHANID_SQUARE2:
+	row.setSquareNote2(std::move(*gbNote));
+	break;
       case N163_INDEX:
+	row.setWaveNote(std::move(*gbNote));
+	break;
       case CHANID_NOISE:
+	row.setNoiseNote(std::move(*gbNote));
 	break;
-      default:
-	continue;
       }
+    }
+  }
 
-      switch(effect.type) {
-      case EFFECT_NO_EFFECT: break;
-      case EFFECT_JUMP:
-	row.jump(effect.param);
-	break;
-      case EFFECT_END_OF_PATTERN:
-	row.endOfPattern();
-	break;
-      case EFFECT_STOP:
-	row.stop();
-	break;
+  void addFlowControl(Row& row, Effect effect) const {
+    switch(effect.type) {
+    case EFFECT_NO_EFFECT: break;
+    case EFFECT_JUMP:
+      row.jump(effect.param);
+      break;
+    case EFFECT_END_OF_PATTERN:
+      row.endOfPattern();
+      break;
+    case EFFECT_STOP:
+      row.stop();
+      break;
+    }
+  }
+
+  // the cell's note for channel, if it has one, setting the instrument first if it's changed
+  optional<GbNote> makeGbNote(const Cell& cell, uint8_t& currentInstrument) const {
+    Note note = cell.getNote();
+    int instrument = cell.getInstrumentId();
+    if(!note) {
+      return optional<GbNote>();
+    }
+
+    GbNote gbNote(channel == N163_INDEX ? note.toWavePitch() : note.toGbPitch());
+    // a note without an instrument keeps playing the channel's last one
+    if(instrument != MAX_INSTRUMENTS && instrument != currentInstrument) {
+      ChannelCommand command;
+      command.type = CHANNEL_CMD_SET_INSTRUMENT;
+      command.newInstrument = instrument;
+      currentInstrument = instrument;
+      gbNote.addCommand(command);
+      if (channel == N163_INDEX) {
+	ChannelCommand command;
+	command.type = CHANNEL_CMD_SET_WAVE;
+	command.newWave = wavesForInstrument.at(instrument).at(0) * 16;
+	gbNote.addCommand(command);
       }
+    }
+    return gbNote;
+  }
 
-      if(note) {
-	GbNote gbNote(channel == N163_INDEX ? note.toWavePitch() : note.toGbPitch());
-	if(cell.getInstrumentId() != currentInstruments[channel]) {
-	  ChannelCommand command;
-	  command.type = CHANNEL_CMD_SET_INSTRUMENT;
-	  command.newInstrument = instrument;
-	  currentInstruments[channel] = instrument;
-	  gbNote.addCommand(command);
-	  if (channel == N163_INDEX) {
-	    ChannelCommand command;
-	    command.type = CHANNEL_CMD_SET_WAVE;
-	    command.newWave = waveForInstrument.at(instrument) * 16;
-	    gbNote.addCommand(command);
-	  }
+  // the cell's only turned into a note at the end of the track, but anything wrong with it is
+  // caught here, where the error can say where it is
+  void addChannelCell(const Cell& cell) {
+    if (state != IMPORTING_PATTERNS) {
+      auto err = makeError();
+      err << "row isn't in a pattern.";
+      throw err;
+    }
+    uint8_t noInstrument = 0xFF;
+    makeGbNote(cell, noInstrument);
+    size_t gbChannel = std::find(GB_CHANNELS, GB_CHANNELS + GB_CHANNEL_COUNT, channel) - GB_CHANNELS;
+    auto& cells = channelCells[gbChannel][patternNumber.toInt()];
+    if (cells.empty()) {
+      cells.reserve(patternLength);
+    }
+    cells.push_back(cell);
+  }
+
+  /* A binary module goes through the same steps as a text export, in the same order - the
+     text export is written out from the very same data - so it comes out just the same, and
+     anything the Game Boy can't play is turned down just the same. */
+  void importFtm(void) {
+    ftmStep("Module", -1, [&] {
+      importFtmSettings();
+    });
+
+    for (const auto& sequence : ftm->getSequences()) {
+      ftmStep("Sequence", sequence.index, [&] {
+	importFtmSequence(sequence);
+      });
+    }
+    if (ftm->getSampleCount() > 0) {
+      ftmStep("Module", -1, [&] {
+	unsupported("DPCM");
+      });
+    }
+    for (const auto& instrument : ftm->getInstruments()) {
+      ftmStep("Instrument", instrument.index, [&] {
+	importFtmInstrument(instrument);
+      });
+    }
+
+    const auto& tracks = ftm->getTracks();
+    for (size_t i = 0; i < tracks.size(); i++) {
+      importFtmTrack(tracks[i], i);
+    }
+    ftmTrackNumber = -1;
+    ftmPart = "Module";
+    ftmNumber = -1;
+  }
+
+  // when checking, an error in one part of a binary module is noted and the import carries on
+  // with the next, much as it does with the next line of a text one
+  template <typename Step>
+  void ftmStep(const char *part, int number, Step step) {
+    ftmPart = part;
+    ftmNumber = number;
+    if (!checkErrors) {
+      step();
+      return;
+    }
+    try {
+      step();
+    } catch (...) {
+      checkErrors->push_back(describeError(ftmLocation()));
+    }
+  }
+
+  std::string ftmLocation(void) const {
+    std::ostringstream location;
+    if (ftmTrackNumber >= 0) {
+      location << "Track " << ftmTrackNumber << ": ";
+    }
+    location << ftmPart;
+    if (ftmNumber >= 0) {
+      location << " " << ftmNumber;
+    }
+    if (ftmRow >= 0) {
+      location << " row " << ftmRow << " channel " << channel;
+    }
+    return location.str();
+  }
+
+  void importFtmSettings(void) {
+    std::cout << "Title: " << ftm->getTitle() << std::endl;
+    std::cout << "Author: " << ftm->getAuthor() << std::endl;
+    std::cout << "Copyright: " << ftm->getCopyright() << std::endl;
+    checkMachine(ftm->getMachine());
+    checkFramerate(ftm->getEngineSpeed());
+    setExpansion(ftm->getExpansionChip());
+    ignoreVibrato();
+    this->speedSplitPoint = ftm->getSpeedSplitPoint();
+    if (hasN163) {
+      checkN163Channels(ftm->getN163Channels());
+    }
+  }
+
+  void importFtmSequence(const FtmSequence& ftmSequence) {
+    switch (ftmSequence.chip) {
+    case SNDCHIP_VRC6: unsupported("VRC6");
+    case SNDCHIP_S5B: unsupported("S5B");
+    }
+
+    sequence_t sequenceType = (sequence_t)ftmSequence.type;
+    checkSequenceType(sequenceType);
+    InstrSequence sequence(sequenceType);
+    checkReleasePoint(ftmSequence.releasePoint);
+    checkArpeggioType(ftmSequence.setting);
+    for (int8_t item : ftmSequence.items) {
+      sequence.pushBack(item);
+    }
+    sequence.setLoopPoint(ftmSequence.loopPoint);
+
+    addInstrSequence(InstrSequenceIndex(ftmSequence.chip, sequenceType, ftmSequence.index), sequence);
+  }
+
+  void importFtmInstrument(const FtmInstrument& instrument) {
+    const int *sequences = instrument.sequences;
+    switch (instrument.type) {
+    case FtmInstrument::INST_2A03:
+      checkNoArpeggio(sequences[SEQ_ARPEGGIO]);
+      song.addInstrument(buildStdGbInstrument(sequences[SEQ_VOLUME], sequences[SEQ_PITCH],
+					      sequences[SEQ_HIPITCH], sequences[SEQ_DUTYCYCLE]));
+      if (instrument.hasSamples) {
+	unsupported("DPCM");
+      }
+      return;
+    case FtmInstrument::INST_N163:
+      checkNoArpeggio(sequences[SEQ_ARPEGGIO]);
+      checkWaveSize(instrument.waveSize);
+      checkWavePos(instrument.wavePos);
+      checkWaveCount(instrument.waves.size());
+      // the wave sequence is in the duty cycle's place
+      song.addInstrument(buildN163GbInstrument(sequences[SEQ_VOLUME], sequences[SEQ_PITCH],
+					       sequences[SEQ_HIPITCH], sequences[SEQ_DUTYCYCLE]));
+      for (size_t i = 0; i < instrument.waves.size(); i++) {
+	Wave wave;
+	for (size_t sample = 0; sample < Wave::SAMPLE_CNT; sample++) {
+	  wave.setSample(sample, instrument.waves[i][sample]);
 	}
+	addN163Wave(instrument.index, i, wave);
+      }
+      return;
+    case FtmInstrument::INST_VRC6: unsupported("VRC6");
+    case FtmInstrument::INST_VRC7: unsupported("VRC7");
+    case FtmInstrument::INST_FDS: unsupported("FDS");
+    case FtmInstrument::INST_S5B: unsupported("S5B");
+    default: {
+      auto err = makeError();
+      err << "unknown instrument type " << instrument.type;
+      throw err;
+    }
+    }
+  }
+
+  void importFtmTrack(const FtmTrack& ftmTrack, int number) {
+    ftmTrackNumber = -1;
+    ftmStep("Track", number, [&] {
+      checkTrackCount();
+      startTrack(computeTempo(ftmTrack.speed, ftmTrack.tempo), ftmTrack.patternLength);
+
+      if (ftm->getChannelCount() != getChannelCount()) {
+	auto err = makeError();
+	err << "expected " << getChannelCount() << " channels, found " << ftm->getChannelCount();
+	throw err;
+      }
+      for (int extraColumns : ftmTrack.extraEffectColumns) {
+	checkEffectColumns(extraColumns + 1);
+      }
+    });
+    if (ftm->getChannelCount() != getChannelCount()) {
+      // there's no making sense of the rest
+      return;
+    }
+    if (ftm->getTracks().size() > 1) {
+      ftmTrackNumber = number;
+    }
 
-	switch(channel) {
-	case CHANID_SQUARE1:
-	  row.setSquareNote1(gbNote);
-	  break;
-	case CHANID_SQUARE2:
-	  row.setSquareNote2(gbNote);
-	  break;
-	case N163_INDEX:
-	  row.setWaveNote(gbNote);
-	  break;
-	case CHANID_NOISE:
-	  row.setNoiseNote(gbNote);
-	  break;
+    for (size_t frame = 0; frame < ftmTrack.frames.size(); frame++) {
+      ftmStep("Frame", frame, [&] {
+	const auto& patterns = ftmTrack.frames[frame];
+	if (perChannel) {
+	  addFrame(patterns);
+	  return;
+	}
+	for (int c = 1; c < getChannelCount(); ++c) {
+	  checkSamePattern(PatternNumber(patterns[0]), PatternNumber(patterns[c]));
 	}
+	addOrder(PatternNumber(patterns[0]));
+      });
+    }
+
+    // the text export leaves out patterns that are empty in every channel, so they're left out
+    // here too
+    for (int patternNumber = 0; patternNumber < MAX_PATTERN; patternNumber++) {
+      const std::vector<FtmCell> *channelRows[MAX_CHANNELS] = {};
+      bool used = false;
+      for (int c = 0; c < getChannelCount(); c++) {
+	channelRows[c] = ftmTrack.getPattern(c, patternNumber);
+	used = used || channelRows[c];
+      }
+      if (!used) {
+	continue;
+      }
+
+      ftmStep("Pattern", patternNumber, [&] {
+	startPattern(PatternNumber(patternNumber));
+      });
+      for (ftmRow = 0; ftmRow < ftmTrack.patternLength; ftmRow++) {
+	ftmStep("Pattern", patternNumber, [&] {
+	  importFtmRow(channelRows);
+	});
+      }
+      ftmRow = -1;
+    }
+  }
+
+  void importFtmRow(const std::vector<FtmCell> *const channelRows[]) {
+    static const FtmCell emptyCell;
+
+    Row row, flowControlRow;
+    for (this->channel = 0; channel < getChannelCount(); channel++) {
+      const FtmCell& ftmCell = channelRows[channel] ? (*channelRows[channel])[ftmRow] : emptyCell;
+      Cell cell = importFtmCell(ftmCell);
+      if (isGbChannel(channel)) {
+	addCell(row, flowControlRow, cell);
+      }
+    }
+
+    addRow(std::move(row), std::move(flowControlRow));
+  }
+
+  // what the text importer would make of the cell, once the text export had written it out
+  Cell importFtmCell(const FtmCell& ftmCell) const {
+    Note note(0, 0);
+    switch (ftmCell.note) {
+    case NONE:
+      break;
+    case HALT:
+      note = Note(HALT, 0);
+      break;
+    case RELEASE:
+      note = Note(RELEASE, 0);
+      break;
+    default:
+      if (ftmCell.note > B) {
+	auto errMsg = makeError();
+	errMsg << "unrecognized note " << (int)ftmCell.note;
+	throw errMsg;
+      } else if (channel == CHANID_NOISE) {
+	// the text export only has room for the bottom four bits of a noise note
+	int h = (ftmCell.note - 1 + ftmCell.octave * NOTE_RANGE) & 0x0F;
+	note = Note(h % 12 + 1, h / 12);
+      } else if (channel == CHANID_TRIANGLE || channel == CHANID_DPCM) {
+	auto errMsg = makeError();
+	errMsg << "non-empty cell in " << (channel == CHANID_TRIANGLE ? "triangle" : "DPCM") << " channel";
+	throw errMsg;
+      } else if (ftmCell.octave >= OCTAVE_RANGE) {
+	auto errMsg = makeError();
+	errMsg << "unrecognized octave " << (int)ftmCell.octave;
+	throw errMsg;
+      } else {
+	note = Note(ftmCell.note, ftmCell.octave);
       }
-      gbChannel++;
     }
-    t.readEOL();
 
-    pattern.addRow(row);
+    if (ftmCell.instrument > MAX_INSTRUMENTS) {
+      auto errMsg = makeError();
+      errMsg << "instrument " << (int)ftmCell.instrument << " is out of bounds.";
+      throw errMsg;
+    }
+
+    if (ftmCell.volume != MAX_VOLUME) {
+      auto err = makeError();
+      err << "volume column is unsupported";
+      throw err;
+    }
+
+    Effect effect = {EFFECT_NO_EFFECT, 0};
+    if (ftmCell.effects[0] >= EF_COUNT) {
+      auto errMsg = makeError();
+      errMsg << "unrecognized effect " << (int)ftmCell.effects[0];
+      throw errMsg;
+    } else if (ftmCell.effects[0] != EF_NONE) {
+      effect.type = effectTypeOfId(ftmCell.effects[0] - 1);
+      effect.param = ftmCell.params[0];
+    }
+
+    return Cell(note, ftmCell.instrument, effect);
   }
 
   void importMachine(void) {
-    int i = t.readInt(0, PAL);
-    if(i == PAL) {
+    checkMachine(t.readInt(0, PAL));
+    t.readEOL();
+  }
+
+  void checkMachine(int machine) const {
+    if(machine == PAL) {
       auto errMsg = makeError();
       errMsg << "The Game Boy always runs at 60Hz. PAL songs are not supported.";
       throw errMsg;
     }
-    t.readEOL();
   }
 
   void importVibrato(void) {
     t.readInt(0, VIBRATO_NEW);
-    std::cout << "Warning: ignoring vibrato command." << std::endl;
+    ignoreVibrato();
     t.readEOL();
   }
 
+  void ignoreVibrato(void) const {
+    std::cout << "Warning: ignoring vibrato command." << std::endl;
+  }
+
   void importSplit(void) {
     // changes the point where the speed adjustment effect, Fxx
     // switches to changing tempo (or vice versa)
@@ -855,18 +1617,28 @@ private:
   }
     
   void importFramerate(void) {
-    int i = t.readInt(0, 800);
-    if(i != 0 && i != 60) {
+    checkFramerate(t.readInt(0, 800));
+    t.readEOL();
+  }
+
+  void checkFramerate(int framerate) const {
+    if(framerate != 0 && framerate != 60) {
       auto errMsg = makeError();
-      errMsg << "Engine speed must be 60Hz; got " << i;
+      errMsg << "Engine speed must be 60Hz; got " << framerate;
       throw errMsg;
     }
-    t.readEOL();
   }
     
   void importPattern(void) {
-    PatternNumber patternNumber(t.readHex(0, MAX_PATTERN - 1));
+    startPattern(PatternNumber(t.readHex(0, MAX_PATTERN - 1)));
+    t.readEOL();
+  }
 
+  void startPattern(PatternNumber patternNumber) {
+    if (perChannel) {
+      startChannelPatterns(patternNumber);
+      return;
+    }
     switch(state) {
     case IMPORTING_ORDERS:
       state = IMPORTING_PATTERNS;
@@ -878,7 +1650,12 @@ private:
       } else {
 	Row row;
 	row.endOfPattern();
-	this->pattern.addRow(row);
+	this->pattern.addRow(std::move(row));
+      }
+      song.addPattern(this->pattern);
+      if (lowMemory) {
+	// nothing before this line gets read again
+	source.release(t.getPosition());
       }
       break;
     }
@@ -891,36 +1668,47 @@ private:
 
     this->patternNumber = patternNumber;
     this->pattern = Pattern();
-    t.readEOL();
+    // and one more row to end it
+    this->pattern.reserve(patternLength + 1);
+    // the pattern can be played after any other, so its first notes can't count on what the one
+    // before it in the module left each channel playing
+    memset(currentInstruments, 0xFF, sizeof currentInstruments);
+  }
+
+  // in per-channel mode, the patterns can come in any order, since they're only put together
+  // at the end of the track
+  void startChannelPatterns(PatternNumber patternNumber) {
+    if (state == IMPORTING_PATTERNS && lowMemory) {
+      // nothing before this line gets read again
+      source.release(t.getPosition());
+    }
+    state = IMPORTING_PATTERNS;
+    for (const auto& patterns : channelCells) {
+      if (!patterns[patternNumber.toInt()].empty()) {
+	auto err = makeError();
+	err << "pattern " << patternNumber << " appears twice.";
+	throw err;
+      }
+    }
+    this->patternNumber = patternNumber;
   }
 
   void importExpansion(void) {
-    int i = t.readInt(0, 255);
-    switch(i) {
+    setExpansion(t.readInt(0, 255));
+    t.readEOL();
+  }
+
+  void setExpansion(int expansion) {
+    switch(expansion) {
     case SNDCHIP_NONE: hasN163 = false; break;
     case SNDCHIP_N163: hasN163 = true;  break;
     default:
       auto errMsg = makeError();
-      errMsg << "Unsupported expansion: " << i;
+      errMsg << "Unsupported expansion: " << expansion;
       throw errMsg;
     }
-    
-    t.readEOL();
   }
     
-  void checkColon(void) {
-    checkSymbol(":");
-  }
-    
-  void checkSymbol(const std::string& x) {
-    std::string symbol = t.readToken();
-    if (symbol != x) {
-      auto errMsg = makeError();
-      errMsg << "expected '" << x << "', '" << symbol << "' found.";
-      throw errMsg;
-    }
-  }
-
   void importN163Wave(void) {
     int instrumentNumber = t.readInt(0, MAX_INSTRUMENTS - 1);
 
@@ -934,22 +1722,35 @@ private:
     }
     t.readEOL();
 
-    song.addWave(wave);
-    waveForInstrument[instrumentNumber] = ++this->lastWaveRead;
+    addN163Wave(instrumentNumber, waveNumber, wave);
+  }
+
+  void addN163Wave(int instrumentNumber, int waveNumber, const Wave& wave) {
+    auto& waves = wavesForInstrument[instrumentNumber];
+    if(waves.size() <= (size_t)waveNumber) {
+      waves.resize(waveNumber + 1);
+    }
+    waves[waveNumber] = song.addWave(wave);
   }
 
   void importN163Channels(void) {
-    int i = t.readInt(1, 8);
-    if(i > 1) {
+    checkN163Channels(t.readInt(1, 8));
+    t.readEOL();
+  }
+
+  void checkN163Channels(int channels) const {
+    if(channels > 1) {
       auto errMsg = makeError();
       errMsg << "Only 1 N163 wave channel is supported.";
       throw errMsg;
     }
-    t.readEOL();
   }
 
   void checkWaveCount() {
-    int waveCount = t.readInt(1, 1);
+    checkWaveCount(t.readInt(1, 1));
+  }
+
+  void checkWaveCount(int waveCount) const {
     if(waveCount != 1) {
       auto errMsg = makeError();
       errMsg << "invalid wave count: " << waveCount;
@@ -966,16 +1767,11 @@ private:
     int hiPitch   = readSequenceNumber();
     int wave      = readSequenceNumber();
 
-    int waveSize = t.readInt(0, Wave::SAMPLE_CNT);
-    if(waveSize != Wave::SAMPLE_CNT) {
-      auto err = makeError();
-      err << "invalid wave size";
-      throw err;
-    }
+    checkWaveSize(t.readInt(0, Wave::SAMPLE_CNT));
 
     // wave pos - where the sample gets loaded into wave RAM
     // this must be 0 in our engine
-    int wavePos = t.readInt(0, 0);
+    checkWavePos(t.readInt(0, 0));
 
     checkWaveCount();
 
@@ -985,6 +1781,22 @@ private:
     t.readEOL();
   }
   
+  void checkWaveSize(int waveSize) const {
+    if(waveSize != Wave::SAMPLE_CNT) {
+      auto err = makeError();
+      err << "invalid wave size";
+      throw err;
+    }
+  }
+
+  void checkWavePos(int wavePos) const {
+    if(wavePos != 0) {
+      auto err = makeError();
+      err << "wave position must be 0, not " << wavePos;
+      throw err;
+    }
+  }
+
   void importN163InstrSequence(void) {
     importInstrSequence(SNDCHIP_N163);
   }
@@ -1078,6 +1890,10 @@ private:
       if(i == loopPoint_) {
 	command.type = INSTR_MARK;
 	instrument.addCommand(command);
+	// coming round the loop, these are whatever the last frame left them as, so set them
+	// again here; GbInstrument::compact takes out the ones that turn out not to be needed
+	currentVolume = -1;
+	currentDuty = -1;
       }
 
       if(volumeSeq) {
@@ -1215,6 +2031,9 @@ private:
       if(i == loopPoint_) {
 	command.type = INSTR_MARK;
 	instrument.addCommand(command);
+	// as for the standard instruments
+	currentVolume = -1;
+	currentWave = -1;
       }
 
       if(volumeSeq) {
@@ -1298,19 +2117,25 @@ private:
   }
 };
 
-Importer::Importer(const std::string& text) : impl(std::make_unique<ImporterImpl>(text)) {}
+const int ImporterImpl::GB_CHANNELS[GB_CHANNEL_COUNT] = {CHANID_SQUARE1, CHANID_SQUARE2, N163_INDEX, CHANID_NOISE};
+
+Importer::Importer(std::string text) : Importer(SourceFile(std::move(text))) {}
+Importer::Importer(SourceFile source) : impl(std::make_unique<ImporterImpl>(std::move(source))) {}
 Importer::Importer(Importer&& importer) : impl(std::move(importer.impl)) {}
 Importer::~Importer() {}
 
 Importer Importer::fromFile(const char *filename) {
-  std::ifstream f(filename, std::ifstream::in);
-  std::stringstream buffer;
-  buffer << f.rdbuf();
-  f.close();
-
-  return std::move(Importer(buffer.str()));
+  return Importer(SourceFile::open(filename));
 }
 
 Song Importer::runImport(void) {
   return impl->runImport();
 }
+
+std::vector<std::string> Importer::runCheck(void) {
+  return impl->runCheck();
+}
+
+void Importer::setCompressionOptions(const CompressionOptions& options) {
+  impl->setCompressionOptions(options);
+}
@@ -21,22 +21,30 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include "Command.h"
 #include "Song.h"
+#include "SourceFile.h"
 #include "Tokenizer.h"
 
 struct ImporterImpl;
 
 class Importer {
 public:
-  explicit Importer(const std::string& text);
+  explicit Importer(std::string text);
+  explicit Importer(SourceFile source);
   Importer(Importer&&);
   ~Importer();
 
   static Importer fromFile(const char *filename);
 
+  void setCompressionOptions(const CompressionOptions&);
+
   Song runImport();
+  /* reads the whole module without converting it, and returns every error found in it, in
+     order - an empty list if there weren't any */
+  std::vector<std::string> runCheck();
  private:
   std::unique_ptr<ImporterImpl> impl;
 };
@@ -0,0 +1,65 @@
+#include "RunLength.h"
+
+#include <algorithm>
+
+static const size_t MAX_RUN = 0x7F;
+static const uint8_t REPEAT = 0x80;
+/* a repeat costs two bytes, so anything shorter is cheaper left in with the literals */
+static const size_t MIN_REPEAT = 3;
+
+static size_t runAt(ByteSpan input, size_t pos) {
+  size_t end = std::min(input.size, pos + MAX_RUN);
+  size_t i = pos + 1;
+  while (i < end && input.data[i] == input.data[pos]) {
+    i++;
+  }
+  return i - pos;
+}
+
+void encodeRunLength(ByteSpan input, std::vector<char>& output) {
+  size_t literalStart = 0;
+  size_t pos = 0;
+
+  auto flushLiterals = [&](size_t end) {
+    while (literalStart < end) {
+      size_t length = std::min(MAX_RUN, end - literalStart);
+      output.push_back(length);
+      output.insert(output.end(), input.data + literalStart, input.data + literalStart + length);
+      literalStart += length;
+    }
+  };
+
+  while (pos < input.size) {
+    size_t run = runAt(input, pos);
+    if (run >= MIN_REPEAT) {
+      flushLiterals(pos);
+      output.push_back(REPEAT | run);
+      output.push_back(input.data[pos]);
+      pos += run;
+      literalStart = pos;
+    } else {
+      pos++;
+    }
+  }
+  flushLiterals(pos);
+
+  output.push_back(0);
+}
+
+uint32_t runLengthDecodeCycles(ByteSpan encoded) {
+  uint32_t cycles = 0;
+  size_t pos = 0;
+  while (pos < encoded.size) {
+    uint8_t control = encoded.data[pos++];
+    if (control == 0) {
+      return cycles + RunLengthCycles::END;
+    } else if (control & REPEAT) {
+      cycles += RunLengthCycles::repeat(control & MAX_RUN);
+      pos++;
+    } else {
+      cycles += RunLengthCycles::literals(control);
+      pos += control;
+    }
+  }
+  return cycles;
+}
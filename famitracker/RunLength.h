@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Compressor.h"
+
+/* A much simpler alternative to the LZ compressor, for patterns that are mostly runs of the
+   same byte (typically long stretches of empty rows). The output is a sequence of runs, each
+   introduced by a control byte:
+     $01-$7F - that many literal bytes follow
+     $81-$FF - the next byte is repeated (control & $7F) times
+     $00     - end of pattern
+   DecompressRLE (src/decompress.asm) unpacks it. Like Compressor::compress, the encoded stream
+   is appended to output. */
+void encodeRunLength(ByteSpan input, std::vector<char>& output);
+
+/* What each run costs DecompressRLE, in SM83 machine cycles (see DecompressCycles) */
+struct RunLengthCycles {
+  static const unsigned END = 8;
+  static unsigned literals(unsigned length) { return 17 + 10 * length; }
+  static unsigned repeat(unsigned length) { return 17 + 8 * length; }
+};
+
+/* an estimate of how long DecompressRLE takes to unpack encodeRunLength's output */
+uint32_t runLengthDecodeCycles(ByteSpan encoded);
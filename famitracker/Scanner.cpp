@@ -0,0 +1,60 @@
+#include "Scanner.h"
+
+Scanner::Scanner(std::string_view text_, ScanLevel level_) : text(text_), level(level_) {
+#ifndef __SSE2__
+  level = SCAN_SCALAR;
+#endif
+}
+
+ScanLevel Scanner::bestLevel(void) {
+#ifdef __SSE2__
+  return SCAN_SSE2;
+#else
+  return SCAN_SCALAR;
+#endif
+}
+
+// each of these stops wherever its vector loop can't go any further, and the scalar loop
+// finishes off the last few bytes
+
+size_t Scanner::skipBlanksFrom(size_t pos) const {
+#ifdef __SSE2__
+  for (; pos + VECTOR_SIZE <= text.size(); pos += VECTOR_SIZE) {
+    unsigned found = ~blankMask(pos) & 0xFFFF;
+    if (found) {
+      return pos + __builtin_ctz(found);
+    }
+  }
+#endif
+  return skipBlanksScalar(pos);
+}
+
+size_t Scanner::findDelimiterFrom(size_t pos) const {
+#ifdef __SSE2__
+  for (; pos + VECTOR_SIZE <= text.size(); pos += VECTOR_SIZE) {
+    unsigned found = delimiterMask(pos);
+    if (found) {
+      return pos + __builtin_ctz(found);
+    }
+  }
+#endif
+  return findDelimiterScalar(pos);
+}
+
+size_t Scanner::findNewline(size_t pos) const {
+#ifdef __SSE2__
+  if (level != SCAN_SCALAR) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; pos + VECTOR_SIZE <= text.size(); pos += VECTOR_SIZE) {
+      unsigned found = _mm_movemask_epi8(_mm_cmpeq_epi8(load(pos), lf));
+      if (found) {
+	return pos + __builtin_ctz(found);
+      }
+    }
+  }
+#endif
+  while (pos < text.size() && text[pos] != '\n') {
+    ++pos;
+  }
+  return pos;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+enum ScanLevel {
+  SCAN_SCALAR,
+  SCAN_SSE2
+};
+
+/* Finds the characters the Tokenizer splits on, 16 bytes at a time with SSE2 (which every
+   x86-64 has). Most tokens are a few characters long, so the first 16 bytes usually settle it,
+   and that part is inline; long runs (comment lines, mostly) go out to a loop. Near the end of
+   the text it drops back to testing a character at a time, so it never reads past the end.
+   SCAN_SCALAR does that everywhere, and is there for comparison and for other CPUs.
+
+   Each search returns the index of the first character at or after pos that it's looking for,
+   or text.size() if there isn't one. */
+class Scanner {
+ public:
+  static const size_t VECTOR_SIZE = 16;
+  static const size_t SHORT_TOKEN = 4;
+
+  Scanner(std::string_view text_, ScanLevel level);
+
+  /* SSE2 if the build can use it, otherwise scalar */
+  static ScanLevel bestLevel(void);
+
+  // the first character that isn't a space or a tab
+  size_t skipBlanks(size_t pos) const {
+    // usually there's just the one space, if any
+    if (pos >= text.size() || !isBlank(text[pos])) {
+      return pos;
+    }
+#ifdef __SSE2__
+    if (level != SCAN_SCALAR && pos + VECTOR_SIZE <= text.size()) {
+      unsigned found = ~blankMask(pos) & 0xFFFF;
+      if (found) {
+	return pos + __builtin_ctz(found);
+      }
+      return skipBlanksFrom(pos + VECTOR_SIZE);
+    }
+#endif
+    return skipBlanksScalar(pos);
+  }
+
+  // the first space, tab, CR, LF or quote
+  size_t findDelimiter(size_t pos) const {
+    // most tokens are only a few characters long, and are over before a vector would pay off
+    for (size_t shortEnd = pos + SHORT_TOKEN; pos < shortEnd; ++pos) {
+      if (pos >= text.size() || isDelimiter(text[pos])) {
+	return pos;
+      }
+    }
+#ifdef __SSE2__
+    if (level != SCAN_SCALAR && pos + VECTOR_SIZE <= text.size()) {
+      unsigned found = delimiterMask(pos);
+      if (found) {
+	return pos + __builtin_ctz(found);
+      }
+      return findDelimiterFrom(pos + VECTOR_SIZE);
+    }
+#endif
+    return findDelimiterScalar(pos);
+  }
+
+  // the first LF
+  size_t findNewline(size_t pos) const;
+
+ private:
+  static bool isBlank(char c) {
+    return c == ' ' || c == '\t';
+  }
+
+  static bool isDelimiter(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\"';
+  }
+
+  size_t skipBlanksScalar(size_t pos) const {
+    while (pos < text.size() && isBlank(text[pos])) {
+      ++pos;
+    }
+    return pos;
+  }
+
+  size_t findDelimiterScalar(size_t pos) const {
+    while (pos < text.size() && !isDelimiter(text[pos])) {
+      ++pos;
+    }
+    return pos;
+  }
+
+#ifdef __SSE2__
+  __m128i load(size_t pos) const {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + pos));
+  }
+
+  unsigned blankMask(size_t pos) const {
+    __m128i v = load(pos);
+    return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+					  _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))));
+  }
+
+  unsigned delimiterMask(size_t pos) const {
+    __m128i v = load(pos);
+    __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+				 _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    __m128i eol = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+			       _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    __m128i quote = _mm_cmpeq_epi8(v, _mm_set1_epi8('\"'));
+    return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(blank, eol), quote));
+  }
+#endif
+
+  // the rest of a long search, after the first 16 bytes came up empty
+  size_t skipBlanksFrom(size_t pos) const;
+  size_t findDelimiterFrom(size_t pos) const;
+
+  std::string_view text;
+  ScanLevel level;
+};
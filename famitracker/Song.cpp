@@ -21,8 +21,42 @@
 #include "Song.h"
 
 #include "Compressor.h"
-
+#include "Dictionary.h"
+#include "RunLength.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
 #include <sstream>
+#include <string_view>
+#include <unordered_map>
+
+/* Writes to the end of a vector, so that a pattern can be written straight into the buffer it's
+   kept in, rather than into a stringstream and then copied out */
+class VectorStream : private std::streambuf, public std::ostream {
+ public:
+  explicit VectorStream(std::vector<char>& data) : std::ostream(this), data(data) {}
+
+ private:
+  typedef std::streambuf::int_type int_type;
+  typedef std::streambuf::traits_type traits_type;
+
+  int_type overflow(int_type c) override {
+    if(!traits_type::eq_int_type(c, traits_type::eof())) {
+      data.push_back(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    data.insert(data.end(), s, s + n);
+    return n;
+  }
+
+  std::vector<char>& data;
+};
 
 Wave::Wave() : samples{0} {}
 
@@ -32,6 +66,10 @@ void Wave::writeGb(std::ostream& ostream) const {
   }
 }
 
+bool Wave::operator==(const Wave& wave) const {
+  return std::equal(samples, samples + SAMPLE_CNT, wave.samples);
+}
+
 void Wave::setSample(size_t sampleNum, uint8_t value) {
   if(sampleNum >= Wave::SAMPLE_CNT) {
     throw "Sample index out of bounds";
@@ -44,84 +82,274 @@ void Wave::setSample(size_t sampleNum, uint8_t value) {
 
 class SongMasterConfig {
  public:
-  SongMasterConfig() : tempo(0), channelControl(0x77), outputTerminals(0xFF) {}
-
-  void setTempo(uint8_t tempo) {
-    this->tempo = tempo;
-  }
+  SongMasterConfig() : channelControl(0x77), outputTerminals(0xFF) {}
 
   void writeGb(std::ostream& ostream) const {
     ostream.put(channelControl);
     ostream.put(outputTerminals);
-    ostream.put(tempo);
   }
 
-  static const uint16_t GB_SIZE = 3;
+  static const uint16_t GB_SIZE = 2;
 
  private:
-  uint8_t tempo;
   uint8_t channelControl;
   uint8_t outputTerminals;
 };
 
+/* How a pattern's been compressed; the engine finds this in the top two bits of its pattern table entry */
+enum PatternCodec {
+  PATTERN_LZ = 0,
+  PATTERN_RLE = 1,
+  PATTERN_STORED = 2,
+  PATTERN_LZX = 3
+};
+
 class CompressedPattern {
 public:
-  CompressedPattern(const std::vector<char>& data) {
-    Compressor compressor(data);
-    while(!compressor.isDone()) {
-      this->compressedBlocks.push_back(compressor.getNextBlock());
-    }
-  }
+  CompressedPattern(PatternCodec codec, ByteSpan encoded, uint32_t decodeCycles) :
+    codec(codec), encoded(encoded.data, encoded.data + encoded.size), length(encoded.size),
+    decodeCycles(decodeCycles) {}
 
   void writeGb(std::ostream& ostream) const {
-    for(const auto& block : this->compressedBlocks) {
-      ostream.put(block.getFlagByte());
-      ostream.write(block.begin(), block.sizeNoFlagByte());
+    ostream.write(encoded.data(), encoded.size());
+  }
+
+  // writes the pattern to the end of file and lets go of it; it still knows how long it was
+  void spill(std::FILE *file) {
+    if(std::fwrite(encoded.data(), 1, encoded.size(), file) != encoded.size()) {
+      throw std::string("Couldn't write a pattern to its temporary file");
     }
+    encoded = std::vector<char>();
   }
 
   uint16_t getLength(void) const {
-    uint16_t totalSize = 0;
-    for(const auto& block : this->compressedBlocks) {
-      totalSize += block.sizeIncludingFlagByte();
+    return length;
+  }
+
+  bool isSame(const std::vector<char>& encoded) const {
+    return this->encoded == encoded;
+  }
+
+  uint32_t getDecodeCycles(void) const {
+    return decodeCycles;
+  }
+
+  PatternCodec getCodec(void) const {
+    return codec;
+  }
+
+private:
+  PatternCodec codec;
+  std::vector<char> encoded;
+  uint16_t length;
+  uint32_t decodeCycles;
+};
+
+/* Each pattern is encoded every way the engine can decode it, and we keep whichever suits the
+   compression mode best. LZ is usually smallest, but patterns that are mostly runs unpack more
+   quickly with RLE, and ones that barely compress at all are better off stored as they are -
+   the engine plays those straight out of the ROM without decompressing them. If it's allowed,
+   the extended LZ format gets a go too; it only wins where far matches more than pay for the
+   extra time every match takes to decode.
+   The candidates are built in buffers that get reused from one pattern to the next, so the only
+   allocation per pattern is the copy the CompressedPattern keeps. */
+class PatternEncoder {
+public:
+  explicit PatternEncoder(const CompressionOptions& options) :
+    options(options), compressor(plainOptions(options)), extendedCompressor(options) {}
+
+  CompressedPattern encode(const std::vector<char>& data, const std::vector<char>& dictionary) {
+    Candidate candidates[4];
+    size_t candidateCount = 0;
+
+    lz.clear();
+    uint32_t lzCycles = compressor.compress(data, lz, dictionary);
+    candidates[candidateCount++] = Candidate{PATTERN_LZ, lz, lzCycles};
+    // the streaming engine only understands LZ
+    if(!options.streaming) {
+      if(options.extended) {
+	extendedLz.clear();
+	uint32_t extendedCycles = extendedCompressor.compress(data, extendedLz, dictionary);
+	candidates[candidateCount++] = Candidate{PATTERN_LZX, extendedLz, extendedCycles};
+      }
+      runLength.clear();
+      encodeRunLength(data, runLength);
+      candidates[candidateCount++] = Candidate{PATTERN_RLE, runLength, runLengthDecodeCycles(runLength)};
+      candidates[candidateCount++] = Candidate{PATTERN_STORED, data, 0};
     }
-    return totalSize;
+
+    const Candidate& chosen = choose(candidates, candidateCount);
+    return CompressedPattern(chosen.codec, chosen.encoded, chosen.decodeCycles);
   }
 
 private:
-  std::vector<Block> compressedBlocks;
+  const CompressionOptions options;
+  Compressor compressor;
+  Compressor extendedCompressor;
+  std::vector<char> lz;
+  std::vector<char> extendedLz;
+  std::vector<char> runLength;
+
+  static CompressionOptions plainOptions(CompressionOptions options) {
+    options.extended = false;
+    return options;
+  }
+
+  struct Candidate {
+    PatternCodec codec;
+    ByteSpan encoded;
+    uint32_t decodeCycles;
+  };
+
+  // the smallest, unless we're after decode speed - then the quickest within the byte budget
+  const Candidate& choose(const Candidate *candidates, size_t candidateCount) const {
+    size_t smallest = candidates[0].encoded.size;
+    for(size_t i = 0; i < candidateCount; i++) {
+      smallest = std::min(smallest, candidates[i].encoded.size);
+    }
+    size_t byteLimit = smallest;
+    if(options.mode == COMPRESSION_FAST_DECODE) {
+      byteLimit += options.extraByteBudget;
+    }
+
+    const Candidate *best = nullptr;
+    for(size_t i = 0; i < candidateCount; i++) {
+      if(candidates[i].encoded.size > byteLimit) {
+	continue;
+      }
+      if(!best || isBetter(candidates[i], *best)) {
+	best = &candidates[i];
+      }
+    }
+    return *best;
+  }
+
+  bool isBetter(const Candidate& candidate, const Candidate& than) const {
+    if(options.mode == COMPRESSION_FAST_DECODE) {
+      return candidate.decodeCycles < than.decodeCycles;
+    }
+    return candidate.encoded.size < than.encoded.size
+      || (candidate.encoded.size == than.encoded.size && candidate.decodeCycles < than.decodeCycles);
+  }
 };
 
 class PatternImpl {
  public:
-  void addRow(const Row& row) {
-    rows.push_back(row);
+  PatternImpl() : hasChannelPatterns(false) {}
+
+  void reserve(size_t rows) {
+    this->rows.reserve(rows);
+  }
+
+  void addRow(Row row) {
+    rows.push_back(std::move(row));
   }
 
   void addJump(PatternNumber to) {
     Row row;
     row.jump(to.toInt());
-    rows.push_back(row);
+    rows.push_back(std::move(row));
   }
 
   void terminate() {
     Row terminatingRow;
     terminatingRow.stop();
-    addRow(terminatingRow);
+    addRow(std::move(terminatingRow));
   }
 
-  CompressedPattern compress() const {
-    std::stringstream rowStream;
+  // the engine stops reading a pattern at its first flow control command, so that's the one that
+  // decides where the song goes next
+  optional<EngineCommand> getFlowControlCommand() const {
     for (const auto& row : rows) {
-      row.writeGb(rowStream);
+      auto command = row.getFlowControlCommand();
+      if (command) {
+	return command;
+      }
     }
-    auto rowDataStr = rowStream.str();
-    std::vector<char> rowData(rowDataStr.cbegin(), rowDataStr.cend());
-    return CompressedPattern(rowData);
+    return optional<EngineCommand>();
+  }
+
+  void playChannelPatterns(const uint8_t numbers[GB_CHANNEL_COUNT]) {
+    hasChannelPatterns = true;
+    std::copy(numbers, numbers + GB_CHANNEL_COUNT, channelPatterns);
+  }
+
+  optional<uint8_t> getChannelPattern(size_t channel) const {
+    if(!hasChannelPatterns || channelPatterns[channel] == ChannelPattern::NONE) {
+      return optional<uint8_t>();
+    }
+    return channelPatterns[channel];
+  }
+
+  // a per-channel song's pattern starts with its channel patterns' numbers, doubled like pattern
+  // numbers are, and then has a byte for each row
+  std::vector<char> serialize(const CompressionOptions& options) const {
+    // however the rows are written, they take no more than they do written out in full (and with
+    // row masks, the masks), so that's room for the whole pattern in one go
+    std::vector<char> data;
+    data.reserve(getLength() + (options.rowMasks ? rows.size() : 0));
+    VectorStream rowStream(data);
+    if (hasChannelPatterns) {
+      for (uint8_t number : channelPatterns) {
+	rowStream.put(number == ChannelPattern::NONE ? number : number * 2);
+      }
+      for (const auto& row : rows) {
+	row.writeControlGb(rowStream);
+      }
+    } else if (options.waits) {
+      writeRowsWithWaits(rowStream, options);
+    } else {
+      for (const auto& row : rows) {
+	writeRow(row, rowStream, options);
+      }
+    }
+    return data;
+  }
+
+  size_t getLength(void) const {
+    size_t length = hasChannelPatterns ? GB_CHANNEL_COUNT : 0;
+    for (const auto& row : rows) {
+      length += row.getLength();
+    }
+    return length;
   }
 
  private:
+  // the most ticks a single wait can cover
+  static const size_t MAX_WAIT = 0xFF;
+
+  /* An empty row still takes a byte for the song and one for each channel, and the engine reads
+     them all; a wait covers a whole run of them in two bytes, and the engine just counts it
+     down. (Not in a per-channel song, where the channels' rows aren't in the pattern.) */
+  void writeRowsWithWaits(std::ostream& rowStream, const CompressionOptions& options) const {
+    for (size_t i = 0; i < rows.size(); ) {
+      size_t empty = 0;
+      while (i + empty < rows.size() && empty < MAX_WAIT && rows[i + empty].isEmpty()) {
+	empty++;
+      }
+      if (empty == 0) {
+	writeRow(rows[i++], rowStream, options);
+	continue;
+      }
+      EngineCommand wait;
+      wait.type = ENGINE_CMD_WAIT;
+      wait.ticks = empty;
+      wait.writeGb(rowStream);
+      i += empty;
+    }
+  }
+
+  static void writeRow(const Row& row, std::ostream& rowStream, const CompressionOptions& options) {
+    if (options.rowMasks) {
+      row.writeMaskedGb(rowStream);
+    } else {
+      row.writeGb(rowStream);
+    }
+  }
+
   std::vector<Row> rows;
+  bool hasChannelPatterns;
+  uint8_t channelPatterns[GB_CHANNEL_COUNT];
 };
 
 Pattern::Pattern() : impl(std::make_unique<PatternImpl>()) {}
@@ -133,8 +361,12 @@ Pattern& Pattern::operator=(Pattern&& pattern) {
   return *this;
 }
 
-void Pattern::addRow(const Row& row) {
-  impl->addRow(row);
+void Pattern::reserve(size_t rows) {
+  impl->reserve(rows);
+}
+
+void Pattern::addRow(Row row) {
+  impl->addRow(std::move(row));
 }
 
 void Pattern::addJump(PatternNumber to) {
@@ -145,6 +377,18 @@ void Pattern::terminate(void) {
   impl->terminate();
 }
 
+void Pattern::playChannelPatterns(const uint8_t numbers[GB_CHANNEL_COUNT]) {
+  impl->playChannelPatterns(numbers);
+}
+
+void ChannelPattern::reserve(size_t notes) {
+  this->notes.reserve(notes);
+}
+
+void ChannelPattern::addNote(GbNote note) {
+  notes.push_back(std::move(note));
+}
+
 bool operator==(const PatternNumber& n, const PatternNumber& n_) {
   return n.patternNumber == n_.patternNumber;
 }
@@ -160,8 +404,8 @@ void PatternNumber::writeGb(std::ostream& ostream) const {
 
 class SongImpl {
 public:
-  void setTempo(uint8_t tempo) {
-    songMasterConfig.setTempo(tempo);
+  void addTrack(uint8_t tempo) {
+    tracks.push_back(Track{tempo, patternFlowControl.size(), Table()});
   }
 
   void addInstrument(const GbInstrument& instrument) {
@@ -174,79 +418,793 @@ public:
   }
 
   void addPattern(const PatternImpl& pattern) {
-    patterns.push_back(pattern.compress());
+    if(tracks.empty()) {
+      throw std::string("Pattern added before any track");
+    }
+    auto data = pattern.serialize(compressionOptions);
+    checkUnpackedSize(pattern, data.size());
+    PatternRef ref = {tracks.size() - 1, -1, patternBodies.size() - tracks.back().firstPattern};
+    patternBodies.push_back(storeBody(data, ref));
+    patternFlowControl.push_back(pattern.getFlowControlCommand());
+  }
+
+  uint8_t addChannelPattern(size_t channel, const std::vector<GbNote>& notes) {
+    if(!compressionOptions.perChannel) {
+      throw std::string("Channel pattern added to a song that isn't per-channel");
+    }
+    if(tracks.empty()) {
+      throw std::string("Pattern added before any track");
+    }
+    if(channel >= GB_CHANNEL_COUNT) {
+      std::stringstream err;
+      err << "Internal error - there's no channel " << channel;
+      throw err.str();
+    }
+    std::vector<char> data;
+    size_t length = 0;
+    for(const auto& note : notes) {
+      length += note.getLength();
+    }
+    data.reserve(length);
+    VectorStream bytes(data);
+    for(const auto& note : notes) {
+      note.writeGb(bytes);
+    }
+
+    // two channel patterns with the same notes are one pattern, even in the channel's own table
+    auto& bodies = tracks.back().channelBodies[channel];
+    PatternRef ref = {tracks.size() - 1, (int)channel, bodies.size()};
+    size_t body = storeBody(data, ref);
+    auto existing = std::find(bodies.begin(), bodies.end(), body);
+    if(existing != bodies.end()) {
+      return existing - bodies.begin();
+    }
+    if(bodies.size() == MAX_CHANNEL_PATTERNS) {
+      std::stringstream err;
+      err << "Too many different patterns on the " << channelName(channel) << " channel - at most "
+	  << MAX_CHANNEL_PATTERNS << " fit in its pattern table";
+      throw err.str();
+    }
+    bodies.push_back(body);
+    return bodies.size() - 1;
+  }
+
+  // patterns can't be compressed as they come in, since the dictionary is built from all of them -
+  // unless we're saving memory, and doing without one
+  void compressPatterns(void) {
+    // the instruments' waves are only known by now, too
+    compactInstruments();
+    if(compressionOptions.lowMemory) {
+      patternBytesWithoutDictionary = 0;
+      for(const auto& pattern : patterns) {
+	patternBytesWithoutDictionary += pattern.getLength();
+      }
+      compressionTime = std::chrono::duration_cast<std::chrono::milliseconds>(spillTime).count();
+      compressionThreads = 1;
+      buildTables();
+      return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    ThreadPool pool(compressionOptions.threads);
+    chooseDictionary(pool);
+
+    patterns = encodePatterns(pool, compressionOptions, dictionary);
+    // compress each again the plain way, too, so we can tell what the chosen mode bought us
+    baselines.clear();
+    auto baselineOptions = getBaselineOptions();
+    if(baselineOptions) {
+      for(const auto& baseline : encodePatterns(pool, *baselineOptions, dictionary)) {
+	baselines.push_back(PatternCost{baseline.getLength(), baseline.getDecodeCycles()});
+      }
+    }
+
+    compressionTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start).count();
+    compressionThreads = pool.getThreadCount();
+
+    buildTables();
+  }
+
+  void compactInstruments(void) {
+    uncompactedInstrumentBytes = 0;
+    for(auto& instrument : instruments) {
+      uncompactedInstrumentBytes += instrument.getLength();
+      instrument.compact(compressionOptions.holds);
+    }
   }
 
-  void addWave(const Wave& wave) {
+  uint8_t addWave(const Wave& wave) {
+    auto existing = std::find(waves.begin(), waves.end(), wave);
+    if(existing != waves.end()) {
+      return existing - waves.begin();
+    }
+    if(waves.size() == MAX_WAVES) {
+      std::stringstream err;
+      err << "Too many waves - at most " << MAX_WAVES << " different ones fit in the wave table";
+      throw err.str();
+    }
     waves.push_back(wave);
+    return waves.size() - 1;
+  }
+
+  void setInstrumentWaves(size_t instrument, const std::vector<uint8_t>& waveIndices) {
+    if(instrument >= instruments.size()) {
+      std::stringstream err;
+      err << "Wave given for instrument " << instrument << ", which doesn't exist";
+      throw err.str();
+    }
+    instruments[instrument].setWaves(waveIndices);
+  }
+
+  void setCompressionOptions(const CompressionOptions& options) {
+    compressionOptions = options;
+  }
+
+  void printSummary(std::ostream& ostream) const {
+    PatternTotals totals = {{0, 0}, {0, 0}, 0, 0};
+    for(size_t i = 0; i < patternBodies.size(); i++) {
+      printPattern(ostream, getPatternRef(i), patternBodies[i], totals);
+    }
+    for(size_t track = 0; track < tracks.size(); track++) {
+      for(size_t channel = 0; channel < GB_CHANNEL_COUNT; channel++) {
+	const auto& bodies = tracks[track].channelBodies[channel];
+	for(size_t i = 0; i < bodies.size(); i++) {
+	  printPattern(ostream, PatternRef{track, (int)channel, i}, bodies[i], totals);
+	}
+      }
+    }
+    ostream << "Patterns total: ";
+    if(baselines.size()) {
+      printComparison(ostream, totals.cost, totals.baselineCost);
+    } else {
+      printCost(ostream, totals.cost);
+    }
+    ostream << std::endl;
+    ostream << "Duplicate patterns: " << totals.duplicates << "; saved " << totals.duplicateBytes << " bytes" << std::endl;
+
+    size_t instrumentBytes = 0;
+    for(const auto& instrument : instruments) {
+      instrumentBytes += instrument.getLength();
+    }
+    ostream << "Instruments: " << instrumentBytes << " bytes; compacting saved "
+	    << uncompactedInstrumentBytes - instrumentBytes << " bytes" << std::endl;
+
+    ostream << "Dictionary: " << dictionary.size() << " bytes; patterns without it: "
+	    << patternBytesWithoutDictionary << " bytes; saved "
+	    << (int)patternBytesWithoutDictionary - (int)(totals.cost.bytes + dictionary.size())
+	    << " bytes overall" << std::endl;
+    ostream << "Compressed in " << compressionTime << " ms on " << compressionThreads
+	    << (compressionThreads == 1 ? " thread" : " threads") << std::endl;
+
+    printTable(ostream, "Waves", waveTable);
+    for(size_t i = 0; i < tracks.size(); i++) {
+      if(tracks.size() == 1) {
+	printTable(ostream, "Pattern table", tracks[i].patternTable);
+      } else {
+	std::ostringstream name;
+	name << "Track " << i << " pattern table";
+	printTable(ostream, name.str().c_str(), tracks[i].patternTable);
+      }
+    }
+    printTable(ostream, "Instrument table", instrumentTable);
   }
 
 private:
   std::vector<GbInstrument> instruments;
+  // how big the instruments were before compactInstruments
+  size_t uncompactedInstrumentBytes = 0;
   SongMasterConfig songMasterConfig;
+  std::vector<optional<EngineCommand>> patternFlowControl;
+
+  /* Which pattern's which: the track it's in and its number there - or for a channel pattern,
+     its channel and its number in that channel's table */
+  struct PatternRef {
+    size_t track;
+    // -1 for the track's own patterns
+    int channel;
+    size_t number;
+
+    bool operator==(const PatternRef& ref) const {
+      return track == ref.track && channel == ref.channel && number == ref.number;
+    }
+  };
+
+  /* Patterns that come out the same - a chorus copied to a new pattern number, say, or the same
+     pattern in two tracks - share one body, which the pattern table points them all at. These
+     are the bodies (serialized, and then compressed), how big each was before it was
+     compressed, and the pattern each one was first added as; every pattern has the index of
+     its body. */
+  std::vector<std::vector<char>> patternData;
   std::vector<CompressedPattern> patterns;
+  std::vector<size_t> bodySizes;
+  std::vector<PatternRef> bodyPatterns;
+  std::vector<size_t> patternBodies;
+  // bodies by a hash of their serialized data, to find the ones a new pattern might be the same as
+  std::unordered_multimap<size_t, size_t> bodiesByHash;
+
+  static size_t hashData(const std::vector<char>& data) {
+    return std::hash<std::string_view>()(std::string_view(data.data(), data.size()));
+  }
+
+  // returns the index of the pattern's body, which might well be one that's already there
+  size_t storeBody(std::vector<char>& data, const PatternRef& ref) {
+    if(compressionOptions.lowMemory) {
+      return spillPattern(data, ref);
+    }
+    return addBody(data, ref);
+  }
+
+  size_t addBody(std::vector<char>& data, const PatternRef& ref) {
+    size_t hash = hashData(data);
+    auto candidates = bodiesByHash.equal_range(hash);
+    for(auto candidate = candidates.first; candidate != candidates.second; ++candidate) {
+      if(patternData[candidate->second] == data) {
+	return candidate->second;
+      }
+    }
+    bodiesByHash.emplace(hash, patternData.size());
+    bodyPatterns.push_back(ref);
+    bodySizes.push_back(data.size());
+    patternData.push_back(std::move(data));
+    return patternData.size() - 1;
+  }
   std::vector<Wave> waves;
+  CompressionOptions compressionOptions;
+  std::vector<char> dictionary;
+  unsigned patternBytesWithoutDictionary;
+
+  unsigned compressionTime;
+  unsigned compressionThreads;
+
+  /* In low memory mode, each pattern's compressed the moment it's added and written straight
+     out to a temporary file, which the Writer copies into the song; all that's kept of it is
+     its CompressedPattern, minus the bytes. */
+  std::unique_ptr<std::FILE, int (*)(std::FILE*)> spillFile{nullptr, &std::fclose};
+  optional<PatternEncoder> spillEncoder;
+  optional<PatternEncoder> spillBaselineEncoder;
+  std::chrono::steady_clock::duration spillTime{};
+  // where each body starts in the file
+  std::vector<long> spillOffsets;
+  long spillSize = 0;
+
+  bool isSpilled(size_t body, const CompressedPattern& pattern) {
+    if(patterns[body].getCodec() != pattern.getCodec() || patterns[body].getLength() != pattern.getLength()) {
+      return false;
+    }
+    std::vector<char> spilled(pattern.getLength());
+    std::FILE *file = spillFile.get();
+    bool same = std::fseek(file, spillOffsets[body], SEEK_SET) == 0
+      && std::fread(spilled.data(), 1, spilled.size(), file) == spilled.size()
+      && pattern.isSame(spilled);
+    // back to the end, for the next pattern to be written
+    if(std::fseek(file, 0, SEEK_END) != 0) {
+      throw std::string("Couldn't write a pattern to its temporary file");
+    }
+    return same;
+  }
+
+  size_t spillPattern(const std::vector<char>& data, const PatternRef& ref) {
+    auto start = std::chrono::steady_clock::now();
+    if(!spillFile) {
+      spillFile.reset(std::tmpfile());
+      if(!spillFile) {
+	throw std::string("Couldn't create a temporary file for the patterns");
+      }
+      spillEncoder.emplace(compressionOptions);
+      auto baselineOptions = getBaselineOptions();
+      if(baselineOptions) {
+	spillBaselineEncoder.emplace(*baselineOptions);
+      }
+    }
+
+    // the serialized data isn't kept, but two patterns that compress to the same bytes are the
+    // same, so a new one's checked against what's already been written out
+    size_t hash = hashData(data);
+    auto encoded = spillEncoder->encode(data, dictionary);
+    auto candidates = bodiesByHash.equal_range(hash);
+    for(auto candidate = candidates.first; candidate != candidates.second; ++candidate) {
+      if(isSpilled(candidate->second, encoded)) {
+	spillTime += std::chrono::steady_clock::now() - start;
+	return candidate->second;
+      }
+    }
+    bodiesByHash.emplace(hash, patterns.size());
+    bodyPatterns.push_back(ref);
+    bodySizes.push_back(data.size());
+    spillOffsets.push_back(spillSize);
+    spillSize += encoded.getLength();
+    patterns.push_back(std::move(encoded));
+    patterns.back().spill(spillFile.get());
+    if(spillBaselineEncoder) {
+      auto baseline = spillBaselineEncoder->encode(data, dictionary);
+      baselines.push_back(PatternCost{baseline.getLength(), baseline.getDecodeCycles()});
+    }
+    spillTime += std::chrono::steady_clock::now() - start;
+    return patterns.size() - 1;
+  }
+
+  /* the patterns are independent of each other, so they're shared out across the pool, each
+     thread with its own encoder. Every result goes in its pattern's slot, so the output is the
+     same no matter which thread got which pattern. */
+  std::vector<CompressedPattern> encodePatterns(ThreadPool& pool, const CompressionOptions& options,
+						const std::vector<char>& dictionary) const {
+    std::vector<PatternEncoder> encoders;
+    encoders.reserve(pool.getThreadCount());
+    for(unsigned i = 0; i < pool.getThreadCount(); i++) {
+      encoders.emplace_back(options);
+    }
+
+    std::vector<optional<CompressedPattern>> encoded(patternData.size());
+    pool.forEach(patternData.size(), [&](unsigned worker, size_t i) {
+      encoded[i].emplace(encoders[worker].encode(patternData[i], dictionary));
+    });
+
+    std::vector<CompressedPattern> result;
+    result.reserve(encoded.size());
+    for(auto& pattern : encoded) {
+      result.push_back(std::move(*pattern));
+    }
+    return result;
+  }
+
+  unsigned compressedSize(ThreadPool& pool, const std::vector<char>& dictionary) const {
+    unsigned size = dictionary.size();
+    for(const auto& pattern : encodePatterns(pool, compressionOptions, dictionary)) {
+      size += pattern.getLength();
+    }
+    return size;
+  }
+
+  // try a few dictionary sizes and keep whichever makes the song smallest, counting the
+  // dictionary itself - which might well mean no dictionary at all
+  void chooseDictionary(ThreadPool& pool) {
+    dictionary.clear();
+    patternBytesWithoutDictionary = compressedSize(pool, dictionary);
+    unsigned bestSize = patternBytesWithoutDictionary;
+    // a per-channel song's patterns are unpacked one after another, so only the first could
+    // ever sit right after the dictionary
+    if(compressionOptions.perChannel) {
+      return;
+    }
+
+    const size_t maxSizes[] = {32, 64, 128, MAX_DICTIONARY_SIZE};
+    for(size_t maxSize : maxSizes) {
+      // the dictionary has to fit in the decoder's window alongside at least one byte of pattern
+      maxSize = std::min<size_t>(maxSize, compressionOptions.window - 1);
+      auto candidate = buildDictionary(patternData, maxSize);
+      if(candidate.empty()) {
+	continue;
+      }
+      unsigned size = compressedSize(pool, candidate);
+      if(size < bestSize) {
+	bestSize = size;
+	dictionary = candidate;
+      }
+    }
+  }
+
+  // the engine copies the dictionary in just below SongData, and a match can only reach
+  // 255 bytes back
+  static const size_t MAX_DICTIONARY_SIZE = 255;
+
+  // the wave table is a page of RAM
+  static const size_t MAX_WAVES = 256 / 16;
+
+  // channel pattern numbers are doubled, and $FF is ChannelPattern::NONE
+  static const size_t MAX_CHANNEL_PATTERNS = 128;
+
+  // all a per-channel song's pattern's channel patterns are unpacked into SongData along with it
+  static const size_t SONG_DATA_SIZE = 0x600;
+
+  // they're counted whatever they're encoded as, though the stored ones stay in the ROM
+  void checkUnpackedSize(const PatternImpl& pattern, size_t size) const {
+    for(size_t channel = 0; channel < GB_CHANNEL_COUNT; channel++) {
+      auto number = pattern.getChannelPattern(channel);
+      if(number) {
+	size += bodySizes[tracks.back().channelBodies[channel].at(*number)];
+      }
+    }
+    if(size > SONG_DATA_SIZE) {
+      std::stringstream err;
+      err << "Pattern and its channel patterns come to " << size << " bytes, but only "
+	  << SONG_DATA_SIZE << " fit in SongData";
+      throw err.str();
+    }
+  }
+
+  static const char *channelName(size_t channel) {
+    static const char *const names[GB_CHANNEL_COUNT] = {"square 1", "square 2", "wave", "noise"};
+    return names[channel];
+  }
+
+  /* LoadSong copies the waves and the pattern and instrument tables into RAM, decompressing any
+     that are stored LZ compressed - which they are, whenever that makes them smaller */
+  struct Table {
+    std::vector<char> data;
+    std::vector<char> packed;
+
+    bool isPacked(void) const {
+      return packed.size() < data.size();
+    }
+  };
+  Table waveTable;
+  Table instrumentTable;
+
+  /* Every track has its own tempo and pattern table, but they all share the instruments and
+     waves. A track's patterns are numbered from 0 in its own pattern table; in the song they
+     follow on from the last track's. */
+  struct Track {
+    uint8_t tempo;
+    size_t firstPattern;
+    Table patternTable;
+    /* In a per-channel song, each channel's patterns' bodies, by number, and the table the
+       engine looks them up in; those are left in the ROM, so they're never compressed */
+    std::vector<size_t> channelBodies[GB_CHANNEL_COUNT];
+    std::vector<char> channelTables[GB_CHANNEL_COUNT];
+  };
+  std::vector<Track> tracks;
+
+  // one past the last of the track's patterns
+  size_t getPatternsEnd(size_t track) const {
+    return track + 1 < tracks.size() ? tracks[track + 1].firstPattern : patternBodies.size();
+  }
+
+  // the top two bits of each pattern table entry are taken by the pattern's codec
+  static const uint16_t MAX_PATTERN_ADDRESS = 0x3FFF;
+  // the engine reads the song through plain pointers, with no bank switching, so all of it has to
+  // be in the same ROM bank
+  static const size_t ROM_BANK_SIZE = 0x4000;
+
+  static void checkEnd(size_t end, size_t limit, const char *what) {
+    if(end > limit) {
+      std::stringstream err;
+      err << "Song is too big - " << what << " must end within " << limit
+	  << " bytes of the end of the track directory";
+      throw err.str();
+    }
+  }
+
+  // everything before the track directory ends, where the offsets in the song are from
+  size_t getHeaderLength(void) const {
+    size_t length = 2 + 1 + dictionary.size() + 1;
+    for(const Table *table : {&waveTable, &instrumentTable}) {
+      length += 1 + (table->isPacked() ? table->packed : table->data).size();
+    }
+    return length + 1 + 2 * tracks.size();
+  }
+
+  size_t getTrackLength(size_t track) const {
+    const Track& t = tracks[track];
+    const std::vector<char>& table = t.patternTable.isPacked() ? t.patternTable.packed : t.patternTable.data;
+    size_t length = 3 + table.size() + getPatternsEnd(track) - t.firstPattern;
+    if (compressionOptions.perChannel) {
+      for (const auto& channelTable : t.channelTables) {
+	length += 1 + channelTable.size();
+      }
+    }
+    return length;
+  }
+
+  /* The offsets in the pattern and instrument tables are from the end of the track directory,
+     where the patterns start, rather than the start of the song, so that what's in the tables
+     doesn't depend on how well they compress. */
+  void buildTables(void) {
+    waveTable.data.clear();
+    for(const auto& wave : waves) {
+      std::ostringstream bytes;
+      wave.writeGb(bytes);
+      std::string written = bytes.str();
+      waveTable.data.insert(waveTable.data.end(), written.begin(), written.end());
+    }
+    if(waveTable.data.empty()) {
+      // LoadSong always copies at least one byte, so put a dummy byte in
+      waveTable.data.push_back(0);
+    }
+
+    if(tracks.empty()) {
+      throw std::string("Song has no tracks");
+    }
+    // the bodies are written out in order, each only once
+    size_t opcodeAddress = 0;
+    std::vector<uint16_t> bodyAddresses;
+    for(const auto& pattern : patterns) {
+      checkEnd(opcodeAddress + pattern.getLength(), MAX_PATTERN_ADDRESS + 1, "patterns");
+      bodyAddresses.push_back(opcodeAddress);
+      opcodeAddress += pattern.getLength();
+    }
+
+    for(size_t track = 0; track < tracks.size(); track++) {
+      if(tracks[track].firstPattern == getPatternsEnd(track)) {
+	std::stringstream err;
+	err << "Track " << track << " has no patterns";
+	throw err.str();
+      }
+      Table& patternTable = tracks[track].patternTable;
+      patternTable.data.clear();
+      for(size_t i = tracks[track].firstPattern; i < getPatternsEnd(track); i++) {
+	addEntry(patternTable.data, patternBodies[i], bodyAddresses);
+      }
+      for(size_t channel = 0; channel < GB_CHANNEL_COUNT; channel++) {
+	auto& channelTable = tracks[track].channelTables[channel];
+	channelTable.clear();
+	for(size_t body : tracks[track].channelBodies[channel]) {
+	  addEntry(channelTable, body, bodyAddresses);
+	}
+      }
+    }
+
+    size_t patternsEnd = opcodeAddress;
+
+    instrumentTable.data.clear();
+    for(const auto& instrument : instruments) {
+      instrumentTable.data.push_back(opcodeAddress & 0x00FF);
+      instrumentTable.data.push_back(opcodeAddress >> 8 & 0x00FF);
+      opcodeAddress += instrument.getLength();
+    }
+
+    // LoadSong unpacks them with Decompress, and there's no dictionary in front of them
+    CompressionOptions tableOptions = compressionOptions;
+    tableOptions.window = CompressionOptions::MAX_WINDOW;
+    tableOptions.streaming = false;
+    tableOptions.extended = false;
+    Compressor compressor(tableOptions);
+    std::vector<Table*> packedTables = {&waveTable, &instrumentTable};
+    for(auto& track : tracks) {
+      packedTables.push_back(&track.patternTable);
+    }
+    for(Table *table : packedTables) {
+      table->packed.clear();
+      compressor.compress(table->data, table->packed);
+    }
+
+    // the tracks come last, after the instruments
+    size_t instrumentsEnd = opcodeAddress;
+    size_t tracksEnd = instrumentsEnd;
+    for(size_t track = 0; track < tracks.size(); track++) {
+      tracksEnd += getTrackLength(track);
+    }
+    size_t bankLimit = ROM_BANK_SIZE - getHeaderLength();
+    checkEnd(patternsEnd, bankLimit, "patterns");
+    checkEnd(instrumentsEnd, bankLimit, "instruments");
+    checkEnd(tracksEnd, bankLimit, "tracks");
+  }
+
+  void addEntry(std::vector<char>& table, size_t body, const std::vector<uint16_t>& bodyAddresses) const {
+    uint16_t entry = bodyAddresses[body] | patterns[body].getCodec() << 14;
+    table.push_back(entry & 0x00FF);
+    table.push_back(entry >> 8);
+  }
+
+  // in the successor table, for a pattern the song stops at
+  static const uint8_t NO_SUCCESSOR = 0xFF;
+
+  // which pattern the engine plays after this one, in the same (doubled) form it keeps in
+  // NextPattern - so numbered within the track
+  uint8_t getSuccessor(size_t track, size_t patternIndex) const {
+    const auto& command = patternFlowControl[patternIndex];
+    if(command && command->type == ENGINE_CMD_JMP_FRAME) {
+      return command->newFrame * 2;
+    }
+    if(command && command->type == ENGINE_CMD_STOP) {
+      return NO_SUCCESSOR;
+    }
+    if(patternIndex + 1 < getPatternsEnd(track)) {
+      return (patternIndex + 1 - tracks[track].firstPattern) * 2;
+    }
+    return NO_SUCCESSOR;
+  }
+
+  PatternRef getPatternRef(size_t patternIndex) const {
+    size_t track = tracks.size() - 1;
+    while(tracks[track].firstPattern > patternIndex) {
+      track--;
+    }
+    return PatternRef{track, -1, patternIndex - tracks[track].firstPattern};
+  }
+
+  // numbered as they are in their track, which only needs saying if there's more than one
+  void printPatternName(std::ostream& ostream, const PatternRef& ref) const {
+    std::string name = "pattern";
+    if(ref.channel >= 0) {
+      name = std::string(channelName(ref.channel)) + " " + name;
+    }
+    if(tracks.size() > 1) {
+      ostream << "Track " << ref.track << " ";
+    } else {
+      name[0] = toupper(name[0]);
+    }
+    ostream << name << " " << ref.number;
+  }
+
+  struct PatternCost {
+    unsigned bytes;
+    unsigned cycles;
+  };
+
+  struct PatternTotals {
+    PatternCost cost;
+    PatternCost baselineCost;
+    unsigned duplicates;
+    unsigned duplicateBytes;
+  };
+
+  void printPattern(std::ostream& ostream, const PatternRef& ref, size_t body, PatternTotals& totals) const {
+    printPatternName(ostream, ref);
+    if(!(bodyPatterns[body] == ref)) {
+      std::ostringstream original;
+      printPatternName(original, bodyPatterns[body]);
+      std::string name = original.str();
+      name[0] = tolower(name[0]);
+      ostream << ": same as " << name << std::endl;
+      totals.duplicates++;
+      totals.duplicateBytes += patterns[body].getLength();
+      return;
+    }
+    PatternCost cost = {patterns[body].getLength(), patterns[body].getDecodeCycles()};
+    ostream << " (" << codecName(patterns[body].getCodec()) << "): ";
+    if(baselines.size()) {
+      printComparison(ostream, cost, baselines[body]);
+      totals.baselineCost.bytes += baselines[body].bytes;
+      totals.baselineCost.cycles += baselines[body].cycles;
+    } else {
+      printCost(ostream, cost);
+    }
+    ostream << std::endl;
+    totals.cost.bytes += cost.bytes;
+    totals.cost.cycles += cost.cycles;
+  }
+
+  static void printTable(std::ostream& ostream, const char *name, const Table& table) {
+    ostream << name << ": " << table.data.size() << " bytes";
+    if(table.isPacked()) {
+      ostream << ", compressed to " << table.packed.size();
+    }
+    ostream << std::endl;
+  }
+
+  std::vector<PatternCost> baselines;
+
+  // the mode each pattern gets compared against in the summary
+  optional<CompressionOptions> getBaselineOptions(void) const {
+    optional<CompressionOptions> baselineOptions;
+    switch(compressionOptions.mode) {
+    case COMPRESSION_GREEDY:
+      break;
+    case COMPRESSION_OPTIMAL:
+      baselineOptions.emplace(compressionOptions);
+      baselineOptions->mode = COMPRESSION_GREEDY;
+      break;
+    case COMPRESSION_FAST_DECODE:
+      baselineOptions.emplace(compressionOptions);
+      baselineOptions->mode = COMPRESSION_OPTIMAL;
+      break;
+    }
+    return baselineOptions;
+  }
+
+  static const char *codecName(PatternCodec codec) {
+    switch(codec) {
+    case PATTERN_LZ: return "lz";
+    case PATTERN_RLE: return "rle";
+    case PATTERN_STORED: return "stored";
+    case PATTERN_LZX: return "lzx";
+    }
+    return "unknown";
+  }
+
+  const char *modeName(CompressionMode mode) const {
+    switch(mode) {
+    case COMPRESSION_GREEDY: return "greedy";
+    case COMPRESSION_OPTIMAL: return "optimal";
+    case COMPRESSION_FAST_DECODE: return "fast decode";
+    }
+    return "unknown";
+  }
+
+  static void printCost(std::ostream& ostream, const PatternCost& cost) {
+    ostream << cost.bytes << " bytes, ~" << cost.cycles << " decode cycles";
+  }
+
+  void printComparison(std::ostream& ostream, const PatternCost& cost, const PatternCost& baseline) const {
+    printCost(ostream, cost);
+    ostream << " (" << modeName(getBaselineOptions()->mode) << " ";
+    printCost(ostream, baseline);
+    ostream << "; saved " << (int)baseline.bytes - (int)cost.bytes << " bytes, "
+	    << (int)baseline.cycles - (int)cost.cycles << " cycles)";
+  }
 
   class Writer {
   public:
-    Writer(const SongImpl& song, std::ostream& ostream) : song(song), ostream(ostream), opcodeAddress(0) {}
+    Writer(const SongImpl& song, std::ostream& ostream) : song(song), ostream(ostream) {}
 
     void writeGb(void) {
-      opcodeAddress = computeOpcodeAddress();
       writeSongMasterConfig();
-      writeWaves();
-      writePatternTable();
-      writeInstrumentTable();
+      writeDictionary();
+      writePackedTables();
+      writeTable(song.waveTable);
+      writeTable(song.instrumentTable);
+      writeTrackDirectory();
       writePatterns();
       writeInstruments();
+      for (size_t track = 0; track < song.tracks.size(); track++) {
+	writeTrack(track);
+      }
     }
 
   private:
     const SongImpl& song;
     std::ostream& ostream;
-    uint16_t opcodeAddress;
-
-    uint16_t computeOpcodeAddress() const {
-      return 
-	SongMasterConfig::GB_SIZE
-	+ (song.waves.size() ? song.waves.size() * 16 : 1) + 1
-	+ song.patterns.size() * 2 + 1
-	+ song.instruments.size() * 2 + 1;
-    }
 
     void writeSongMasterConfig(void) {
       song.songMasterConfig.writeGb(ostream);
     }
 
-    void writeWaves(void) {
-      uint8_t waveBytes = song.waves.size() * 16;
-      if(waveBytes) {
-	ostream.put(waveBytes);
-	for(const auto& wave : song.waves) {
-	  wave.writeGb(ostream);
+    void writeDictionary(void) {
+      ostream.put(song.dictionary.size());
+      ostream.write(song.dictionary.data(), song.dictionary.size());
+    }
+
+    // one bit for each table, in the order they're written, set if it's compressed
+    void writePackedTables(void) {
+      const Table *tables[] = {&song.waveTable, &song.instrumentTable};
+      uint8_t packed = 0;
+      for(size_t i = 0; i < 2; i++) {
+	if(tables[i]->isPacked()) {
+	  packed |= 1 << i;
 	}
-      } else {
-	// since 0 => 256, put a dummy byte in
-	ostream.put(1);
-	ostream.put(0);
       }
+      ostream.put(packed);
     }
 
-    void writeInstrumentTable(void) {
-      ostream.put(song.instruments.size() * 2);
+    /* The tracks come after the patterns and instruments, so the directory gives where each
+       starts, from the end of the directory - like everything else in the song, since that's
+       where the patterns start */
+    void writeTrackDirectory(void) {
+      ostream.put(song.tracks.size());
+      uint16_t offset = 0;
+      for (const auto& pattern : song.patterns) {
+	offset += pattern.getLength();
+      }
       for (const auto& instrument : song.instruments) {
-	ostream.put(opcodeAddress & 0x00FF);
-	ostream.put(opcodeAddress >> 8);
-	opcodeAddress += instrument.getLength(); // extra byte for length
+	offset += instrument.getLength();
+      }
+      for (size_t track = 0; track < song.tracks.size(); track++) {
+	ostream.put(offset & 0x00FF);
+	ostream.put(offset >> 8);
+	offset += song.getTrackLength(track);
       }
     }
 
-    void writePatternTable(void) {
-      ostream.put(song.patterns.size() * 2);
-      for (const auto& pattern : song.patterns) {
-	ostream.put(opcodeAddress & 0x00FF);
-	ostream.put(opcodeAddress >> 8);
-	opcodeAddress += pattern.getLength();
+    // each track's tempo, whether its pattern table's compressed (and whether the song's
+    // per-channel), the table itself and then its successor table - and in a per-channel song,
+    // each channel's pattern table
+    void writeTrack(size_t track) {
+      const Track& t = song.tracks[track];
+      ostream.put(t.tempo);
+      ostream.put((t.patternTable.isPacked() ? 1 : 0) | (song.compressionOptions.perChannel ? 2 : 0));
+      writeTable(t.patternTable);
+      writeSuccessorTable(track);
+      if (song.compressionOptions.perChannel) {
+	for (const auto& channelTable : t.channelTables) {
+	  // how many patterns, rather than bytes, so that 128 of them fit
+	  ostream.put(channelTable.size() / 2);
+	  ostream.write(channelTable.data(), channelTable.size());
+	}
+      }
+    }
+
+    void writeTable(const Table& table) {
+      // 0 => 256
+      ostream.put(table.data.size());
+      const std::vector<char>& bytes = table.isPacked() ? table.packed : table.data;
+      ostream.write(bytes.data(), bytes.size());
+    }
+
+    // lets the engine start decompressing a pattern before the song gets to it
+    void writeSuccessorTable(size_t track) {
+      for (size_t i = song.tracks[track].firstPattern; i < song.getPatternsEnd(track); i++) {
+	ostream.put(song.getSuccessor(track, i));
       }
     }
 
@@ -257,10 +1215,27 @@ private:
     }
 
     void writePatterns(void) {
+      if (song.spillFile) {
+	copySpilledPatterns();
+	return;
+      }
       for (const auto& pattern : song.patterns) {
 	pattern.writeGb(ostream);
       }
     }
+
+    void copySpilledPatterns(void) {
+      std::FILE *file = song.spillFile.get();
+      std::rewind(file);
+      char chunk[65536];
+      size_t got;
+      while ((got = std::fread(chunk, 1, sizeof chunk, file)) > 0) {
+	ostream.write(chunk, got);
+      }
+      if (std::ferror(file)) {
+	throw std::string("Couldn't read the patterns back from their temporary file");
+      }
+    }
   };
 };
 
@@ -272,8 +1247,8 @@ void Song::addInstrument(const GbInstrument& instrument) {
   impl->addInstrument(instrument);
 }
 
-void Song::setTempo(uint8_t tempo) {
-  impl->setTempo(tempo);
+void Song::addTrack(uint8_t tempo) {
+  impl->addTrack(tempo);
 }
 
 void Song::writeGb(std::ostream& ostream) const {
@@ -284,6 +1259,10 @@ void Song::addPattern(const Pattern& pattern) {
   impl->addPattern(*pattern.impl);
 }
 
+uint8_t Song::addChannelPattern(size_t channel, const ChannelPattern& channelPattern) {
+  return impl->addChannelPattern(channel, channelPattern.notes);
+}
+
 std::ostream& operator<<(std::ostream& ostream, const PatternNumber& patternNumber) {
   ostream << (unsigned)patternNumber.patternNumber;
   return ostream;
@@ -301,36 +1280,61 @@ PatternNumber PatternNumber::next(void) const {
   }
 }
 
-GbNote::GbNote() : pitch(0) {}
+GbNote::GbNote() : commandCount(0), pitch(0) {}
 
-GbNote::GbNote(uint8_t pitch) : pitch(pitch) {}
+GbNote::GbNote(uint8_t pitch) : commandCount(0), pitch(pitch) {}
 
 Row::Row() : hasFlowControlCommand(false) {}
 
-void Row::setSquareNote1(const GbNote& note) {
-  squareNote1 = note;
+void Row::setSquareNote1(GbNote note) {
+  squareNote1 = std::move(note);
+}
+
+void Row::setSquareNote2(GbNote note) {
+  squareNote2 = std::move(note);
+}
+
+void Row::setWaveNote(GbNote note) {
+  waveNote = std::move(note);
+}
+
+void Row::setNoiseNote(GbNote note) {
+  noiseNote = std::move(note);
 }
 
-void Row::setSquareNote2(const GbNote& note) {
-  squareNote2 = note;
+uint8_t Song::addWave(const Wave& wave) {
+  return impl->addWave(wave);
 }
 
-void Row::setWaveNote(const GbNote& note) {
-  waveNote = note;
+void Song::setInstrumentWaves(size_t instrument, const std::vector<uint8_t>& waveIndices) {
+  impl->setInstrumentWaves(instrument, waveIndices);
 }
 
-void Row::setNoiseNote(const GbNote& note) {
-  noiseNote = note;
+void Song::setCompressionOptions(const CompressionOptions& options) {
+  impl->setCompressionOptions(options);
 }
 
-void Song::addWave(const Wave& wave) {
-  impl->addWave(wave);
+void Song::compressPatterns(void) {
+  impl->compressPatterns();
+}
+
+void Song::printSummary(std::ostream& ostream) const {
+  impl->printSummary(ostream);
 }
 
 int PatternNumber::toInt() const {
   return patternNumber;
 }
 
+void Row::writeControlGb(std::ostream& ostream) const {
+  if(engineCommands.empty()) {
+    ostream.put(0);
+  } else {
+    // the engine only runs one song control command a tick
+    engineCommands.at(0).writeGb(ostream);
+  }
+}
+
 void Row::writeGb(std::ostream& ostream) const {
   if(this->hasFlowControlCommand) {
     engineCommands.at(0).writeGb(ostream);
@@ -348,9 +1352,37 @@ void Row::writeGb(std::ostream& ostream) const {
   }
 }
 
+/* A masked row has the same song control commands, but instead of ending them with a NOP, it
+   ends them with the mask - bit 0 for square 1, up to bit 3 for noise - doubled, so that it's
+   even and can't be mistaken for a command */
+void Row::writeMaskedGb(std::ostream& ostream) const {
+  if(this->hasFlowControlCommand) {
+    engineCommands.at(0).writeGb(ostream);
+    return;
+  }
+  for (const auto& engineCommand : engineCommands) {
+    engineCommand.writeGb(ostream);
+  }
+
+  const GbNote *notes[] = {&squareNote1, &squareNote2, &waveNote, &noiseNote};
+  uint8_t mask = 0;
+  for (size_t channel = 0; channel < GB_CHANNEL_COUNT; channel++) {
+    if(!notes[channel]->isEmpty()) {
+      mask |= 1 << channel;
+    }
+  }
+  ostream.put(mask * 2);
+
+  for (const auto *note : notes) {
+    if(!note->isEmpty()) {
+      note->writeGb(ostream);
+    }
+  }
+}
+
 uint16_t Row::getLength(void) const {
   if(this->hasFlowControlCommand) {
-    return 1;
+    return engineCommands.at(0).getLength();
   } else {
     uint16_t length = 0;
     for (const auto& engineCommand : engineCommands) {
@@ -367,6 +1399,11 @@ uint16_t Row::getLength(void) const {
   }
 }
 
+bool Row::isEmpty(void) const {
+  return engineCommands.empty()
+    && squareNote1.isEmpty() && squareNote2.isEmpty() && waveNote.isEmpty() && noiseNote.isEmpty();
+}
+
 void EngineCommand::writeGb(std::ostream& ostream) const {
   // engine commands increment by two to make table lookup faster
   // also, 0 is a NOP, so they start at 1 (3, 5, ...)
@@ -375,7 +1412,9 @@ void EngineCommand::writeGb(std::ostream& ostream) const {
   case ENGINE_CMD_SET_RATE: ostream.put(newRate); break;
   case ENGINE_CMD_STOP: break;
   case ENGINE_CMD_END_OF_PAT: break;
-  case ENGINE_CMD_JMP_FRAME: ostream.put(newFrame); break;
+  // frames double up just like pattern numbers do
+  case ENGINE_CMD_JMP_FRAME: ostream.put(newFrame * 2); break;
+  case ENGINE_CMD_WAIT: ostream.put(ticks); break;
   }
 }
 
@@ -385,6 +1424,7 @@ uint16_t EngineCommand::getLength(void) const {
   case ENGINE_CMD_STOP: return 1;
   case ENGINE_CMD_END_OF_PAT: return 1;
   case ENGINE_CMD_JMP_FRAME: return 2;
+  case ENGINE_CMD_WAIT: return 2;
   }
   
   std::stringstream err;
@@ -393,8 +1433,8 @@ uint16_t EngineCommand::getLength(void) const {
 }
 
 void GbNote::writeGb(std::ostream& ostream) const {
-  for (const auto& command : commands) {
-    command.writeGb(ostream);
+  for (size_t i = 0; i < commandCount; i++) {
+    commands[i].writeGb(ostream);
   }
 
   // notes are odd numbered... (1, 3, ...)
@@ -402,10 +1442,14 @@ void GbNote::writeGb(std::ostream& ostream) const {
   ostream.put(pitch ? pitch * 2 + 1 : 0);
 }
 
+bool GbNote::isEmpty(void) const {
+  return commandCount == 0 && pitch == 0;
+}
+
 uint16_t GbNote::getLength(void) const {
   uint16_t length = 0;
-  for (const auto& command : commands) {
-    length += command.getLength();
+  for (size_t i = 0; i < commandCount; i++) {
+    length += commands[i].getLength();
   }
   length++; // for the note
   return length;
@@ -446,8 +1490,8 @@ void GbInstrument::writeGb(std::ostream& ostream) const {
   }
 }
 
-uint8_t GbInstrument::getLength(void) const {
-  uint8_t length = 0;
+uint16_t GbInstrument::getLength(void) const {
+  uint16_t length = 0;
   for (const auto& command : commands) {
     length += command.getLength();
   }
@@ -455,18 +1499,311 @@ uint8_t GbInstrument::getLength(void) const {
 }
 
 void GbNote::addCommand(const ChannelCommand& command) {
-  commands.push_back(command);
+  if(commandCount == MAX_COMMANDS) {
+    throw std::string("Internal error - too many commands for one note");
+  }
+  commands[commandCount++] = command;
 }
 
 void GbInstrument::addCommand(const InstrumentCommand& command) {
   commands.push_back(command);
 }
 
+void GbInstrument::setWaves(const std::vector<uint8_t>& waveIndices) {
+  for (auto& command : commands) {
+    if(command.type != INSTR_SETWAVE) {
+      continue;
+    }
+    if(command.newWave >= waveIndices.size()) {
+      std::stringstream err;
+      err << "Instrument uses wave " << (unsigned)command.newWave << ", which it doesn't have";
+      throw err.str();
+    }
+    // like CHANNEL_CMD_SET_WAVE, this is an offset into the wave table
+    command.newWave = waveIndices[command.newWave] * 16;
+  }
+}
+
+void GbInstrument::compact(bool holds) {
+  // enough frames to cover the instrument once through and a couple of times round its loop;
+  // after that, one that plays the same as it so far always will
+  Period period = getPeriod();
+  size_t frames = period.start + 2 * period.length;
+  std::vector<Frame> played = play(frames);
+
+  findLoop();
+  removeRedundantCommands();
+  dropTrailingFrames();
+  if(holds) {
+    mergeEmptyFrames();
+  }
+
+  if(play(frames) != played) {
+    throw std::string("Internal error - instrument plays differently once compacted");
+  }
+}
+
+optional<GbInstrument::Setting> GbInstrument::getSetting(const InstrumentCommand& command) {
+  switch(command.type) {
+  case INSTR_VOL: return Setting{VOLUME, command.newVolume};
+  case INSTR_DUTY_LO:
+  case INSTR_DUTY_25:
+  case INSTR_DUTY_50:
+  case INSTR_DUTY_75: return Setting{DUTY, command.type};
+  case INSTR_SETWAVE: return Setting{WAVE, command.newWave};
+  default: return nullopt;
+  }
+}
+
+InstrumentCommand GbInstrument::makeSetting(Register reg, int value) {
+  InstrumentCommand command;
+  switch(reg) {
+  case VOLUME:
+    command.type = INSTR_VOL;
+    command.newVolume = value;
+    break;
+  case DUTY:
+    command.type = static_cast<InstrumentCommandType>(value);
+    break;
+  case WAVE:
+    command.type = INSTR_SETWAVE;
+    command.newWave = value;
+    break;
+  default:
+    throw std::string("Internal error - invalid instrument register");
+  }
+  return command;
+}
+
+GbInstrument::Frame::Frame() {
+  std::fill(registers, registers + REGISTER_COUNT, UNKNOWN);
+}
+
+// a command that sets a register to what it already is makes no difference to what's heard
+bool GbInstrument::Frame::operator==(const Frame& frame) const {
+  return std::equal(registers, registers + REGISTER_COUNT, frame.registers)
+    && pitchCommands == frame.pitchCommands;
+}
+
+std::vector<GbInstrument::Frame> GbInstrument::play(size_t count) const {
+  std::vector<Frame> frames;
+  Frame frame;
+  size_t next = 0;
+  size_t mark = 0;
+  size_t held = 0;
+  while(frames.size() < count) {
+    frame.pitchCommands.clear();
+    if(held) {
+      held--;
+      frames.push_back(frame);
+      continue;
+    }
+    // a frame that goes round the loop without ending would hang the engine
+    for(size_t run = 0; ; run++) {
+      if(run > commands.size() || next >= commands.size()) {
+	throw std::string("Internal error - instrument never ends its frame");
+      }
+      const auto& command = commands[next];
+      // the engine stays on INSTR_END from then on
+      if(command.type == INSTR_END) {
+	break;
+      }
+      next++;
+      if(command.type == INSTR_END_FRAME) {
+	break;
+      }
+      if(command.type == INSTR_HOLD) {
+	held = command.frames - 1;
+	break;
+      }
+      if(command.type == INSTR_MARK) {
+	mark = next;
+      } else if(command.type == INSTR_LOOP) {
+	next = mark;
+      } else if(auto setting = getSetting(command)) {
+	frame.registers[setting->reg] = setting->value;
+      } else {
+	frame.pitchCommands.push_back(command);
+      }
+    }
+    frames.push_back(frame);
+  }
+  return frames;
+}
+
+/* However the instrument was built, by the time it's been through once (and, if it loops, once
+   round the loop) it's only ever going to repeat itself: after INSTR_END every frame is the same
+   as the last, and after INSTR_LOOP it goes round the loop's frames forever. */
+GbInstrument::Period GbInstrument::getPeriod(void) const {
+  size_t frames = 0;
+  size_t mark = 0;
+  for(const auto& command : commands) {
+    switch(command.type) {
+    case INSTR_MARK: mark = frames; break;
+    case INSTR_END_FRAME: frames++; break;
+    case INSTR_HOLD: frames += command.frames; break;
+    case INSTR_END: return Period{frames + 1, 1};
+    case INSTR_LOOP: return Period{frames, std::max<size_t>(frames - mark, 1)};
+    default: break;
+    }
+  }
+  throw std::string("Internal error - instrument neither ends nor loops");
+}
+
+/* FamiTracker sequences that don't loop, or only loop late, come out as every frame written out
+   in full, even when the instrument settled into repeating itself long before. This plays the
+   instrument, finds the shortest loop that repeats the same way and the earliest it can start,
+   and rebuilds the instrument from the frames it played: the ones before the loop, then a
+   mark, the loop's frames and INSTR_LOOP. If the loop is a single frame that does nothing,
+   the instrument just ends instead. */
+void GbInstrument::findLoop(void) {
+  Period period = getPeriod();
+  std::vector<Frame> frames = play(period.start + 2 * period.length);
+
+  size_t length = 1;
+  for(; length < period.length; length++) {
+    if(period.length % length) {
+      continue;
+    }
+    bool repeats = true;
+    for(size_t i = period.start; repeats && i < period.start + period.length; i++) {
+      repeats = frames[i] == frames[i + length];
+    }
+    if(repeats) {
+      break;
+    }
+  }
+  size_t start = period.start;
+  while(start > 0 && frames[start - 1] == frames[start - 1 + length]) {
+    start--;
+  }
+  bool ends = length == 1 && frames[start].pitchCommands.empty();
+
+  std::vector<InstrumentCommand> rebuilt;
+  Frame previous;
+  for(size_t i = 0; i < start + (ends ? 1 : length); i++) {
+    if(i == start && !ends) {
+      rebuilt.push_back(InstrumentCommand{INSTR_MARK, {}});
+      // coming round the loop, the registers could be anything the loop left them as; the
+      // ones that can't be are taken out again by removeRedundantCommands
+      previous = Frame();
+    }
+    const Frame& frame = frames[i];
+    auto set = [&](Register reg) {
+      if(frame.registers[reg] != previous.registers[reg]) {
+	rebuilt.push_back(makeSetting(reg, frame.registers[reg]));
+      }
+    };
+    // in the order the importer adds them
+    set(VOLUME);
+    rebuilt.insert(rebuilt.end(), frame.pitchCommands.begin(), frame.pitchCommands.end());
+    set(DUTY);
+    set(WAVE);
+    rebuilt.push_back(InstrumentCommand{INSTR_END_FRAME, {}});
+    previous = frame;
+  }
+  rebuilt.push_back(InstrumentCommand{ends ? INSTR_END : INSTR_LOOP, {}});
+  commands = std::move(rebuilt);
+}
+
+/* Volume, duty and wave commands set their register outright, so one that sets it to what it
+   already is can go (for volume, that also saves retriggering the note). Nothing's known about
+   them when the instrument starts, and at the mark only what's the same whether we've just got
+   there or come round the loop. Pitch commands add to the pitch, so they all stay. */
+void GbInstrument::removeRedundantCommands(void) {
+  int atMark[REGISTER_COUNT] = {UNKNOWN, UNKNOWN, UNKNOWN};
+  int atLoop[REGISTER_COUNT];
+  auto mark = std::find_if(commands.begin(), commands.end(), [](const InstrumentCommand& command) {
+      return command.type == INSTR_MARK;
+    });
+  for(auto i = commands.begin(); i != mark; ++i) {
+    if(auto setting = getSetting(*i)) {
+      atMark[setting->reg] = setting->value;
+    }
+  }
+  std::copy(atMark, atMark + REGISTER_COUNT, atLoop);
+  for(auto i = mark; i != commands.end(); ++i) {
+    if(auto setting = getSetting(*i)) {
+      atLoop[setting->reg] = setting->value;
+    }
+  }
+  for(int reg = 0; reg < REGISTER_COUNT; reg++) {
+    if(atLoop[reg] != atMark[reg]) {
+      atMark[reg] = UNKNOWN;
+    }
+  }
+
+  int current[REGISTER_COUNT] = {UNKNOWN, UNKNOWN, UNKNOWN};
+  std::vector<InstrumentCommand> kept;
+  for(const auto& command : commands) {
+    if(command.type == INSTR_MARK) {
+      std::copy(atMark, atMark + REGISTER_COUNT, current);
+    }
+    if(auto setting = getSetting(command)) {
+      if(current[setting->reg] == setting->value) {
+	continue;
+      }
+      current[setting->reg] = setting->value;
+    }
+    kept.push_back(command);
+  }
+  commands = std::move(kept);
+}
+
+// after INSTR_END nothing happens anyway, so the empty frames just before it can go
+void GbInstrument::dropTrailingFrames(void) {
+  if(commands.empty() || commands.back().type != INSTR_END) {
+    return;
+  }
+  auto end = commands.end() - 1;
+  auto trailing = end;
+  while(trailing != commands.begin() && (trailing - 1)->type == INSTR_END_FRAME) {
+    --trailing;
+  }
+  commands.erase(trailing, end);
+}
+
+// a run of frames with nothing to do becomes one hold, which the engine counts down without
+// reading the instrument at all
+void GbInstrument::mergeEmptyFrames(void) {
+  std::vector<InstrumentCommand> merged;
+  for(size_t i = 0; i < commands.size();) {
+    if(commands[i].type != INSTR_END_FRAME) {
+      merged.push_back(commands[i++]);
+      continue;
+    }
+    size_t empty = 0;
+    while(i < commands.size() && commands[i].type == INSTR_END_FRAME) {
+      empty++;
+      i++;
+    }
+    while(empty) {
+      size_t frames = std::min(empty, MAX_HOLD_FRAMES);
+      InstrumentCommand command;
+      // (a hold of one frame would just be an INSTR_END_FRAME)
+      if(frames > 1) {
+	command.type = INSTR_HOLD;
+	command.frames = frames;
+      } else {
+	command.type = INSTR_END_FRAME;
+      }
+      merged.push_back(command);
+      empty -= frames;
+    }
+  }
+  commands = std::move(merged);
+}
+
 void InstrumentCommand::writeGb(std::ostream& ostream) const {
+  if(type == INSTR_HOLD) {
+    ostream.put(frames * 2 - 1);
+    return;
+  }
   ostream.put(type);
   switch(type) {
   case INSTR_END: break;
   case INSTR_END_FRAME: break;
+  case INSTR_HOLD: break;
   case INSTR_VOL: ostream.put(newVolume); break;
   case INSTR_MARK: break;
   case INSTR_LOOP: break;
@@ -480,10 +1817,18 @@ void InstrumentCommand::writeGb(std::ostream& ostream) const {
   }
 }
 
+bool InstrumentCommand::operator==(const InstrumentCommand& command) const {
+  // the commands with no argument leave it unset - except a hold, which is one byte but keeps
+  // how many frames it lasts in frames
+  bool hasArgument = getLength() > 1 || type == INSTR_HOLD;
+  return type == command.type && (!hasArgument || newVolume == command.newVolume);
+}
+
 uint8_t InstrumentCommand::getLength(void) const {
   switch(type) {
   case INSTR_END: return 1;
   case INSTR_END_FRAME: return 1;
+  case INSTR_HOLD: return 1;
   case INSTR_VOL: return 2;
   case INSTR_MARK: return 1;
   case INSTR_LOOP: return 1;
@@ -519,6 +1864,14 @@ void Row::endOfPattern(void) {
   setFlowControlCommand(command);
 }
 
+optional<EngineCommand> Row::getFlowControlCommand(void) const {
+  optional<EngineCommand> command;
+  if(this->hasFlowControlCommand) {
+    command = engineCommands.at(0);
+  }
+  return command;
+}
+
 void Row::stop(void) {
   EngineCommand command;
   command.type = ENGINE_CMD_STOP;
@@ -20,6 +20,7 @@
 
 #pragma once
 
+#include "Compressor.h"
 #include "FamiTrackerTypes.h"
 
 #include <iostream>
@@ -29,10 +30,13 @@
 
 using namespace std::experimental;
 
-// commands are even numbered, starting at 2
+// commands are even numbered, starting at 2; odd numbers end the frame
 enum InstrumentCommandType {
   INSTR_END       = 0,
   INSTR_END_FRAME = 1,
+  // ends the frame like INSTR_END_FRAME, and then does nothing for the rest of the frames it
+  // holds for; these are written as 2 * frames - 1, so it's 3, 5, 7...
+  INSTR_HOLD      = 3,
   INSTR_VOL       = 2,
   INSTR_MARK      = 4,
   INSTR_LOOP      = 6,
@@ -52,20 +56,65 @@ struct InstrumentCommand {
     uint8_t newPitch;
     uint8_t newHiPitch;
     uint8_t newWave;
+    uint8_t frames;
   };
 
   void writeGb(std::ostream& ostream) const;
   uint8_t getLength(void) const;
+  bool operator==(const InstrumentCommand&) const;
 };
 
 class GbInstrument {
  public:
   void addCommand(const InstrumentCommand&);
+  // INSTR_SETWAVE commands are added with the instrument's own wave numbers; this swaps in
+  // where each of those waves ended up in the song's wave table
+  void setWaves(const std::vector<uint8_t>& waveIndices);
+  // loops the instrument as soon as it starts repeating itself, drops the commands that change
+  // nothing, and, if asked, merges runs of empty frames into holds; call once the waves have
+  // been set
+  void compact(bool holds);
   void writeGb(std::ostream&) const;
-  uint8_t getLength(void) const;
+  uint16_t getLength(void) const;
 
  private:
+  // so that the opcode fits in a byte
+  static const size_t MAX_HOLD_FRAMES = 128;
+
+  // the registers that commands set outright, rather than adjusting
+  enum Register { VOLUME, DUTY, WAVE, REGISTER_COUNT };
+  static const int UNKNOWN = -1;
+  struct Setting {
+    Register reg;
+    int value;
+  };
+  // which register the command sets, and to what; nothing for the other commands
+  static optional<Setting> getSetting(const InstrumentCommand&);
+  static InstrumentCommand makeSetting(Register, int value);
+
+  // what the instrument's done by the end of a frame: what the registers have been set to, and
+  // the pitch commands it ran in it
+  struct Frame {
+    Frame();
+    int registers[REGISTER_COUNT];
+    std::vector<InstrumentCommand> pitchCommands;
+    bool operator==(const Frame&) const;
+  };
+  // the instrument plays the same length frames over and over from the frame start on
+  struct Period {
+    size_t start;
+    size_t length;
+  };
+
   std::vector<InstrumentCommand> commands;
+
+  // the first count frames, as the engine would play them
+  std::vector<Frame> play(size_t count) const;
+  Period getPeriod(void) const;
+  void findLoop(void);
+  void removeRedundantCommands(void);
+  void dropTrailingFrames(void);
+  void mergeEmptyFrames(void);
 };
 
 enum ChannelCommandType {
@@ -92,7 +141,9 @@ enum EngineCommandType {
   ENGINE_CMD_SET_RATE = 1,
   ENGINE_CMD_STOP = 3,
   ENGINE_CMD_END_OF_PAT = 5,
-  ENGINE_CMD_JMP_FRAME = 7
+  ENGINE_CMD_JMP_FRAME = 7,
+  // nothing happens on this tick or the next ticks - 1, for a run of empty rows
+  ENGINE_CMD_WAIT = 9
 };
 
 struct EngineCommand {
@@ -101,6 +152,7 @@ struct EngineCommand {
   union {
     uint8_t newRate;
     uint8_t newFrame;
+    uint8_t ticks;
   };
 
   void writeGb(std::ostream&) const;
@@ -115,8 +167,13 @@ class GbNote {
   void writeGb(std::ostream&) const;
   void addCommand(const ChannelCommand&);
   uint16_t getLength(void) const;
+  bool isEmpty(void) const;
  private:
-  std::vector<ChannelCommand> commands;
+  // a note sets at most its instrument and, on the wave channel, that instrument's wave, so
+  // there's room for them in the note itself rather than on the heap
+  static const size_t MAX_COMMANDS = 2;
+  ChannelCommand commands[MAX_COMMANDS];
+  uint8_t commandCount;
   uint8_t pitch;
 };
 
@@ -124,14 +181,21 @@ class Row {
  public:
   Row();
   void writeGb(std::ostream&) const;
+  // just the row's song control command (or a NOP), for a per-channel song's own patterns
+  void writeControlGb(std::ostream&) const;
+  // like writeGb, but with a mask of the channels that have notes, and nothing for the rest
+  void writeMaskedGb(std::ostream&) const;
   void jump(uint8_t newFrame);
   void endOfPattern(void);
   void stop(void);
+  optional<EngineCommand> getFlowControlCommand(void) const;
   uint16_t getLength(void) const;
-  void setSquareNote1(const GbNote&);
-  void setSquareNote2(const GbNote&);
-  void setWaveNote(const GbNote&);
-  void setNoiseNote(const GbNote&);
+  // no commands and no notes; a run of these is played as a single wait
+  bool isEmpty(void) const;
+  void setSquareNote1(GbNote);
+  void setSquareNote2(GbNote);
+  void setWaveNote(GbNote);
+  void setNoiseNote(GbNote);
   
  private:
   bool hasFlowControlCommand;
@@ -172,10 +236,28 @@ class Wave {
   Wave(void);
   void writeGb(std::ostream&) const;
   void setSample(size_t sampleNum, uint8_t);
+  bool operator==(const Wave&) const;
  private:
   uint8_t samples[SAMPLE_CNT];
 };
 
+// square 1, square 2, wave and noise
+const size_t GB_CHANNEL_COUNT = 4;
+
+/* In a per-channel song, each channel plays patterns of its own, alongside the song's: just a
+   note (or nothing) for every row */
+class ChannelPattern {
+  friend class Song;
+ public:
+  // in place of a channel pattern's number, for a channel that has nothing to play
+  static const uint8_t NONE = 0xFF;
+
+  void reserve(size_t notes);
+  void addNote(GbNote);
+ private:
+  std::vector<GbNote> notes;
+};
+
 struct PatternImpl;
 class Pattern {
   friend class Song;
@@ -186,9 +268,15 @@ class Pattern {
 
   Pattern& operator=(Pattern&&);
   
-  void addRow(const Row&);
+  // makes room for this many rows (counting the one that ends the pattern), so that adding them
+  // doesn't allocate as it goes
+  void reserve(size_t rows);
+  void addRow(Row);
   void addJump(PatternNumber to);
   void terminate(void);
+  // makes this a per-channel song's pattern, whose rows only have song control commands, and
+  // which has each channel play the channel pattern with the given number (or NONE)
+  void playChannelPatterns(const uint8_t numbers[GB_CHANNEL_COUNT]);
  private:
   std::unique_ptr<PatternImpl> impl;
 };
@@ -202,7 +290,8 @@ class Song {
 
   void addInstrument(const GbInstrument&);
 
-  void setTempo(uint8_t tempo);
+  // starts a new track; the patterns added after this belong to it, numbered from 0
+  void addTrack(uint8_t tempo);
 
   void addRow(const Row&, PatternNumber);
 
@@ -212,7 +301,21 @@ class Song {
 
   void addPattern(const Pattern&);
 
-  void addWave(const Wave&);
+  // per-channel songs only: adds a pattern for one channel of the current track, and returns
+  // the number a Pattern plays it by
+  uint8_t addChannelPattern(size_t channel, const ChannelPattern&);
+
+  // identical waves are only stored once; returns the index of the one to use
+  uint8_t addWave(const Wave&);
+
+  void setInstrumentWaves(size_t instrument, const std::vector<uint8_t>& waveIndices);
+
+  void setCompressionOptions(const CompressionOptions&);
+
+  // must be called once every pattern has been added, before writing the song out
+  void compressPatterns(void);
+
+  void printSummary(std::ostream&) const;
  private:
   std::unique_ptr<SongImpl> impl;
 };
@@ -0,0 +1,121 @@
+#include "SourceFile.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct SourceFileImpl {
+public:
+  explicit SourceFileImpl(std::string text_) : text(std::move(text_)), mapping(nullptr), mappedSize(0), released(0) {}
+
+  SourceFileImpl(void *mapping_, size_t mappedSize_) : mapping(mapping_), mappedSize(mappedSize_), released(0) {}
+
+  ~SourceFileImpl() {
+    if (mapping) {
+      munmap(mapping, mappedSize);
+    }
+  }
+
+  std::string_view getText(void) const {
+    if (mapping) {
+      return std::string_view(static_cast<const char*>(mapping), mappedSize);
+    }
+    return text;
+  }
+
+  bool isMapped(void) const {
+    return mapping != nullptr;
+  }
+
+  void release(size_t offset) {
+    if (!mapping) {
+      return;
+    }
+    // only whole pages can go, and the mapping's private and never written, so anything read
+    // again afterwards just comes back from the file
+    static const size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t end = std::min(offset, mappedSize) / pageSize * pageSize;
+    if (end > released) {
+      madvise(static_cast<char*>(mapping) + released, end - released, MADV_DONTNEED);
+      released = end;
+    }
+  }
+
+private:
+  std::string text;
+  void *mapping;
+  size_t mappedSize;
+  // how much of the start of the mapping has been let go of already
+  size_t released;
+};
+
+static std::string fileError(const char *filename, const char *what) {
+  std::ostringstream err;
+  err << "Couldn't " << what << " " << filename << ": " << strerror(errno);
+  return err.str();
+}
+
+SourceFile::SourceFile(std::string text) : impl(std::make_unique<SourceFileImpl>(std::move(text))) {}
+SourceFile::SourceFile(std::unique_ptr<SourceFileImpl> impl_) : impl(std::move(impl_)) {}
+SourceFile::SourceFile(SourceFile&& source) : impl(std::move(source.impl)) {}
+SourceFile::~SourceFile() {}
+
+SourceFile SourceFile::open(const char *filename) {
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) {
+    throw fileError(filename, "open");
+  }
+
+  struct stat st;
+  bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  if (regular && st.st_size > 0) {
+    void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+      // the tokenizer goes straight through the text, once
+      madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+      close(fd);
+      return SourceFile(std::make_unique<SourceFileImpl>(mapping, st.st_size));
+    }
+  }
+
+  // not something we can map, so read it all in, straight into the one buffer
+  std::string text;
+  if (regular) {
+    text.reserve(st.st_size);
+  }
+  char chunk[65536];
+  ssize_t got;
+  while ((got = read(fd, chunk, sizeof chunk)) != 0) {
+    if (got < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      int readErrno = errno;
+      close(fd);
+      errno = readErrno;
+      throw fileError(filename, "read");
+    }
+    text.append(chunk, got);
+  }
+  close(fd);
+
+  return SourceFile(std::move(text));
+}
+
+std::string_view SourceFile::getText(void) const {
+  return impl->getText();
+}
+
+bool SourceFile::isMapped(void) const {
+  return impl->isMapped();
+}
+
+void SourceFile::release(size_t offset) {
+  impl->release(offset);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+/* The text of a module being imported. A regular file is memory-mapped read-only, so the
+   tokenizer reads straight out of the page cache; anything that can't be mapped (a pipe, say)
+   is read once into a buffer instead. Either way there's only the one copy of the text, and
+   it stays put for as long as the SourceFile lives, even if the SourceFile is moved. */
+struct SourceFileImpl;
+class SourceFile {
+ public:
+  explicit SourceFile(std::string text);
+  SourceFile(SourceFile&&);
+  ~SourceFile();
+
+  /* throws a string if the file can't be opened or read */
+  static SourceFile open(const char *filename);
+
+  std::string_view getText(void) const;
+  bool isMapped(void) const;
+
+  /* says the text before offset won't be needed again for a while. If it's mapped, the pages
+     it's on stop counting towards our memory use until they're next read; a buffer's kept as
+     it is. */
+  void release(size_t offset);
+ private:
+  explicit SourceFile(std::unique_ptr<SourceFileImpl>);
+
+  std::unique_ptr<SourceFileImpl> impl;
+};
@@ -0,0 +1,154 @@
+#include "ThreadPool.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct ThreadPoolImpl {
+public:
+  explicit ThreadPoolImpl(unsigned threadCount) :
+    queues(threadCount ? threadCount : 1), job(nullptr), batch(0), busy(0), stopping(false)
+  {
+    // the caller is worker 0, so it only needs threads for the rest
+    for (unsigned worker = 1; worker < queues.size(); worker++) {
+      threads.emplace_back(&ThreadPoolImpl::workerMain, this, worker);
+    }
+  }
+
+  ~ThreadPoolImpl() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  unsigned getThreadCount(void) const {
+    return queues.size();
+  }
+
+  void forEach(size_t count, const std::function<void(unsigned, size_t)>& job) {
+    // deal the jobs out in contiguous runs, one per worker
+    for (size_t worker = 0; worker < queues.size(); worker++) {
+      size_t begin = count * worker / queues.size();
+      size_t end = count * (worker + 1) / queues.size();
+      for (size_t i = begin; i < end; i++) {
+	queues[worker].jobs.push_back(i);
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      this->job = &job;
+      error = nullptr;
+      busy = threads.size();
+      batch++;
+    }
+    wake.notify_all();
+
+    runJobs(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return busy == 0; });
+    this->job = nullptr;
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<size_t> jobs;
+  };
+
+  std::vector<Queue> queues;
+  std::vector<std::thread> threads;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  const std::function<void(unsigned, size_t)> *job;
+  // bumped for every call to forEach, so the workers can tell a new batch from the last one
+  uint64_t batch;
+  unsigned busy;
+  bool stopping;
+  std::exception_ptr error;
+
+  void workerMain(unsigned worker) {
+    uint64_t lastBatch = 0;
+    for (;;) {
+      {
+	std::unique_lock<std::mutex> lock(mutex);
+	wake.wait(lock, [&] { return stopping || batch != lastBatch; });
+	if (stopping) {
+	  return;
+	}
+	lastBatch = batch;
+      }
+
+      runJobs(worker);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--busy == 0) {
+	done.notify_one();
+      }
+    }
+  }
+
+  void runJobs(unsigned worker) {
+    size_t i;
+    while (takeOwn(worker, i) || steal(worker, i)) {
+      try {
+	(*job)(worker, i);
+      } catch (...) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!error) {
+	  error = std::current_exception();
+	}
+      }
+    }
+  }
+
+  bool takeOwn(unsigned worker, size_t& i) {
+    Queue& queue = queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.jobs.empty()) {
+      return false;
+    }
+    i = queue.jobs.front();
+    queue.jobs.pop_front();
+    return true;
+  }
+
+  // take from the other end of someone else's queue, to stay out of its owner's way
+  bool steal(unsigned worker, size_t& i) {
+    for (size_t offset = 1; offset < queues.size(); offset++) {
+      Queue& queue = queues[(worker + offset) % queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.jobs.empty()) {
+	i = queue.jobs.back();
+	queue.jobs.pop_back();
+	return true;
+      }
+    }
+    return false;
+  }
+};
+
+ThreadPool::ThreadPool(unsigned threads) : impl(std::make_unique<ThreadPoolImpl>(threads)) {}
+ThreadPool::~ThreadPool() {}
+
+unsigned ThreadPool::getThreadCount(void) const {
+  return impl->getThreadCount();
+}
+
+void ThreadPool::forEach(size_t count, const std::function<void(unsigned, size_t)>& job) {
+  impl->forEach(count, job);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+/* A fixed set of threads for running batches of independent jobs. Each thread starts a batch with
+   its own share of the jobs and, once it runs out, steals from the far end of another thread's
+   share, so a few slow jobs don't leave the rest of the pool idle. The thread that calls forEach
+   pitches in as worker 0. */
+struct ThreadPoolImpl;
+class ThreadPool {
+ public:
+  /* 0 or 1 threads runs everything on the calling thread */
+  explicit ThreadPool(unsigned threads);
+  ~ThreadPool();
+
+  unsigned getThreadCount(void) const;
+
+  /* calls job(worker, i) for every i from 0 to count - 1, and waits for them all to finish.
+     worker (0 to getThreadCount() - 1) says which thread is running the job, for keeping
+     per-thread state. If any job throws, the first exception is rethrown once the rest are done. */
+  void forEach(size_t count, const std::function<void(unsigned worker, size_t i)>& job);
+ private:
+  std::unique_ptr<ThreadPoolImpl> impl;
+};
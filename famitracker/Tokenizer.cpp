@@ -1,8 +1,9 @@
 #include "Tokenizer.h"
+#include <charconv>
 #include <sstream>
 
-Tokenizer::Tokenizer(const std::string& text_)
-  : text(text_), pos(0), line(1), linestart(0)
+Tokenizer::Tokenizer(std::string_view text_, ScanLevel scanLevel)
+  : text(text_), scanner(text_, scanLevel), pos(0), line(1), linestart(0)
 {}
 
 Tokenizer::~Tokenizer() {}
@@ -14,19 +15,11 @@ void Tokenizer::reset(void) {
 }
 
 void Tokenizer::consumeSpace(void) {
-  while (pos < text.size()) {
-    char c = text.at(pos);
-    if (c != ' ' && c != '\t') {
-      return;
-    }
-    ++pos;
-  }
+  pos = scanner.skipBlanks(pos);
 }
 
 void Tokenizer::finishLine(void) {
-  while (pos < text.size() && text.at(pos) != '\n') {
-    ++pos;
-  }
+  pos = scanner.findNewline(pos);
 
   if (pos < text.size()) ++pos; // skip newline
   ++line;
@@ -42,22 +35,34 @@ int Tokenizer::getColumn(void) const {
   return 1 + pos - linestart;
 }
 
+size_t Tokenizer::getPosition(void) const {
+  return pos;
+}
+
+void Tokenizer::seek(size_t pos_) {
+  pos = pos_;
+}
+
 bool Tokenizer::finished(void) const {
   return pos >= text.size();
 }
 
-std::string Tokenizer::readToken() {
+std::string_view Tokenizer::readToken() {
   consumeSpace();
-  std::string t = "";
 
-  bool inQuote = false;
-  bool lastQuote = false; // for finding double-quotes
-  do {
-    if (pos >= text.size()) {
-      break;
+  size_t start = pos;
+  if (pos < text.size() && text[pos] != '\"') {
+    pos = scanner.findDelimiter(pos);
+    if (pos >= text.size() || text[pos] != '\"') {
+      return std::string_view(text.data() + start, pos - start);
     }
+  }
 
-    char c = text.at(pos);
+  // quoted strings (and tokens with quotes in them) take the slow road
+  bool inQuote = false;
+  int quotes = 0;
+  while (pos < text.size()) {
+    char c = text[pos];
     if ((c == ' ' && !inQuote) ||
         c == '\t' ||
         c == '\r' ||
@@ -68,92 +73,104 @@ std::string Tokenizer::readToken() {
 
     // quotes suppress space ending the token
     if (c == '\"') {
-      if (!inQuote && t.size() == 0) { // first quote begins a quoted string
+      if (pos == start) { // first quote begins a quoted string
 	inQuote = true;
       }
+      ++quotes;
+    }
+
+    ++pos;
+  }
+
+  std::string_view token(text.data() + start, pos - start);
+  if (quotes == 0) {
+    return token;
+  }
+
+  // a plain quoted string is still just a slice of the text
+  if (inQuote && quotes == 2 && token.size() >= 2 && token.back() == '\"') {
+    return token.substr(1, token.size() - 2);
+  }
+
+  return unescapeToken(start, pos);
+}
+
+std::string_view Tokenizer::unescapeToken(size_t start, size_t end) {
+  unescaped.clear();
+
+  bool lastQuote = false; // for finding double-quotes
+  for (size_t i = start; i < end; i++) {
+    char c = text[i];
+    if (c == '\"') {
+      if (i == start) { // first quote begins a quoted string
+	continue;
+      }
+      if (lastQuote) { // convert "" to "
+	unescaped += c;
+	lastQuote = false;
+      }
       else {
-	if (lastQuote) { // convert "" to "
-	  t += c;
-	  lastQuote = false;
-	}
-	else {
-	  lastQuote = true;
-	}
+	lastQuote = true;
       }
     }
     else {
       lastQuote = false;
-      t += c;
+      unescaped += c;
     }
-
-    ++pos;
   }
-  while (true);
 
-  return t;
+  return unescaped;
 }
 
-int Tokenizer::readInt(int rangeMin, int rangeMax) {
-  std::ostringstream errMsg;
-
-  std::string t = readToken();
+int Tokenizer::readNumber(int base, const char *expected, int rangeMin, int rangeMax) {
+  std::string_view t = readToken();
   int c = getColumn();
 
   if (t.size() < 1) {
-    errMsg << "Line " << line << " column " << c << ": expected integer, no token found.";
+    std::ostringstream errMsg;
+    errMsg << "Line " << line << " column " << c << ": expected " << expected << ", no token found.";
     throw errMsg.str();
   }
 
+  // like sscanf, allow a leading '+' and ignore anything after the number
+  const char *first = t.data();
+  if (*first == '+' && t.size() > 1) {
+    ++first;
+  }
+
   int i;
-  int result = ::sscanf(t.c_str(), "%d", &i);
-  if(result == EOF || result == 0) {
-    errMsg << "Line " << line << " column " << c << ": expected integer, '" << t << "' found.";
+  auto result = std::from_chars(first, t.data() + t.size(), i, base);
+  if (result.ec == std::errc::invalid_argument) {
+    std::ostringstream errMsg;
+    errMsg << "Line " << line << " column " << c << ": expected " << expected << ", '" << t << "' found.";
     throw errMsg.str();
   }
 
-  if (i < rangeMin || i > rangeMax) {
-    errMsg << "Line " << line << " column " << c << ": expected integer in range [" << rangeMin << "," << rangeMax << "], " << i << " found.";
+  if (result.ec == std::errc::result_out_of_range || i < rangeMin || i > rangeMax) {
+    std::ostringstream errMsg;
+    errMsg << "Line " << line << " column " << c << ": expected " << expected << " in range [" << rangeMin << "," << rangeMax << "], " << t << " found.";
     throw errMsg.str();
   }
 
   return i;
 }
 
-int Tokenizer::readHex(int rangeMin, int rangeMax) {
-  std::ostringstream errMsg;
-
-  std::string t = readToken();
-  int c = getColumn();
-
-  if (t.size() < 1) {
-    errMsg << "Line " << line << " column " << c << ": expected hexadecimal, no token found.";
-    throw errMsg.str();
-  }
-
-  int i;
-  int result = ::sscanf(t.c_str(), "%x", &i);
-  if(result == EOF || result == 0) {
-    errMsg << "Line " << line << " column " << c << ": expected hexadecimal, '" << t << "' found.";
-    throw errMsg.str();
-  }
+int Tokenizer::readInt(int rangeMin, int rangeMax) {
+  return readNumber(10, "integer", rangeMin, rangeMax);
+}
 
-  if (i < rangeMin || i > rangeMax) {
-    errMsg << "Line " << line << " column " << c << ": expected hexadecimal in range [" << rangeMin << "," << rangeMax << "], " << i << " found.";
-    throw errMsg.str();
-  }
-   
-  return i;
+int Tokenizer::readHex(int rangeMin, int rangeMax) {
+  return readNumber(16, "hexadecimal", rangeMin, rangeMax);
 }
 
 // note: finishes line if found
 void Tokenizer::readEOL(void) {
-  std::ostringstream errMsg;
-
   int c = getColumn();
   consumeSpace();
 
-  std::string s = readToken();
+  std::string_view s = readToken();
   if (s.size() > 0) {
+    std::ostringstream errMsg;
     errMsg << "Line " << line << " column " << c << ": expected end of line, '" << s << "' found.";
     throw errMsg.str();
   }
@@ -162,8 +179,9 @@ void Tokenizer::readEOL(void) {
     return;
   }
 
-  char eol = text.at(pos);
+  char eol = text[pos];
   if (eol != '\r' && eol != '\n') {
+    std::ostringstream errMsg;
     errMsg << "Line " << line << " column " << c << ": expected end of line, '" << eol << "' found.";
     throw errMsg.str();
   }
@@ -178,7 +196,7 @@ bool Tokenizer::isEOL(void) {
     return true;
   }
 
-  char eol = text.at(pos);
+  char eol = text[pos];
   if (eol == '\r' || eol == '\n') {
     finishLine();
     return true;
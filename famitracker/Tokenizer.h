@@ -1,10 +1,13 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+
+#include "Scanner.h"
 
 class Tokenizer {
  public:
-  Tokenizer(const std::string& text_);
+  Tokenizer(std::string_view text_, ScanLevel scanLevel = Scanner::bestLevel());
   virtual ~Tokenizer();
 
   void reset(void);
@@ -12,8 +15,15 @@ class Tokenizer {
   int getColumn(void) const;
   bool finished(void) const;
   int getLine(void) const;
+
+  // where in the text the tokenizer is; seeking doesn't keep track of line numbers
+  size_t getPosition(void) const;
+  void seek(size_t pos_);
   
-  std::string readToken(void);
+  // the token is a view into the text (or, for quoted tokens with "" in them, into an
+  // unescaped copy), so it's only good until the next token is read; the text itself
+  // isn't copied, and has to outlive the tokenizer
+  std::string_view readToken(void);
   int readInt(int rangeMin, int rangeMax);
   int readHex(int rangeMin, int rangeMax);
   void readEOL(void);
@@ -21,8 +31,12 @@ class Tokenizer {
   void finishLine(void);
  private:
   void consumeSpace(void);
+  std::string_view unescapeToken(size_t start, size_t end);
+  int readNumber(int base, const char *expected, int rangeMin, int rangeMax);
 
-  const std::string text;
+  const std::string_view text;
+  Scanner scanner;
+  std::string unescaped;
   size_t pos;
   int line;
   int linestart;
@@ -0,0 +1,137 @@
+/* Checks the greedy parse against a straightforward one that tries every offset in the window
+   at every position, extending each a byte at a time - which is what the compressor did before
+   it had hash chains - and times the two. They have to come out byte for byte the same, on
+   random bytes, on runs of zeros and on data shaped like patterns, with and without a dictionary
+   and with a streaming window as well as the whole 256 bytes. */
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "../Compressor.h"
+
+static uint32_t seed = 1;
+
+static uint32_t nextRandom(void) {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+enum Shape {
+  RANDOM,
+  ZEROS,
+  PATTERN_LIKE
+};
+
+static const char *SHAPE_NAMES[] = {"random bytes", "zeros", "pattern-like"};
+
+// pattern-like data is made of a few phrases of mostly empty rows, repeated with a few changes
+static std::vector<char> makeInput(Shape shape, size_t size) {
+  std::vector<char> phrases[8];
+  for (auto& phrase : phrases) {
+    for (int i = 0; i < 40; i++) {
+      phrase.push_back(nextRandom() % 4 == 0 ? nextRandom() % 90 * 2 + 3 : 0);
+    }
+  }
+  std::vector<char> input;
+  while (input.size() < size) {
+    if (shape == RANDOM) {
+      input.push_back(nextRandom());
+    } else if (shape == ZEROS) {
+      input.push_back(0);
+    } else {
+      for (char c : phrases[nextRandom() % 8]) {
+	input.push_back(nextRandom() % 20 == 0 ? nextRandom() : c);
+      }
+    }
+  }
+  input.resize(size);
+  return input;
+}
+
+// the parse the compressor used to make, written out in the same format
+static void compressByScanning(const std::vector<char>& input, const std::vector<char>& dictionary,
+			       unsigned window, std::vector<char>& output) {
+  std::vector<uint8_t> data(dictionary.begin(), dictionary.end());
+  data.insert(data.end(), input.begin(), input.end());
+  size_t commands = 0;
+  size_t flagByte = 0;
+  for (size_t pos = dictionary.size(); pos < data.size(); ) {
+    if (commands++ % 8 == 0) {
+      flagByte = output.size();
+      output.push_back(0);
+    }
+    size_t limit = std::min<size_t>(255, data.size() - pos);
+    size_t bestLength = 2, bestDelta = 0;
+    for (size_t delta = 1; delta <= std::min<size_t>(window - 1, pos); delta++) {
+      size_t length = 0;
+      while (length < limit && data[pos + length] == data[pos - delta + length]) {
+	length++;
+      }
+      if (length > bestLength) {
+	bestLength = length;
+	bestDelta = delta;
+      }
+    }
+    if (bestDelta) {
+      output.push_back(bestLength);
+      output.push_back(-bestDelta);
+      pos += bestLength;
+    } else {
+      output[flagByte] |= 1 << ((commands - 1) % 8);
+      output.push_back(data[pos++]);
+    }
+  }
+  // the end marker counts as a command, so it needs a flag byte of its own after a full block
+  if (commands % 8 == 0) {
+    output.push_back(0);
+  }
+  output.push_back(0);
+}
+
+static double since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// compresses the same input both ways, a few times over, and says how quickly
+static bool compareOn(Shape shape, size_t size, unsigned window, bool withDictionary) {
+  std::vector<char> input = makeInput(shape, size);
+  std::vector<char> dictionary = withDictionary ? makeInput(shape, 200) : std::vector<char>();
+  CompressionOptions options;
+  options.window = window;
+  Compressor compressor(options);
+
+  int runs = std::max<size_t>(1, 200000 / size);
+  std::vector<char> hashed, scanned;
+  auto start = std::chrono::steady_clock::now();
+  for (int run = 0; run < runs; run++) {
+    hashed.clear();
+    compressor.compress(input, hashed, dictionary);
+  }
+  double hashTime = since(start);
+  start = std::chrono::steady_clock::now();
+  for (int run = 0; run < runs; run++) {
+    scanned.clear();
+    compressByScanning(input, dictionary, window, scanned);
+  }
+  double scanTime = since(start);
+
+  printf("%-12s %6zu bytes, window %3u%s: %6zu bytes out, %s; %6.1f MB/s, %5.1f scanning (%.1fx)\n",
+	 SHAPE_NAMES[shape], size, window, withDictionary ? ", dictionary" : "            ", hashed.size(),
+	 hashed == scanned ? "identical" : "DIFFERENT", size * runs / hashTime / 1e6,
+	 size * runs / scanTime / 1e6, scanTime / hashTime);
+  return hashed == scanned;
+}
+
+int main(void) {
+  bool same = true;
+  for (Shape shape : {RANDOM, ZEROS, PATTERN_LIKE}) {
+    for (size_t size : {1536, 102400}) {
+      same &= compareOn(shape, size, CompressionOptions::MAX_WINDOW, false);
+    }
+    same &= compareOn(shape, 1536, CompressionOptions::MAX_WINDOW, true);
+    same &= compareOn(shape, 1536, 64, false);
+  }
+  return same ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+/* Checks that a .ftm and its text export convert to the same bytes, and times reading each. The
+   module in bench/modules was saved both ways; it has 2A03 and N163 instruments, two N163 waves,
+   and a D00 and a Bxx on rows that also have notes. It's converted with each of the options that
+   change what's read, so that the binary reader has to agree with the text one on all of it. */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "../Importer.h"
+
+static const char *TEXT = "bench/modules/small.txt";
+static const char *BINARY = "bench/modules/small.ftm";
+
+// the song the module converts to, and the quickest of a few tries, in ms
+static std::string convert(const char *filename, const CompressionOptions& options, double& time) {
+  std::string converted;
+  time = 1e9;
+  for(int run = 0; run < 5; run++) {
+    // the module's title and so on aren't wanted
+    std::cout.setstate(std::ios::failbit);
+    auto start = std::chrono::steady_clock::now();
+    std::ostringstream out;
+    try {
+      Importer importer = Importer::fromFile(filename);
+      importer.setCompressionOptions(options);
+      importer.runImport().writeGb(out);
+    } catch(const std::stringstream& error) {
+      std::cout.clear();
+      fprintf(stderr, "%s: Error: %s", filename, error.str().c_str());
+      exit(2);
+    } catch(const std::string& error) {
+      std::cout.clear();
+      fprintf(stderr, "%s: Error: %s", filename, error.c_str());
+      exit(2);
+    }
+    time = std::min(time, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    std::cout.clear();
+    converted = out.str();
+  }
+  return converted;
+}
+
+int main(void) {
+  struct {
+    const char *name;
+    CompressionOptions options;
+  } cases[6];
+  cases[0].name = "default";
+  cases[1].name = "optimal";
+  cases[1].options.mode = COMPRESSION_OPTIMAL;
+  cases[2].name = "per-channel";
+  cases[2].options.perChannel = true;
+  cases[3].name = "waits, row masks, holds";
+  cases[3].options.waits = true;
+  cases[3].options.rowMasks = true;
+  cases[3].options.holds = true;
+  cases[4].name = "low memory";
+  cases[4].options.lowMemory = true;
+  cases[5].name = "stream window 64";
+  cases[5].options.streaming = true;
+  cases[5].options.window = 64;
+
+  bool failed = false;
+  for(const auto& c : cases) {
+    double textTime, binaryTime;
+    std::string text = convert(TEXT, c.options, textTime);
+    std::string binary = convert(BINARY, c.options, binaryTime);
+    bool same = text == binary;
+    printf("%-23s: %4zu bytes, %s; text %.2f ms, .ftm %.2f ms\n", c.name, text.size(),
+	   same ? "identical" : "DIFFERENT", textTime, binaryTime);
+    failed |= !same;
+  }
+  return failed ? 1 : 0;
+}
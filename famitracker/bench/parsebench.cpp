@@ -0,0 +1,136 @@
+/* Counts the heap allocations made reading a module, to make sure that reading a row doesn't
+   allocate anything. The same patterns are read once with 64 rows and once with 128, so that
+   whatever's allocated once per module or once per pattern cancels out, leaving what each
+   row costs. */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+
+#include "../Importer.h"
+
+static size_t allocations = 0;
+
+void *operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size ? size : 1);
+  if(!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+static const int PATTERNS = 8;
+static const char *NOTES[] = {"C-3", "E-3", "G-3", "C-4", "D#4", "A#3"};
+static const char *EMPTY = " : ... .. . ...";
+
+/* A module with both squares and an N163 channel all changing instrument on most rows, so that
+   most notes carry commands - the N163's carry two, its instrument and its wave. */
+static std::string makeModule(int patternLength) {
+  std::ostringstream module;
+  module << "# FamiTracker text export 0.4.2\n"
+	 << "TITLE \"bench\"\nAUTHOR \"\"\nCOPYRIGHT \"\"\n"
+	 << "MACHINE 0\nFRAMERATE 0\nEXPANSION 16\nVIBRATO 1\nSPLIT 32\nN163CHANNELS 1\n\n"
+	 << "MACRO 0 0 -1 -1 0 : 15 14 13 12 11 10 9 8\n"
+	 << "MACRO 0 1 2 -1 0 : 15 12 10 8 8 8\n"
+	 << "MACRO 4 0 -1 -1 0 : 2 2 1 1 0 0 0 0\n"
+	 << "MACRON163 0 0 -1 -1 0 : 15 14 13 12\n\n"
+	 << "INST2A03 0 0 -1 -1 -1 0 \"a\"\n"
+	 << "INST2A03 1 1 -1 -1 -1 -1 \"b\"\n"
+	 << "INSTN163 2 0 -1 -1 -1 -1 32 0 1 \"w\"\n"
+	 << "N163WAVE 2 0 : 0 0 0 1 1 2 2 3 3 4 4 5 5 6 6 7 7 8 8 9 9 10 10 11 11 12 12 13 13 14 14 15\n"
+	 << "INSTN163 3 0 -1 -1 -1 -1 32 0 1 \"v\"\n"
+	 << "N163WAVE 3 0 : 15 15 14 14 13 13 12 12 11 11 10 10 9 9 8 8 7 7 6 6 5 5 4 4 3 3 2 2 1 1 0 0\n\n"
+	 << "TRACK " << patternLength << " 6 150 \"t\"\n"
+	 << "COLUMNS :";
+  for(int c = 0; c < 13; c++) {
+    module << " 1";
+  }
+  module << "\n\n";
+  for(int p = 0; p < PATTERNS; p++) {
+    char order[8];
+    snprintf(order, sizeof order, "%02X", p);
+    module << "ORDER " << order << " :";
+    for(int c = 0; c < 13; c++) {
+      module << " " << order;
+    }
+    module << "\n";
+  }
+  for(int p = 0; p < PATTERNS; p++) {
+    char number[8];
+    snprintf(number, sizeof number, "%02X", p);
+    module << "\nPATTERN " << number << "\n";
+    for(int row = 0; row < patternLength; row++) {
+      char header[16];
+      snprintf(header, sizeof header, "ROW %02X", row);
+      module << header;
+      const char *note = NOTES[(row + p) % 6];
+      bool empty = row % 4 == 3;
+      for(int c = 0; c < 13; c++) {
+	if(empty || (c > 1 && c != 5)) {
+	  module << EMPTY;
+	} else if(c == 5) {
+	  module << " : " << note << " 0" << 2 + row % 2 << " . ...";
+	} else {
+	  module << " : " << note << " 0" << (row + c) % 2 << " . ...";
+	}
+      }
+      module << "\n";
+    }
+  }
+  return module.str();
+}
+
+// allocations made reading the module, and the quickest of a few tries, in ms
+static size_t countAllocations(const std::string& text, bool perChannel, double& time) {
+  size_t counted = 0;
+  time = 1e9;
+  for(int run = 0; run < 5; run++) {
+    Importer importer(text);
+    // the module's title and so on aren't wanted
+    std::cout.setstate(std::ios::failbit);
+    CompressionOptions options;
+    options.perChannel = perChannel;
+    importer.setCompressionOptions(options);
+    auto start = std::chrono::steady_clock::now();
+    size_t before = allocations;
+    auto errors = importer.runCheck();
+    counted = allocations - before;
+    time = std::min(time, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    std::cout.clear();
+    if(!errors.empty()) {
+      fprintf(stderr, "Error: %s\n", errors.front().c_str());
+      exit(2);
+    }
+  }
+  return counted;
+}
+
+int main(void) {
+  bool failed = false;
+  for(bool perChannel : {false, true}) {
+    std::string shortModule = makeModule(64);
+    std::string longModule = makeModule(128);
+    double shortTime, longTime;
+    size_t shortCount = countAllocations(shortModule, perChannel, shortTime);
+    size_t longCount = countAllocations(longModule, perChannel, longTime);
+    double perRow = ((double)longCount - shortCount) / (PATTERNS * 64);
+    printf("%-11s %4d rows: %6zu allocations, %.2f ms; %4d rows: %6zu allocations, %.2f ms; %.2f allocations per row\n",
+	   perChannel ? "per-channel" : "plain", PATTERNS * 64, shortCount, shortTime,
+	   PATTERNS * 128, longCount, longTime, perRow);
+    failed |= longCount != shortCount;
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,167 @@
+/* Checks that every ScanLevel the build can use finds the same characters as the scalar code, and
+   times how quickly each one tokenizes a module. The searches are each tried from every position
+   in a lot of short random texts, so that every way a search can run into the end of the text,
+   at every alignment, gets tried; then whole modules are tokenized at each level, and the
+   tokens and line numbers have to match. One module's like an ordinary export, where the tokens
+   are so short that the vectors barely come into it; the other is padded out with long runs of
+   blanks and long comments, where they should. */
+
+#include <cstdio>
+#include <ctime>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../Scanner.h"
+#include "../Tokenizer.h"
+
+static const char *LEVEL_NAMES[] = {"scalar", "SSE2"};
+
+static uint32_t seed = 1;
+
+static uint32_t nextRandom(void) {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+// mostly letters and blanks, in runs of up to 40 so that the longer loops get a go
+static std::string makeText(size_t length) {
+  static const char CHARACTERS[] = "a  \t\t\r\n\"";
+  std::string text;
+  while (text.size() < length) {
+    char c = CHARACTERS[nextRandom() % (sizeof CHARACTERS - 1)];
+    text.append(std::min<size_t>(nextRandom() % 40 + 1, length - text.size()), c);
+  }
+  return text;
+}
+
+static bool checkSearches(ScanLevel best) {
+  for (int i = 0; i < 20000; i++) {
+    std::string text = makeText(nextRandom() % (i < 10000 ? 100 : 1000));
+    Scanner scalar(text, SCAN_SCALAR);
+    for (int level = SCAN_SSE2; level <= best; level++) {
+      Scanner scanner(text, (ScanLevel)level);
+      for (size_t pos = 0; pos <= text.size(); pos++) {
+	if (scanner.skipBlanks(pos) != scalar.skipBlanks(pos)
+	    || scanner.findDelimiter(pos) != scalar.findDelimiter(pos)
+	    || scanner.findNewline(pos) != scalar.findNewline(pos)) {
+	  printf("%s search from %zu differs from scalar in a text of %zu bytes\n",
+		 LEVEL_NAMES[level], pos, text.size());
+	  return false;
+	}
+      }
+    }
+  }
+  return true;
+}
+
+/* Rows like a text export's, with comment lines and long quoted names among them, and blanks
+   both short and long (or with padding, a lot longer); the last line has no newline. */
+static std::string makeModule(size_t rows, size_t padding) {
+  std::string blanks(padding, ' ');
+  std::string comment(padding * 4, '-');
+  std::ostringstream module;
+  module << "# FamiTracker text export 0.4.2\r\n"
+	 << "TITLE \"a long title, with \"\"quotes\"\" in it, and then some more after them\"\n";
+  for (size_t row = 0; row < rows; row++) {
+    if (row % 64 == 0) {
+      module << "\n# pattern " << row / 64 << ", where the comment goes on long enough to need the wider loops\n"
+	     << "PATTERN " << row / 64 << "\n";
+    }
+    if (padding && row % 8 == 0) {
+      module << "# " << comment << "\n";
+    }
+    module << "ROW " << row % 64 << " : C-3 01 . ... :" << blanks << "... .. . ... :\t... .. . ...   :   ... .. . ..."
+	   << blanks << ": ... .. . ..." << (row % 7 == 0 ? "\r\n" : "\n");
+  }
+  module << "INST2A03 0 0 -1 -1 -1 0 \"" << std::string(50, 'x') << "\"";
+  return module.str();
+}
+
+// a token, or "\n" for the end of a line, and the line it was on
+struct Token {
+  std::string text;
+  int line;
+
+  bool operator!=(const Token& other) const {
+    return text != other.text || line != other.line;
+  }
+};
+
+// tokenizes like the importer does, skipping comments whole; the tokens are only kept if asked for
+static size_t tokenize(const std::string& text, ScanLevel level, std::vector<Token> *tokens) {
+  Tokenizer t(text, level);
+  size_t count = 0;
+  while (!t.finished()) {
+    int line = t.getLine();
+    if (t.isEOL()) {
+      if (tokens) {
+	tokens->push_back(Token{"\n", line});
+      }
+      continue;
+    }
+    auto token = t.readToken();
+    count++;
+    if (tokens) {
+      tokens->push_back(Token{std::string(token), line});
+    }
+    if (token == "#") {
+      t.finishLine();
+    }
+  }
+  return count;
+}
+
+// the time this thread's spent running, which other processes on a busy machine don't add to
+static double cpuTime(void) {
+  timespec time;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return time.tv_sec * 1e3 + time.tv_nsec / 1e6;
+}
+
+static bool checkModule(const char *name, const std::string& module, ScanLevel best) {
+  printf("%s module, %zu bytes:\n", name, module.size());
+  std::vector<Token> expected;
+  tokenize(module, SCAN_SCALAR, &expected);
+  for (int level = SCAN_SCALAR; level <= best; level++) {
+    std::vector<Token> tokens;
+    tokenize(module, (ScanLevel)level, &tokens);
+    if (tokens.size() != expected.size()) {
+      printf("%s gives %zu tokens, not %zu\n", LEVEL_NAMES[level], tokens.size(), expected.size());
+      return false;
+    }
+    for (size_t i = 0; i < tokens.size(); i++) {
+      if (tokens[i] != expected[i]) {
+	printf("%s token %zu is \"%s\" on line %d, not \"%s\" on line %d\n", LEVEL_NAMES[level], i,
+	       tokens[i].text.c_str(), tokens[i].line, expected[i].text.c_str(), expected[i].line);
+	return false;
+      }
+    }
+
+    double fastest = 1e9;
+    size_t count = 0;
+    for (int run = 0; run < 10; run++) {
+      double start = cpuTime();
+      count = tokenize(module, (ScanLevel)level, nullptr);
+      fastest = std::min(fastest, cpuTime() - start);
+    }
+    printf("  %-6s %zu tokens, the same as scalar's; %.2f ms, %.0f MB/s\n", LEVEL_NAMES[level], count,
+	   fastest, module.size() / fastest / 1000);
+  }
+  return true;
+}
+
+int main(void) {
+  ScanLevel best = Scanner::bestLevel();
+  printf("Best scan level on this CPU: %s\n", LEVEL_NAMES[best]);
+  if (!checkSearches(best)) {
+    return 1;
+  }
+  printf("Searches from every position in 20000 texts: every level matches scalar\n");
+
+  if (!checkModule("Ordinary", makeModule(100000, 0), best)
+      || !checkModule("Padded", makeModule(100000, 40), best)) {
+    return 1;
+  }
+  return 0;
+}
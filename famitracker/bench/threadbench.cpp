@@ -0,0 +1,155 @@
+/* Times the ThreadPool at 1, 2, 4 and as many threads as there are CPUs: first on a batch of
+   compression jobs of uneven sizes, the way the song's patterns are compressed, and then on a
+   whole conversion with -j. Whatever the thread count, the results have to be the same as with
+   one thread. On a machine with one CPU there's nothing to gain, so all this shows there is
+   what the pool costs. */
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../Compressor.h"
+#include "../Importer.h"
+#include "../ThreadPool.h"
+
+static uint32_t seed = 1;
+
+static uint32_t nextRandom(void) {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+// mostly empty rows, with a note now and then; some inputs are several times longer than others
+static std::vector<std::vector<char>> makeJobs(size_t count) {
+  std::vector<std::vector<char>> jobs(count);
+  for (auto& job : jobs) {
+    job.resize(512 * (nextRandom() % 6 + 1));
+    for (auto& c : job) {
+      c = nextRandom() % 5 == 0 ? nextRandom() % 90 * 2 + 3 : 0;
+    }
+  }
+  return jobs;
+}
+
+static std::string makeModule(int patterns) {
+  static const char *NOTES[] = {"C-3", "E-3", "G-3", "C-4", "D#4", "A#3"};
+  std::ostringstream module;
+  module << "# FamiTracker text export 0.4.2\n"
+	 << "TITLE \"bench\"\nAUTHOR \"\"\nCOPYRIGHT \"\"\n"
+	 << "MACHINE 0\nFRAMERATE 0\nEXPANSION 0\nVIBRATO 1\nSPLIT 32\n\n"
+	 << "MACRO 0 0 -1 -1 0 : 15 14 13 12 11 10 9 8\n"
+	 << "MACRO 4 0 -1 -1 0 : 2 2 1 1 0 0 0 0\n\n"
+	 << "INST2A03 0 0 -1 -1 -1 0 \"a\"\n"
+	 << "INST2A03 1 -1 -1 -1 -1 0 \"b\"\n\n"
+	 << "TRACK 128 6 150 \"t\"\n"
+	 << "COLUMNS : 1 1 1 1 1\n\n";
+  for (int p = 0; p < patterns; p++) {
+    char order[32];
+    snprintf(order, sizeof order, "ORDER %02X : %02X %02X %02X %02X %02X\n", p, p, p, p, p, p);
+    module << order;
+  }
+  for (int p = 0; p < patterns; p++) {
+    char number[16];
+    snprintf(number, sizeof number, "%02X", p);
+    module << "\nPATTERN " << number << "\n";
+    for (int row = 0; row < 128; row++) {
+      char header[16];
+      snprintf(header, sizeof header, "ROW %02X", row);
+      module << header;
+      for (int c = 0; c < 5; c++) {
+	if (c < 2 && nextRandom() % 3 == 0) {
+	  module << " : " << NOTES[nextRandom() % 6] << " 0" << nextRandom() % 2 << " . ...";
+	} else {
+	  module << " : ... .. . ...";
+	}
+      }
+      module << "\n";
+    }
+  }
+  return module.str();
+}
+
+static double since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// compresses every job on the pool, with a compressor for each worker, the way the song does
+static std::vector<std::vector<char>> compressAll(const std::vector<std::vector<char>>& jobs, unsigned threads,
+						   double& time) {
+  std::vector<std::vector<char>> outputs;
+  time = 1e9;
+  for (int run = 0; run < 3; run++) {
+    ThreadPool pool(threads);
+    CompressionOptions options;
+    options.mode = COMPRESSION_OPTIMAL;
+    std::vector<Compressor> compressors;
+    for (unsigned worker = 0; worker < pool.getThreadCount(); worker++) {
+      compressors.emplace_back(options);
+    }
+    outputs.assign(jobs.size(), std::vector<char>());
+    auto start = std::chrono::steady_clock::now();
+    pool.forEach(jobs.size(), [&](unsigned worker, size_t i) {
+	compressors[worker].compress(jobs[i], outputs[i]);
+      });
+    time = std::min(time, since(start));
+  }
+  return outputs;
+}
+
+static std::string convert(const std::string& module, unsigned threads, double& time) {
+  std::string song;
+  time = 1e9;
+  for (int run = 0; run < 3; run++) {
+    auto start = std::chrono::steady_clock::now();
+    Importer importer(module);
+    CompressionOptions options;
+    options.mode = COMPRESSION_OPTIMAL;
+    options.threads = threads;
+    importer.setCompressionOptions(options);
+    // the module's title and so on aren't wanted
+    std::cout.setstate(std::ios::failbit);
+    std::ostringstream out;
+    importer.runImport().writeGb(out);
+    std::cout.clear();
+    time = std::min(time, since(start));
+    song = out.str();
+  }
+  return song;
+}
+
+int main(void) {
+  unsigned cpus = std::thread::hardware_concurrency();
+  printf("%u CPU%s\n", cpus, cpus == 1 ? " - the threads can only take turns, so expect no speedup" : "s");
+  std::vector<unsigned> threadCounts = {1, 2, 4};
+  if (cpus > 4) {
+    threadCounts.push_back(cpus);
+  }
+
+  std::vector<std::vector<char>> jobs = makeJobs(400);
+  std::string module = makeModule(40);
+  std::vector<std::vector<char>> expectedOutputs;
+  std::string expectedSong;
+  double oneThreadJobs = 0, oneThreadSong = 0;
+  bool same = true;
+  for (unsigned threads : threadCounts) {
+    double jobsTime, songTime;
+    auto outputs = compressAll(jobs, threads, jobsTime);
+    std::string song = convert(module, threads, songTime);
+    if (threads == 1) {
+      expectedOutputs = outputs;
+      expectedSong = song;
+      oneThreadJobs = jobsTime;
+      oneThreadSong = songTime;
+    }
+    printf("%2u threads: %zu patterns compressed in %7.1f ms (%.2fx), %s; song converted in %7.1f ms (%.2fx), %s\n",
+	   threads, jobs.size(), jobsTime, oneThreadJobs / jobsTime,
+	   outputs == expectedOutputs ? "identical" : "DIFFERENT", songTime, oneThreadSong / songTime,
+	   song == expectedSong ? "identical" : "DIFFERENT");
+    same &= outputs == expectedOutputs && song == expectedSong;
+  }
+  return same ? 0 : 1;
+}
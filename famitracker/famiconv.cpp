@@ -1,23 +1,144 @@
 #include <sstream>
 #include <fstream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include <sys/resource.h>
 
 #include "Importer.h"
 
+static void printUsage(const char *program) {
+  std::ostringstream errMsg;
+  errMsg << "Missing command line arguments; usage: " << program
+	 << " [-O|--optimal] [--fast-decode EXTRA_BYTES] [--stream-window BYTES] [--extended-lz] [--low-memory] [--per-channel] [--waits] [--row-masks] [--holds] [-j THREADS] [-v|--verbose] IN.txt OUT.bin"
+	 << " or " << program << " --check IN.txt";
+  std::cerr << errMsg.str();
+}
+
 int main(int argc, char **argv) {
-  if(argc != 3) {
-    std::ostringstream errMsg;
-    errMsg << "Missing command line arguments; usage: " << argv[0] << " IN.txt OUT.bin";
-    std::cerr << errMsg.str();
+  CompressionOptions compressionOptions;
+  bool printSummary = false;
+  bool checkOnly = false;
+
+  int arg = 1;
+  for(; arg < argc && argv[arg][0] == '-'; arg++) {
+    if(!strcmp(argv[arg], "-O") || !strcmp(argv[arg], "--optimal")) {
+      compressionOptions.mode = COMPRESSION_OPTIMAL;
+      printSummary = true;
+    } else if(!strcmp(argv[arg], "--fast-decode") && arg + 1 < argc) {
+      // trade up to this many extra bytes per pattern for a quicker Decompress
+      compressionOptions.mode = COMPRESSION_FAST_DECODE;
+      compressionOptions.extraByteBudget = atoi(argv[++arg]);
+      printSummary = true;
+    } else if(!strcmp(argv[arg], "--stream-window") && arg + 1 < argc) {
+      // the streaming engine decodes into a ring this big, which must be a power of two
+      unsigned window = atoi(argv[++arg]);
+      if(window < 16 || window > CompressionOptions::MAX_WINDOW || (window & (window - 1))) {
+	std::cerr << "Stream window must be a power of two from 16 to "
+		  << CompressionOptions::MAX_WINDOW << std::endl;
+	return -1;
+      }
+      compressionOptions.window = window;
+      compressionOptions.streaming = true;
+    } else if(!strcmp(argv[arg], "--extended-lz")) {
+      // let patterns use far matches too, where they're worth it
+      compressionOptions.extended = true;
+    } else if(!strcmp(argv[arg], "--low-memory")) {
+      // compress patterns as they're read and keep them on disk, at the cost of the dictionary
+      compressionOptions.lowMemory = true;
+    } else if(!strcmp(argv[arg], "--per-channel")) {
+      // for the per-channel engine: let each channel play its own patterns
+      compressionOptions.perChannel = true;
+    } else if(!strcmp(argv[arg], "--waits")) {
+      // play runs of empty rows as waits, which are quicker to play, if not always smaller
+      compressionOptions.waits = true;
+    } else if(!strcmp(argv[arg], "--row-masks")) {
+      // for the engine assembled with GBSOUND_ROW_MASK: only write the channels each row uses
+      compressionOptions.rowMasks = true;
+    } else if(!strcmp(argv[arg], "--holds")) {
+      // for the engine assembled with GBSOUND_INSTR_HOLD: hold instruments through empty frames
+      compressionOptions.holds = true;
+    } else if(!strcmp(argv[arg], "-j") && arg + 1 < argc) {
+      compressionOptions.threads = atoi(argv[++arg]);
+      if(compressionOptions.threads == 0) {
+	compressionOptions.threads = std::thread::hardware_concurrency();
+      }
+    } else if(!strcmp(argv[arg], "--check")) {
+      // just report everything that's wrong with the module
+      checkOnly = true;
+    } else if(!strcmp(argv[arg], "-v") || !strcmp(argv[arg], "--verbose")) {
+      printSummary = true;
+    } else {
+      std::cerr << "Unknown option " << argv[arg] << std::endl;
+      printUsage(argv[0]);
+      return -1;
+    }
+  }
+
+  if(compressionOptions.perChannel && compressionOptions.streaming) {
+    std::cerr << "--per-channel can't be used with --stream-window" << std::endl;
+    return -1;
+  }
+
+  if(compressionOptions.extended && compressionOptions.streaming) {
+    // the streaming decoder only understands plain LZ
+    std::cerr << "--extended-lz can't be used with --stream-window" << std::endl;
+    return -1;
+  }
+
+  if(compressionOptions.perChannel && compressionOptions.waits) {
+    // the channels' rows aren't in the song's patterns for a wait to stand in for
+    std::cerr << "--waits can't be used with --per-channel" << std::endl;
+    return -1;
+  }
+
+  if(compressionOptions.perChannel && compressionOptions.rowMasks) {
+    std::cerr << "--row-masks can't be used with --per-channel" << std::endl;
     return -1;
   }
 
-  Importer importer = Importer::fromFile(argv[1]);
+  if(argc - arg != (checkOnly ? 1 : 2)) {
+    printUsage(argv[0]);
+    return -1;
+  }
 
   std::ofstream out;
   try {
+    auto loadStart = std::chrono::steady_clock::now();
+    SourceFile source = SourceFile::open(argv[arg]);
+    auto loadTime = std::chrono::steady_clock::now() - loadStart;
+    size_t sourceSize = source.getText().size();
+    bool mapped = source.isMapped();
+
+    Importer importer(std::move(source));
+    importer.setCompressionOptions(compressionOptions);
+
+    if(checkOnly) {
+      auto errors = importer.runCheck();
+      for(const auto& error : errors) {
+	std::cerr << "Error: " << error << std::endl;
+      }
+      if(!errors.empty()) {
+	std::cerr << errors.size() << (errors.size() == 1 ? " error" : " errors") << " found" << std::endl;
+	return -2;
+      }
+      return 0;
+    }
+
     Song song = importer.runImport();
-    out.open(argv[2], std::ios::binary);
+    out.open(argv[arg + 1], std::ios::binary);
     song.writeGb(out);
+    if(printSummary) {
+      std::cout << "Loaded " << sourceSize << " bytes (" << (mapped ? "memory-mapped" : "read") << ") in "
+		<< std::chrono::duration_cast<std::chrono::microseconds>(loadTime).count() / 1000.0 << " ms" << std::endl;
+      song.printSummary(std::cout);
+      struct rusage usage;
+      if(getrusage(RUSAGE_SELF, &usage) == 0) {
+	std::cout << "Peak memory: " << usage.ru_maxrss << " KB" << std::endl;
+      }
+    }
   } catch (const std::stringstream& error) {
     std::cerr << "Error: " << error.str();
     return -2;
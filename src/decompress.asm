@@ -1,9 +1,8 @@
-SECTION "Decompress", HOME
-
-;; assumes HL contains src
-;;         DE contains dest
-Decompress::
-.chunk		LD A, [HLI]			; get flags
+;; Unpacks one block (a flag byte and the eight commands it covers); returns from the
+;; routine it's expanded in when it reaches EOF
+;; \1 is nonzero for the extended format, where a length of 1 or 2 starts a far match
+DECOMPRESS_BLOCK: MACRO
+		LD A, [HLI]			; get flags
 		LD B, A				; put flags in B
 REPT 8
 		LD A, [HLI]			; get next byte
@@ -11,6 +10,10 @@ REPT 8
 		JR NZ, .literal\@		; if so, we have a literal
 		AND A				; otherwise, check for EOF
 		RET Z
+IF \1
+		CP 3				; is it a far match?
+		JR C, .far\@
+ENDC
 		LD C, A				; store length to copy
 		LD A, [HLI]			; get -offset
 		PUSH HL				; backup read location
@@ -26,8 +29,127 @@ REPT 8
 		JR NZ, .copy\@
 		POP HL				; get pointer to compressed data
 		JR .nextbyte\@
+IF \1
+.far\@		CALL CopyFarMatch
+		JR .nextbyte\@
+ENDC
 .literal\@	LD [DE], A
 		INC DE
 .nextbyte\@	SRL B				; move to next flag
 ENDR
+ENDM
+
+SECTION "Decompress", HOME
+
+;; assumes HL contains src
+;;         DE contains dest
+Decompress::
+.chunk		DECOMPRESS_BLOCK 0
+		JP .chunk
+
+;; Unpacks a single block, for when the work needs spreading out
+;; assumes HL contains src
+;;         DE contains dest
+;; returns with carry set if there's more to come, with HL and DE ready to pick up from
+DecompressBlock::
+		DECOMPRESS_BLOCK 0
+		SCF
+		RET
+
+;; The extended format is the same, except that a command can also be a far match, which can
+;; copy more than 255 bytes from anywhere back in the pattern (or the dictionary). Those start
+;; with a 1 where the length would be, followed by the length (0 => 256) and -offset as a word;
+;; or with a 2, followed by the low byte of the length, how many passes of the copy loop it
+;; takes, and then -offset.
+;; Every match costs a little more to check whether it's a far one, so the converter only uses
+;; this for patterns that come out smaller for it.
+
+;; assumes HL contains src
+;;         DE contains dest
+DecompressX::
+.chunk		DECOMPRESS_BLOCK 1
 		JP .chunk
+
+;; Unpacks a single block of the extended format
+;; assumes HL contains src
+;;         DE contains dest
+;; returns with carry set if there's more to come, with HL and DE ready to pick up from
+DecompressXBlock::
+		DECOMPRESS_BLOCK 1
+		SCF
+		RET
+
+;; A = 1 or 2, HL points just past it, and B holds the flags, which are preserved
+;; There aren't enough registers to hold the copy length, the read pointer, and where to copy from
+;; and to all at once, so the number of passes gets parked in the destination for a moment - the
+;; copy overwrites it before it reads it, since a match always starts further back.
+CopyFarMatch:
+		PUSH BC				; save the flags
+		DEC A				; Z if the length is one byte
+		LD A, [HLI]
+		LD C, A				; C = length (or its low byte)
+		LD A, 1				; a short one takes a single pass
+		JR Z, .short
+		LD A, [HLI]			; otherwise get how many passes
+.short		LD [DE], A			; park the pass count
+		LD A, [HLI]			; newLoc = DE + (-offset)
+		ADD E
+		LD B, A
+		LD A, [HLI]
+		ADC D
+		PUSH HL				; backup read location
+		LD H, A
+		LD L, B
+		LD A, [DE]			; get back the pass count
+		LD B, A
+.copy		LD A, [HLI]
+		LD [DE], A
+		INC DE
+		DEC C
+		JR NZ, .copy
+		DEC B
+		JR NZ, .copy
+		POP HL				; get pointer to compressed data
+		POP BC				; and the flags
+		RET
+
+;; Patterns that are mostly runs of the same byte are packed with a simple RLE instead; each run
+;; starts with a control byte - $01-$7F for that many literal bytes, $81-$FF for the next byte
+;; repeated (control & $7F) times, or $00 for the end. Like DECOMPRESS_BLOCK, this unpacks one
+;; run and returns from the routine it's expanded in at the end.
+DECOMPRESS_RLE_RUN: MACRO
+		LD A, [HLI]			; get control byte
+		AND A				; check for EOF
+		RET Z
+		LD C, A
+		RES 7, C			; C = length of the run
+		BIT 7, A			; is it a repeat?
+		JR NZ, .repeat\@
+.literal\@	LD A, [HLI]
+		LD [DE], A
+		INC DE
+		DEC C
+		JR NZ, .literal\@
+		JR .done\@
+.repeat\@	LD A, [HLI]			; get the byte to repeat
+.fill\@		LD [DE], A
+		INC DE
+		DEC C
+		JR NZ, .fill\@
+.done\@
+ENDM
+
+;; assumes HL contains src
+;;         DE contains dest
+DecompressRLE::
+.run		DECOMPRESS_RLE_RUN
+		JR .run
+
+;; Unpacks a single run
+;; assumes HL contains src
+;;         DE contains dest
+;; returns with carry set if there's more to come, with HL and DE ready to pick up from
+DecompressRLERun::
+		DECOMPRESS_RLE_RUN
+		SCF
+		RET
@@ -70,11 +70,112 @@
 ;;; I don't claim that the below arrangement is 100% ideal - I could pack more onto single pages and pay only minor costs
 ;;; in speed at the expense of getting lots of RAM back - but it's "good enough".
 
+;;; Assemble with -DGBSOUND_STREAM to decode each pattern a byte at a time, as it plays, into a small
+;;; ring buffer rather than unpacking the whole thing up front into SongData. That trades the 1.5KB
+;;; of SongData (and the page for SongDict) for a GBSOUND_STREAM_WINDOW byte ring, at the cost of a
+;;; slower PopOpcode. The ring must be a power of two no bigger than a page, and songs for it have
+;;; to be converted with famiconv --stream-window set to the same size.
+IF DEF(GBSOUND_STREAM)
+IF !DEF(GBSOUND_STREAM_WINDOW)
+GBSOUND_STREAM_WINDOW EQU 256
+ENDC
+IF GBSOUND_STREAM_WINDOW < 16 || GBSOUND_STREAM_WINDOW > 256 || (GBSOUND_STREAM_WINDOW & (GBSOUND_STREAM_WINDOW - 1)) != 0
+		FAIL "GBSOUND_STREAM_WINDOW must be a power of two from 16 to 256"
+ENDC
+ENDC
+
+;;; Alternatively, assemble with -DGBSOUND_PREFETCH to spread the cost of decompressing each pattern
+;;; out over the frames before it's needed: while one pattern plays out of one buffer, the one the
+;;; song says comes next is decompressed GBSOUND_PREFETCH_BLOCKS blocks a frame into another, and
+;;; at the end of the pattern we just swap them. Costs a second SongData buffer.
+IF DEF(GBSOUND_PREFETCH)
+IF DEF(GBSOUND_STREAM)
+		FAIL "GBSOUND_STREAM and GBSOUND_PREFETCH can't be used together"
+ENDC
+IF !DEF(GBSOUND_PREFETCH_BLOCKS)
+GBSOUND_PREFETCH_BLOCKS EQU 4
+ENDC
+ENDC
+
+;;; Assemble with -DGBSOUND_PER_CHANNEL to play songs converted with famiconv --per-channel, in which
+;;; each channel plays patterns of its own, and the song's patterns only hold the song control
+;;; commands and say which pattern each channel plays. When a pattern starts, the channels' patterns
+;;; are unpacked into SongData after it, and each channel plays from its own pointer, in ChSongPtrs.
+;;; Neither streaming nor prefetching knows about channel patterns.
+IF DEF(GBSOUND_PER_CHANNEL)
+IF DEF(GBSOUND_STREAM) || DEF(GBSOUND_PREFETCH)
+		FAIL "GBSOUND_PER_CHANNEL can't be used with GBSOUND_STREAM or GBSOUND_PREFETCH"
+ENDC
+ELSE
+;;; otherwise the channels' notes are in the song's patterns, and come out of the same stream
+PopChOpcode	EQUS "PopOpcode"
+ENDC
+
+;;; Assemble with -DGBSOUND_ROW_MASK to play songs converted with famiconv --row-masks, whose rows
+;;; start with a mask of the channels that have anything to play, and leave the rest out; those
+;;; channels aren't ticked at all, rather than each reading a NOP.
+IF DEF(GBSOUND_ROW_MASK)
+IF DEF(GBSOUND_PER_CHANNEL)
+		FAIL "GBSOUND_ROW_MASK can't be used with GBSOUND_PER_CHANNEL"
+ENDC
+ENDC
+
+;;; Assemble with -DGBSOUND_INSTR_HOLD to play songs converted with famiconv --holds, whose
+;;; instruments hold through each run of frames where nothing changes, rather than reading an end
+;;; of frame every frame. UpdateInstrs skips a channel that's holding (or whose instrument has
+;;; finished) altogether, at the cost of a check on every other.
+
+;;; How each pattern's been compressed - kept in the top two bits of its entry in the pattern table
+PATTERN_LZ	EQU 0
+PATTERN_RLE	EQU 1
+;;; stored patterns aren't compressed at all, and get played straight from the ROM
+PATTERN_STORED	EQU 2
+;;; the extended LZ format, with far matches (see DecompressX)
+PATTERN_LZX	EQU 3
+
 SECTION "MusicVars", BSS
-;;; where the song starts in ROM
+;;; where the song's patterns start in ROM, just after the track directory; the offsets in the
+;;; pattern and instrument tables and the directory are from here
 SongBase:	DS 2
+;;; which of the song's tracks to play, while it's being loaded
+SongTrack:	DS 1
+;;; while loading a song, which of the tables still to come are compressed, lowest bit first
+PackedTbls:	DS 1
+IF DEF(GBSOUND_STREAM)
+;;; where the dictionary is in ROM, and how long it is; it gets copied into the ring for each pattern
+SongDictPtr:	DS 2
+SongDictLen:	DS 1
+;;; The decoder's state between calls to PopOpcode
+;;; bytes of the current match still to hand out, and where in the ring the next of them is
+StreamCopyLen:	DS 1
+StreamCopySrc:	DS 1
+;;; flags for the rest of the current block, and how many commands are left in it
+StreamFlags:	DS 1
+StreamCmds:	DS 1
+;;; the next byte of compressed pattern data in ROM
+StreamSrc:	DS 2
+;;; where in the ring the next byte we hand out goes
+StreamDest:	DS 1
+ELSE
 ;;; pointer into the opcode stream
 SongPtr:	DS 2	;; musn't cross a page
+ENDC
+IF DEF(GBSOUND_PREFETCH)
+;;; where the successor table is in ROM; see LoadSuccessors
+SuccessorTbl:	DS 2
+;;; which pattern is being decompressed in the background (like NextPattern), or $FF for none...
+PrefetchPat:	DS 1
+;;; ...and the page of the buffer it's going in to
+PrefetchBuf:	DS 1
+;;; non-zero while there are blocks of it still to decompress
+PrefetchLeft:	DS 1
+;;; how it's compressed, and where it'll play from once it's ready
+PrefetchCodec:	DS 1
+PrefetchStart:	DS 2
+;;; where we got up to
+PrefetchSrc:	DS 2
+PrefetchDest:	DS 2
+ENDC
 ;;; Pattern numbers are used to look up an entry in the pattern table
 ;;; The pattern table contains pointers into the opcode stream
 NextPattern:	DS 1
@@ -83,6 +184,12 @@ EndOfPat:	DS 1
 ;;; Each frame, SongTimer is incremented by SongRate; if it overflows, we run a music tick
 SongRate:	DS 1
 SongTimer:	DS 1 ;; must follow SongRate
+;;; how many more ticks to sit out before reading the song again, after a SongWait
+SongWaitTicks:	DS 1
+IF DEF(GBSOUND_ROW_MASK)
+;;; which channels the current row has something for, lowest bit first; shifted out as they tick
+RowMask:	DS 1
+ENDC
 ;;; Used to keep track of the current channel being updated
 ChNum:		DS 1
 ;;; please keep this and ChRegBase together
@@ -99,6 +206,11 @@ ChRegBase:	DS 1
 ;;; These values are in BYTES
 InstrTblLen:	DS 1
 PatTblLen:	DS 1
+IF !DEF(GBSOUND_STREAM)
+;;; the codec for each pattern, split out of the pattern table by SplitPatCodecs; the streaming
+;;; engine only plays LZ patterns, so it has no need of these
+PatternCodecs:	DS 128
+ENDC
 
 ;;; An instrument is a stream of special opcodes that update a channel's output
 ;;; parameters on a per note basis
@@ -109,6 +221,12 @@ ChInstrBases:	DS 4 * 2
 ;;; MUST BE TOGETHER
 SECTION "ChInstrPtrs", BSS[$C100]
 ChInstrPtrs:	DS 4 * 2
+IF DEF(GBSOUND_INSTR_HOLD)
+;;; MUST FOLLOW ChInstrPtrs
+;;; how many more frames each channel's instrument is holding for (see ChInstrHold)
+;;; the second byte of each channel is ignored
+ChInstrHolds:	DS 4 * 2
+ENDC
 ;;; MUST BE TOGETHER
 SECTION "ChInstrMarkers", BSS[$C200]
 ;;; Instruments can contain an unbounded loop;
@@ -126,6 +244,15 @@ ChDirty:	DS 4 * 2
 SECTION "ChCurNotes", BSS[$C400]
 ;;; Stores the current note (offset into the note table) being output on each channel
 ChCurNotes:	DS 4
+IF DEF(GBSOUND_PER_CHANNEL)
+;;; where each channel's next opcode is, in a per-channel song; the high byte's 0 for a channel
+;;; with nothing to play in the current pattern
+SECTION "ChSongPtrs", BSS[$C480]
+ChSongPtrs:	DS 4 * 2
+;;; MUST FOLLOW ChSongPtrs
+;;; where each channel's table of patterns is in ROM; see LoadChPatTbls
+ChPatTbls:	DS 4 * 2
+ENDC
 ;;; MUST BE TOGETHER
 SECTION "ChOctaves", BSS[$C500]
 ;;; stores an offset that's added to note lookup; used to change keys or octaves
@@ -145,22 +272,49 @@ InstrumentTbl:	DS 128*2
 SECTION "Waves", BSS[$C900]
 Waves:		DS 256
 
-SECTION "SongData", BSS[$CA00]
+IF DEF(GBSOUND_STREAM)
+;;; The last GBSOUND_STREAM_WINDOW bytes of the current pattern, which is all the history a match can
+;;; refer to; page aligned so that wrapping around is just a matter of masking the low byte
+SECTION "SongRing", BSS[$CA00]
+SongRing:	DS GBSOUND_STREAM_WINDOW
+ELSE
+;;; The song's preset dictionary (if any) is copied into the END of this page, so that it sits
+;;; immediately before SongData and every pattern's matches can reach back into it
+SECTION "SongDict", BSS[$CA00]
+SongDict:	DS 256
+
+SECTION "SongData", BSS[$CB00]
 SongData:	DS $600
+ENDC
+
+IF DEF(GBSOUND_PREFETCH)
+;;; The other buffer, for prefetching into; each has its own copy of the dictionary right before it
+SECTION "SongDict2", BSS[$D100]
+SongDict2:	DS 256
+
+SECTION "SongData2", BSS[$D200]
+SongData2:	DS $600
+ENDC
 
 SECTION "GbSound", ROM0
 
 ;;; Song initialization:
 ;;; Call with HL = Song
 ;;; this is one of the few functions exported from this module; it should be called whenever you'd like to
-;;; play a new song
-InitSndEngine:: 
+;;; play a new song. It plays the song's first track
+InitSndEngine:: XOR A
+;;; Call with HL = Song, A = which of its tracks to play (0 for the first)
+;;; A module with several tracks converts to a single song, whose tracks all share the same instruments
+;;; and waves; this plays any one of them
+InitSndEngineTrack::
+		LD [SongTrack], A
 	;; set this to $FF, so it ticks as soon as we start playing
 		LD A, $FF
 		LD [SongTimer], A
-	;; NextPattern = 0, the first pattern
+	;; NextPattern = 0, the first pattern, and there's no wait
 		INC A
 		LD [NextPattern], A
+		LD [SongWaitTicks], A
 	;; Set the EndOfPat flag to 1, so that we'll load the NextPattern (the first one) once we tick
 		INC A
 		LD [EndOfPat], A
@@ -168,41 +322,124 @@ InitSndEngine::
 		CALL ClearFreqs
 		CALL ClearEffects
 		CALL ClearSndRegs
+IF DEF(GBSOUND_PREFETCH)
+		CALL InitPrefetch
+ENDC
 		JP InitInstrs
 
 ;;; Call with HL = Song
 ;;; HL is mutated across function calls and consistently points
 ;;; to the location in the song data we're working through
-LoadSong:	LD A, L
-		LD [SongBase], A
-		LD A, H
-		LD [SongBase+1], A
-		CALL LoadSongCtrlCh
+LoadSong:	CALL LoadSongCtrlCh
+		CALL LoadDict
+		LD A, [HLI]			; which tables are compressed
+		LD [PackedTbls], A
 		CALL LoadWaves
-		CALL LoadPatternTbl
 		CALL LoadInstrTbl
+		CALL FindTrack
+		CALL LoadTrackCtrl
+		CALL LoadPatternTbl
+		CALL LoadSuccessors
+IF DEF(GBSOUND_PER_CHANNEL)
+		CALL LoadChPatTbls
+ENDC
+IF !DEF(GBSOUND_STREAM)
+		CALL SplitPatCodecs
+ENDC
 		CALL OffsetPatTbl
 		JP OffsetInstrTbl
 
-;;; The first three bytes in the song data provide this information: settings for two hardware registers
-;;; indicating which channels should be active and their volume; and a number that controls how often
-;;; the sound engine ticks (see UpdateSndFrame)
+;;; The first two bytes in the song data are settings for two hardware registers indicating which channels
+;;; should be active and their volume
 LoadSongCtrlCh:	LD A, [HLI]			; volume config
 		LDH [$24], A
 		LD A, [HLI]			; channel select
 		LDH [$25], A
-		LD A, [HLI]			; song rate
+		RET
+
+;;; After the instrument table comes the track directory: how many tracks there are, then for each a 2 byte
+;;; offset from the end of the directory (where the patterns start, and so SongBase) to the track, which
+;;; comes after the instruments
+;;; returns HL = the track in SongTrack
+FindTrack:	LD A, [HLI]			; how many tracks
+		ADD A				; 2 bytes each
+		LD C, A
+		LD B, 0
+	;; DE = the track's offset
+		LD A, [SongTrack]
+		ADD A
+		LD E, A
+		LD D, B
+		PUSH HL
+		ADD HL, DE
+		LD A, [HLI]
+		LD E, A
+		LD D, [HL]
+		POP HL
+	;; the patterns start right after the directory
+		ADD HL, BC
+		LD A, L
+		LD [SongBase], A
+		LD A, H
+		LD [SongBase+1], A
+		ADD HL, DE
+		RET
+
+;;; Each track starts with a number that controls how often the sound engine ticks (see UpdateSndFrame),
+;;; then whether its pattern table is compressed; the table and the successor table come next
+LoadTrackCtrl:	LD A, [HLI]			; song rate
 		LD [SongRate], A
+		LD A, [HLI]
+		LD [PackedTbls], A
 		RET
 
-;;; The raw wave data is copied from the ROM into RAM. One day we might want to compress it in the ROM?
-;;; At any rate, the reason is simple: while we could pull it from the ROM rather than RAM in theory,
-;;; we can't guarantee that it'll be nicely aligned on a page in ROM, and we'd need to compute/store
-;;; the initial pointer to it to boot. With the waves in RAM at a fixed, page-aligned location,
-;;; it's much faster to switch waves during playback, at the expense of some memory and an upfront speed cost here
-LoadWaves:	LD A, [HLI]			; how many bytes of wave data to load
+;;; Decompress only ever looks back at what it's already written, so a pattern's matches can refer
+;;; to the song's dictionary as long as the dictionary sits immediately before SongData. We copy it
+;;; in once here - nothing else ever writes to SongDict, so it's still there for every pattern.
+LoadDict:	LD A, [HLI]			; how many bytes of dictionary (0 for none)
+IF DEF(GBSOUND_STREAM)
+	;; each pattern overwrites the ring, so rather than copy the dictionary now we just note where
+	;; it is and skip over it; StartStream copies it in whenever a pattern starts
+		LD [SongDictLen], A
+		LD E, A
+		LD D, 0
+		LD A, L
+		LD [SongDictPtr], A
+		LD A, H
+		LD [SongDictPtr+1], A
+		ADD HL, DE
+		RET
+ELSE
+		AND A
+		RET Z
 		LD B, A
-		LD DE, Waves
+	;; the dictionary ends where SongData begins, so it starts at SongData - length
+		CPL
+		INC A
+		LD E, A
+		LD D, SongDict >> 8
+.loop:		LD A, [HLI]
+		LD [DE], A
+IF DEF(GBSOUND_PREFETCH)
+	;; and the same again in front of the other buffer
+		LD D, SongDict2 >> 8
+		LD [DE], A
+		LD D, SongDict >> 8
+ENDC
+		INC E
+		DEC B
+		JR NZ, .loop
+		RET
+ENDC
+
+;;; B = how many bytes the table takes up in RAM (0 => 256), DE = where in RAM it goes
+;;; The waves and the pattern and instrument tables are each either stored as they are, and just
+;;; copied, or LZ compressed, in which case it's the same as unpacking a pattern. The next bit of
+;;; PackedTbls says which.
+LoadTable:	LD A, [PackedTbls]
+		SRL A
+		LD [PackedTbls], A
+		JP C, Decompress
 .loop:		LD A, [HLI]
 		LD [DE], A
 		INC E
@@ -210,33 +447,79 @@ LoadWaves:	LD A, [HLI]			; how many bytes of wave data to load
 		JR NZ, .loop
 		RET
 
+;;; The wave data is copied (or decompressed) from the ROM into RAM. The reason is simple: while we could
+;;; pull it from the ROM rather than RAM in theory, we can't guarantee that it'll be nicely aligned on a page
+;;; in ROM, and we'd need to compute/store the initial pointer to it to boot. With the waves in RAM at a
+;;; fixed, page-aligned location, it's much faster to switch waves during playback, at the expense of some
+;;; memory and an upfront speed cost here
+LoadWaves:	LD A, [HLI]			; how many bytes of wave data to load
+		LD B, A
+		LD DE, Waves
+		JR LoadTable
+
 ;;; We copy the pointers of the pattern table into RAM from ROM for now. In part this is for the same reason
 ;;; as why we copy in the waves - quicker lookup. But there's another reason, too - the pointers given in ROM
-;;; are *relative to the start of the song*, rather than absolute memory addresses. In OffsetTbl below we patch
+;;; are *relative to the end of the tables*, rather than absolute memory addresses. In OffsetTbl below we patch
 ;;; the pattern table in RAM and translate it from relative to absolute addresses, so naturally it needs to be in
 ;;; RAM.
 LoadPatternTbl:	LD DE, PatternTable
 		LD A, [HLI]			; how many pattern table bytes to load
 		LD B, A
 		LD [PatTblLen], A
-.loop:		LD A, [HLI]
+		JR LoadTable
+
+;;; Right after the pattern table comes the successor table, one byte per pattern saying which one
+;;; (in the same form as NextPattern) the song plays after it, or $FF if it stops there. Only
+;;; prefetching needs it, so that it knows what to start decompressing; otherwise we skip over it.
+LoadSuccessors:
+IF DEF(GBSOUND_PREFETCH)
+		LD A, L
+		LD [SuccessorTbl], A
+		LD A, H
+		LD [SuccessorTbl+1], A
+ENDC
+	;; half as many bytes as the pattern table (where 0 => 256, so 0 => 128 here)
+		LD A, [PatTblLen]
+		DEC A
+		SRL A
+		INC A
+		LD E, A
+		LD D, 0
+		ADD HL, DE
+		RET
+
+;;; In a per-channel song each channel has a table of patterns after the successor table: how many
+;;; patterns are in it, then an entry for each, in the same form as the pattern table's. These stay
+;;; in ROM - PlayChPattern looks up each entry as it's needed - so we just note where each one is.
+IF DEF(GBSOUND_PER_CHANNEL)
+LoadChPatTbls:	LD DE, ChPatTbls
+		LD B, 4
+.loop:		LD A, [HLI]			; how many patterns
+		LD C, A
+		LD A, L
 		LD [DE], A
 		INC E
+		LD A, H
+		LD [DE], A
+		INC E
+	;; skip over the entries, 2 bytes each
+		PUSH BC
+		LD B, 0
+		SLA C
+		RL B
+		ADD HL, BC
+		POP BC
 		DEC B
 		JR NZ, .loop
 		RET
+ENDC
 
 ;;; See the comments about the pattern table above, in LoadPatternTbl
 LoadInstrTbl:	LD DE, InstrumentTbl
 		LD A, [HLI]
 		LD B, A
 		LD [InstrTblLen], A
-.loop:		LD A, [HLI]
-		LD [DE], A
-		INC E
-		DEC B
-		JR NZ, .loop
-		RET
+		JR LoadTable
 
 ;;; B = number of BYTES to update
 ;;; HL - pointer to table
@@ -264,6 +547,52 @@ OffsetTbl:	SRL B		; B = number of pointers to update
 		JR NZ, .loop
 		RET
 
+IF !DEF(GBSOUND_STREAM)
+;;; Each pattern table entry's top two bits say how that pattern's compressed; move them out into
+;;; PatternCodecs before OffsetPatTbl turns the (now 14-bit) offsets into addresses
+SplitPatCodecs:	LD A, [PatTblLen]
+	;; (where 0 => 256 bytes, so 0 => 128 patterns)
+		DEC A
+		SRL A
+		INC A
+		LD B, A
+		LD HL, PatternTable + 1		; the most significant byte of the first entry
+		LD DE, PatternCodecs
+.loop:		LD A, [HL]
+		LD C, A
+		AND $3F
+		LD [HL], A
+		INC L
+		INC L
+		LD A, C
+		RLCA
+		RLCA
+		AND 3
+		LD [DE], A
+		INC DE
+		DEC B
+		JR NZ, .loop
+		RET
+
+;;; A = pattern number (doubled, like NextPattern)
+;;; returns the pattern's address in HL and its codec in A; clobbers DE
+GetPattern:	LD E, A
+		SRL A
+		LD HL, PatternCodecs
+		ADD L
+		LD L, A
+		JR NC, .nc
+		INC H
+.nc:		LD D, [HL]
+		LD H, PatternTable >> 8
+		LD L, E
+		LD A, [HLI]
+		LD H, [HL]
+		LD L, A
+		LD A, D
+		RET
+ENDC
+
 OffsetPatTbl:	LD A, [PatTblLen]
 		LD B, A
 		LD HL, PatternTable
@@ -354,6 +683,14 @@ InitInstrs:	LD HL, ChInstrBases
 		LD [HLI], A
 		DEC B
 		JR NZ, .loop2
+IF DEF(GBSOUND_INSTR_HOLD)
+	;; and nothing's holding (HL is at ChInstrHolds now)
+		XOR A
+		LD B, 4 * 2
+.loop3:		LD [HLI], A
+		DEC B
+		JR NZ, .loop3
+ENDC
 		RET
 
 ;;; this should be called every frame; a good pattern is to call it in vblank AFTER updating VRAM
@@ -377,19 +714,58 @@ UpdateSndFrame::LD HL, EndOfPat	; test the current pattern over flag
 	;; every frame, regardless if the engine ticks, we update the instruments
 		CALL UpdateInstrs
 	;; finally, we tell the hardware to refresh by writing the frequencies
+IF DEF(GBSOUND_PREFETCH)
+		CALL UpdateHardware
+	;; with the time critical work done, put a little time into the next pattern
+		LD B, GBSOUND_PREFETCH_BLOCKS
+		JP PrefetchSome
+ELSE
 		JP UpdateHardware
+ENDC
 
 ;;; Called whenever the sound engine "ticks"; every frame the song's "rate" variable gets
 ;;; added to an 8-bit timer variable, and when the timer wraps around (exceeds 255) 
 ;;; we trigger a tick and play the next command on each channel.
-RunSndTick:	CALL TickSongCtrl
+RunSndTick:	LD HL, SongWaitTicks
+		LD A, [HL]
+		AND A
+		JR Z, .read
+	;; still waiting - nothing to play on this tick
+		DEC [HL]
+		RET
+.read:		CALL TickSongCtrl
 		LD HL, ChNum
 		XOR A
 		LD [HLI], A
 	;; set reg base ($FF10)
 		LD A, $10
 		LD [HL], A
-.loop:		CALL TickCh
+.loop:
+IF DEF(GBSOUND_ROW_MASK)
+	;; skip any channel the row has nothing for, without reading anything - and once there are
+	;; none left, we're done
+		LD HL, RowMask
+		SRL [HL]
+		JR C, .tick
+		RET Z
+		JR .next
+.tick:		CALL TickCh
+.next:
+ENDC
+IF DEF(GBSOUND_PER_CHANNEL)
+	;; skip any channel that has no pattern to play
+		LD A, [ChNum]
+		ADD A
+		ADD (ChSongPtrs & $FF) + 1
+		LD L, A
+		LD H, ChSongPtrs >> 8
+		LD A, [HL]
+		AND A
+		CALL NZ, TickCh
+ENDC
+IF !DEF(GBSOUND_PER_CHANNEL) && !DEF(GBSOUND_ROW_MASK)
+		CALL TickCh
+ENDC
 		LD HL, ChRegBase
 		LD A, [HL]
 		ADD 5
@@ -405,41 +781,277 @@ RunSndTick:	CALL TickSongCtrl
 ;;; Moreover, the end of one pattern DOES NOT automatically trigger the playback of the next;
 ;;; if a pattern doesn't end with a song end or pattern jump command, the sound engine will
 ;;; start executing garbage and likely crash the game
-;;; The execution of a "jump" command will raise an "end of pattern" flag and load the pattern
-;;; to play into a "next pattern" variable; then, when the sound engine ticks again, it will call
-;;; this procedure if the end of pattern flag has been raised to actually load the new pattern in
-;;; This is also how the initial pattern gets loaded - the init routines raise an end of pattern
-;;; condition and set the initial pattern to be the "next pattern".
+;;; The execution of a "jump" command will load the pattern to play into a "next pattern" variable
+;;; and call this procedure right away, so that the new pattern's first row plays on the same tick
+;;; The initial pattern gets loaded differently - the init routines raise an "end of pattern" flag
+;;; and set the initial pattern to be the "next pattern", and UpdateSndFrame calls this when it sees it.
 PlayNextPat:
 	;; first, figure out what pattern to play
 		LD HL, NextPattern
 		LD A, [HL]
 		INC [HL]	; patterns go by twos
 		INC [HL]
+IF DEF(GBSOUND_PREFETCH)
+		JP PlayPrefetched
+ELSE
+IF DEF(GBSOUND_STREAM)
 	;; now load a pointer to that pattern, pulled from the PatternTable
 		LD H, PatternTable >> 8
 		LD L, A
 		LD A, [HLI]
 		LD H, [HL]
 		LD L, A
-	;; decompress it into the song data
+	;; nothing gets decompressed up front - PopOpcode decodes the pattern as it's played
+		JP StartStream
+ELSE
+	;; now load a pointer to that pattern, pulled from the PatternTable, along with how it's
+	;; been compressed
+		CALL GetPattern
 		LD DE, SongData
-		CALL Decompress
+		CALL UnpackPattern
+IF DEF(GBSOUND_PER_CHANNEL)
+		CALL PlayChPatterns
+ENDC
 	;; finally - point the SongPtr to the beginning of the new data
-		LD HL, SongPtr
+		LD A, L
+		LD [SongPtr], A
+		LD A, H
+		LD [SongPtr+1], A
+		RET
+
+;;; A = how the pattern's been compressed, HL = where it is, DE = where to unpack it
+;;; returns HL = where to play it from, and DE = the end of what was unpacked
+UnpackPattern:
+	;; stored patterns play from where they are
+		CP PATTERN_STORED
+		RET Z
+	;; but anything else gets decompressed
+		PUSH DE
+		AND A				; PATTERN_LZ?
+		JR NZ, .notLz
+		CALL Decompress
+		JR .decompressed
+.notLz:		CP PATTERN_RLE
+		JR NZ, .lzx
+		CALL DecompressRLE
+		JR .decompressed
+.lzx:		CALL DecompressX
+.decompressed:	POP HL
+		RET
+ENDC
+ENDC
+
+IF DEF(GBSOUND_PER_CHANNEL)
+;;; A per-channel song's pattern starts with the number (doubled) of the pattern each channel plays
+;;; alongside it, or $FF for none; the rest of it is just a song control byte for each row.
+;;; HL = the song's pattern, DE = the end of what's been unpacked so far
+;;; returns HL = where the song control bytes start
+PlayChPatterns:	LD C, 0				; the channel (doubled)
+.loop:		LD A, [HLI]
+		PUSH HL
+		CALL PlayChPattern
+		POP HL
+		INC C
+		INC C
+		LD A, C
+		CP 4 * 2
+		JR NZ, .loop
+		RET
+
+;;; A = the channel's pattern (doubled) or $FF, C = the channel (doubled), DE = where to unpack it
+;;; points the channel's ChSongPtr at the pattern; returns DE = the end of what was unpacked, and
+;;; leaves C alone
+PlayChPattern:	LD B, A
+		LD H, ChSongPtrs >> 8
+		LD A, C
+		ADD ChSongPtrs & $FF
+		LD L, A
+		INC B				; $FF => nothing to play
+		JR NZ, .play
 		XOR A
 		LD [HLI], A
-		LD A, SongData >> 8
 		LD [HL], A
 		RET
+.play:		DEC B
+		PUSH HL				; (where the pointer goes)
+	;; look the pattern up in the channel's table
+		SET 3, L			; move to ChPatTbls
+		LD A, [HLI]
+		LD H, [HL]
+		ADD B
+		LD L, A
+		JR NC, .nc
+		INC H
+.nc:		LD A, [HLI]
+		LD H, [HL]
+		LD L, A
+	;; the top two bits are its codec, and the rest's an offset from SongBase
+		LD A, H
+		RLCA
+		RLCA
+		AND 3
+		LD B, A
+		LD A, H
+		AND $3F
+		LD H, A
+		LD A, [SongBase]
+		ADD L
+		LD L, A
+		LD A, [SongBase+1]
+		ADC H
+		LD H, A
+		LD A, B
+		PUSH BC
+		CALL UnpackPattern
+		POP BC
+		LD B, H
+		LD A, L
+		POP HL
+		LD [HLI], A
+		LD [HL], B
+		RET
+ENDC
+
+IF DEF(GBSOUND_PREFETCH)
+InitPrefetch:	LD A, SongData >> 8
+		LD [PrefetchBuf], A
+		LD A, $FF
+		JP StartPrefetch
+
+;;; A = the pattern to play
+;;; Normally it's been decompressing a few blocks a frame while the last pattern played, so there's
+;;; little or nothing left to do but finish it off and swap buffers. If the song went somewhere the
+;;; successor table didn't predict, we fall back to decompressing the whole thing now.
+PlayPrefetched:	LD B, A
+		LD HL, PrefetchPat
+		CP [HL]
+		CALL NZ, StartPrefetch
+	;; finish off whatever's left
+.finish:	PUSH BC
+		LD B, 0
+		CALL PrefetchSome
+		POP BC
+		LD A, [PrefetchLeft]
+		AND A
+		JR NZ, .finish
+	;; play from the buffer we just filled (or, for a stored pattern, the ROM)...
+		LD HL, PrefetchStart
+		LD A, [HLI]
+		LD [SongPtr], A
+		LD A, [HL]
+		LD [SongPtr+1], A
+	;; ...and start filling the other buffer with whatever comes after this pattern
+		LD A, [PrefetchBuf]
+		XOR (SongData >> 8) ^ (SongData2 >> 8)
+		LD [PrefetchBuf], A
+		LD HL, SuccessorTbl
+		LD A, [HLI]
+		LD H, [HL]
+		LD L, A
+		LD A, B
+		SRL A		; the successor table has one byte per pattern, not two
+		ADD L
+		LD L, A
+		JR NC, .nc
+		INC H
+.nc:		LD A, [HL]
+		JP StartPrefetch
+
+;;; A = the pattern to decompress into PrefetchBuf, or $FF for none
+StartPrefetch:	LD [PrefetchPat], A
+		INC A
+		JR Z, .store	; nothing to do, so PrefetchLeft = 0
+		DEC A
+		CALL GetPattern
+		LD [PrefetchCodec], A
+		CP PATTERN_STORED
+		JR NZ, .decompress
+	;; a stored pattern plays straight out of the ROM, so there's nothing to do
+		LD A, L
+		LD [PrefetchStart], A
+		LD A, H
+		LD [PrefetchStart+1], A
+		XOR A
+		JR .store
+	;; point the source at the pattern, and the destination at the start of the buffer
+.decompress:	LD A, L
+		LD [PrefetchSrc], A
+		LD A, H
+		LD [PrefetchSrc+1], A
+		XOR A
+		LD [PrefetchDest], A
+		LD [PrefetchStart], A
+		LD A, [PrefetchBuf]
+		LD [PrefetchDest+1], A
+		LD [PrefetchStart+1], A
+		LD A, 1
+.store:		LD [PrefetchLeft], A
+		RET
+
+;;; B = the most blocks (or for RLE patterns, runs) to decompress (0 => 256)
+;;; Picks up decompressing the pattern in PrefetchBuf where we last left off
+PrefetchSome:	LD A, [PrefetchLeft]
+		AND A
+		RET Z
+		LD HL, PrefetchDest
+		LD A, [HLI]
+		LD E, A
+		LD D, [HL]
+		LD HL, PrefetchSrc
+		LD A, [HLI]
+		LD H, [HL]
+		LD L, A
+.loop:		PUSH BC
+		LD A, [PrefetchCodec]
+		AND A				; PATTERN_LZ?
+		JR NZ, .notLz
+		CALL DecompressBlock
+		JR .next
+.notLz:		CP PATTERN_RLE
+		JR NZ, .lzx
+		CALL DecompressRLERun
+		JR .next
+.lzx:		CALL DecompressXBlock
+.next:		POP BC
+		JR NC, .done
+		DEC B
+		JR NZ, .loop
+	;; save our place for next time
+		LD A, L
+		LD [PrefetchSrc], A
+		LD A, H
+		LD [PrefetchSrc+1], A
+		LD A, E
+		LD [PrefetchDest], A
+		LD A, D
+		LD [PrefetchDest+1], A
+		RET
+.done:		XOR A
+		LD [PrefetchLeft], A
+		RET
+ENDC
 
 ;;; Each tick, before playing the next note on each channel, the music engine executes an optional song 
 ;;; control command that updates the overall state of the engine. This might be a jump command, a tempo
 ;;; control command, etc. - something that has global, rather than per channel effects.
 TickSongCtrl:	CALL PopOpcode
+IF DEF(GBSOUND_ROW_MASK)
+	;; an even byte is the row's channel mask (doubled), rather than a NOP
+		BIT 0, A
+		JR NZ, .cmd
+		SRL A
+		LD [RowMask], A
+		RET
+	;; a command that doesn't read on to a mask leaves no channels to tick
+.cmd:		LD B, A
+		XOR A
+		LD [RowMask], A
+		LD A, B
+ELSE
 	;; 0 is a NOP
 		AND A
 		RET Z
+ENDC
 	;; SongOpcodes are then numbered 1, 3, ... in the stream
 		DEC A
 		LD H, CmdTblSongCtrl >> 8
@@ -452,7 +1064,7 @@ TickSongCtrl:	CALL PopOpcode
 ;;; There are two different type of channel commands - note commands and for lack of a better name
 ;;; "normal" commands. On any given tick, the music engine will execute, per channel, an arbitrarily
 ;;; long sequence of normal commands (ChCmd tail calls back into TickCh) and at most one note.
-TickCh:		CALL PopOpcode
+TickCh:		CALL PopChOpcode
 	;; 0 is a NOP
 		AND A
 		RET Z
@@ -473,13 +1085,24 @@ TickCh:		CALL PopOpcode
 ;;; Each *frame* (i.e. always 60Hz) the engine will run an arbitrary number of instrument commands
 ;;; for each channel. Every time a new note is played on a channel the engine will restart that channel's
 ;;; instrument.
-UpdateInstrs:	LD HL, ChNum
-		XOR A
-		LD [HLI], A
+UpdateInstrs:	LD HL, ChRegBase
 		LD A, $10
-		LD [HL], A
-.loop:		CALL ApplyInstrCh
-		LD HL, ChRegBase
+		LD [HLD], A
+		XOR A
+		LD [HL], A	; ChNum
+.loop:
+IF DEF(GBSOUND_INSTR_HOLD)
+	;; an instrument that's holding has nothing to do but count off the frame
+		ADD A
+		LD H, ChInstrPtrs >> 8
+		LD L, A
+		SET 3, L	; move to ChInstrHolds
+		LD A, [HL]
+		AND A
+		JR NZ, .held
+ENDC
+		CALL ApplyInstrCh
+.next:		LD HL, ChRegBase
 		LD A, [HL]
 		ADD $5
 		LD [HLD], A
@@ -490,6 +1113,10 @@ UpdateInstrs:	LD HL, ChNum
 		CP 4
 		JR NZ, .loop
 		RET
+IF DEF(GBSOUND_INSTR_HOLD)
+.held:		DEC [HL]
+		JR .next
+ENDC
 
 ;;; Executes an arbitrary number of instrument commands for the channel in ChNum.
 ApplyInstrCh:	LD H, ChInstrPtrs >> 8
@@ -504,7 +1131,11 @@ ApplyInstrCh:	LD H, ChInstrPtrs >> 8
 		LD A, [HLI]	; A = current command, HL = next
 	;; 0 indicates the end of the instrument - don't do anything more (ever)
 		AND A
+IF DEF(GBSOUND_INSTR_HOLD)
+		JR Z, InstrEnded
+ELSE
 		RET Z
+ENDC
 		LD B, A		; B = current command
 	;; write the new pointer back
 		LD A, L
@@ -515,6 +1146,11 @@ ApplyInstrCh:	LD H, ChInstrPtrs >> 8
 	;; 1 indicates the end of a frame - end the loop
 		DEC B
 		RET Z
+IF DEF(GBSOUND_INSTR_HOLD)
+	;; and so do the other odd numbers, which hold it for longer
+		BIT 0, B
+		JR Z, ChInstrHold
+ENDC
 	;; Push ApplyInstr onto the stack as a return address, so when the effect proc ends,
 	;; we run the loop again
 		LD HL, ApplyInstrCh
@@ -528,6 +1164,26 @@ ApplyInstrCh:	LD H, ChInstrPtrs >> 8
 		LD L, A
 		JP [HL]
 
+IF DEF(GBSOUND_INSTR_HOLD)
+;;; Ends the frame, and holds the instrument as it is for the next (B / 2) frames; for a long
+;;; note, that's quicker than reading an end of frame every frame
+;;; Assumes DE points at the high byte of the channel's instrument pointer
+ChInstrHold:	SRL B
+		DEC E
+		SET 3, E	; move to ChInstrHolds
+		LD A, B
+		LD [DE], A
+		RET
+
+;;; A finished instrument has nothing more to do, so rather than come back every frame to find
+;;; that out, hold it for as long as we can
+;;; Assumes DE points at the channel's instrument pointer
+InstrEnded:	SET 3, E	; move to ChInstrHolds
+		LD A, $FF
+		LD [DE], A
+		RET
+ENDC
+
 ;;; Rather than have different commands update the hardware haphazardly, they update a number
 ;;; of state variables; this function, called after all processing is done each frame, then does
 ;;; the final hardware updates (only for channels that have been marked "dirty" - the rest are
@@ -568,6 +1224,13 @@ ChRstInstr:	LD A, [ChNum]
 		INC E
 		LD A, [HL]
 		LD [DE], A
+IF DEF(GBSOUND_INSTR_HOLD)
+	;; stop any hold the last note was in
+		DEC E
+		SET 3, E	; move to ChInstrHolds
+		XOR A
+		LD [DE], A
+ENDC
 		RET
 
 ;;; Plays the next note for ChNum
@@ -623,7 +1286,7 @@ ChKeyOff:	LD A, [ChRegBase]
 		LD [HL], A
 		RET
 
-ChSetSndLen:	CALL PopOpcode
+ChSetSndLen:	CALL PopChOpcode
 		LD B, A
 		LD A, [ChRegBase]
 		LD C, A
@@ -797,11 +1460,11 @@ ChOctaveUp:	LD B, 12
 ChOctaveDown:	LD B, -12
 		JR ChOctaveCmd
 
-ChSetInstrCmd:	CALL PopOpcode
+ChSetInstrCmd:	CALL PopChOpcode
 		CALL ChSetInstr
 		JP ChRstInstr
 
-ChSetWaveCmd:	CALL PopOpcode
+ChSetWaveCmd:	CALL PopChOpcode
 		JP LoadWave
 
 ;;; assume HL = Instrument pointer
@@ -822,6 +1485,128 @@ PopInstr:	LD D, H
 		RET
 
 ;;; returns the next opcode byte in A and increments the song pointer
+IF DEF(GBSOUND_STREAM)
+;;; ...or rather, in streaming mode, decodes the next byte of the pattern and returns it.
+;;; This is Decompress (see decompress.asm) turned inside out, with its registers kept in the
+;;; Stream* variables between calls: every byte handed out is also written into the ring, where
+;;; later matches can find it. Past the end of the pattern it keeps returning 0 (a NOP).
+;;; Unlike the non-streaming PopOpcode, this clobbers BC and DE as well as HL.
+PopOpcode:	LD HL, StreamCopyLen
+		LD A, [HLI]
+		AND A
+		JR Z, .nextCmd
+	;; we're partway through a match - take its next byte from further back in the ring
+		DEC A
+		LD [StreamCopyLen], A
+		LD A, [HL]			; StreamCopySrc
+		INC [HL]
+		JR .copy
+.nextCmd:	INC HL				; StreamFlags
+	;; B = flags, C = commands left in this block, DE = compressed data
+		LD A, [HLI]
+		LD B, A
+		LD A, [HLI]
+		LD C, A
+		LD A, [HLI]
+		LD E, A
+		LD D, [HL]
+		LD A, C
+		AND A
+		JR NZ, .haveFlags
+	;; start a new block
+		LD A, [DE]
+		INC DE
+		LD B, A
+		LD C, 8
+.haveFlags:	DEC C
+		LD A, [DE]			; get the command
+		INC DE
+		BIT 0, B			; is this flag hi?
+		JR NZ, .literal			; if so, we have a literal
+		AND A				; otherwise, check for EOF
+	;; at the end of the pattern, leave the state as it is so that we hit the end again next time
+		RET Z
+	;; a match - the first byte is handed out now, and the rest on the calls to come
+		DEC A
+		LD [StreamCopyLen], A
+		LD A, [DE]			; get -offset
+		INC DE
+		LD HL, StreamDest
+		ADD [HL]			; source = dest + (-offset)
+		LD HL, StreamCopySrc
+		LD [HL], A
+		INC [HL]
+	;; we're done reading this command - save the decoder state, but keep hold of the source
+.literal:	LD H, A
+		SRL B				; move to next flag
+		LD A, B
+		LD [StreamFlags], A
+		LD A, C
+		LD [StreamCmds], A
+		LD A, E
+		LD [StreamSrc], A
+		LD A, D
+		LD [StreamSrc+1], A
+		LD A, H
+	;; SRL B shifted this command's flag into carry - a literal goes straight out, otherwise A
+	;; is where in the ring to copy from
+		JR C, .emit
+.copy:
+IF GBSOUND_STREAM_WINDOW < 256
+		AND GBSOUND_STREAM_WINDOW - 1
+ENDC
+		LD L, A
+		LD H, SongRing >> 8
+		LD A, [HL]
+.emit:	;; write the byte into the ring at StreamDest, and hand it out
+		LD HL, StreamDest
+		LD E, [HL]
+		INC [HL]
+		LD B, A
+		LD A, E
+IF GBSOUND_STREAM_WINDOW < 256
+		AND GBSOUND_STREAM_WINDOW - 1
+ENDC
+		LD E, A
+		LD D, SongRing >> 8
+		LD A, B
+		LD [DE], A
+		RET
+
+;;; Call with HL = the compressed pattern to start playing
+;;; Resets the decoder to the start of the pattern, and refills the end of the ring with the
+;;; dictionary - so that, just like with SongDict, it's immediately before the first byte of pattern
+StartStream:	LD A, L
+		LD [StreamSrc], A
+		LD A, H
+		LD [StreamSrc+1], A
+		XOR A
+		LD [StreamCopyLen], A
+		LD [StreamCmds], A
+		LD [StreamDest], A
+		LD HL, SongDictPtr
+		LD A, [HLI]
+		LD H, [HL]
+		LD L, A
+		LD A, [SongDictLen]
+		AND A
+		RET Z
+		LD B, A
+	;; the dictionary ends at the end of the ring, so it starts at -length
+		CPL
+		INC A
+IF GBSOUND_STREAM_WINDOW < 256
+		AND GBSOUND_STREAM_WINDOW - 1
+ENDC
+		LD E, A
+		LD D, SongRing >> 8
+.loop:		LD A, [HLI]
+		LD [DE], A
+		INC E
+		DEC B
+		JR NZ, .loop
+		RET
+ELSE
 PopOpcode:	LD HL, SongPtr
 		LD A, [HLI]
 		LD H, [HL]
@@ -833,6 +1618,25 @@ PopOpcode:	LD HL, SongPtr
 		INC L
 		INC [HL]
 		RET
+ENDC
+
+IF DEF(GBSOUND_PER_CHANNEL)
+;;; returns the next opcode byte of ChNum's pattern in A, and moves its pointer on
+PopChOpcode:	LD A, [ChNum]
+		ADD A
+		ADD ChSongPtrs & $FF
+		LD L, A
+		LD H, ChSongPtrs >> 8
+		LD E, [HL]
+		INC L
+		LD D, [HL]
+		LD A, [DE]
+		INC DE
+		LD [HL], D
+		DEC L
+		LD [HL], E
+		RET
+ENDC
 
 SongStop:	XOR A
 		LD HL, ChNum
@@ -855,23 +1659,34 @@ SongStop:	XOR A
 		ADD SP, 4
 		RET
 
-SongEndOfPat:	LD A, 1
-		LD [EndOfPat], A
-		RET
-
 SongJmpFrame:	CALL PopOpcode
 		LD [NextPattern], A
+	;; fall through
+
+;;; The row that ends a pattern holds nothing but this (or a jump), so it doesn't get a tick of its own
 	;; another, similar nasty bit of trickery - instead of returning and updating the sound channels
-	;; scrap the return address and jump back to the beginning of the frame update code
-	;; so that the first song control byte isn't ignored
-		ADD SP, 2
-		LD A, 1
-		LD [EndOfPat], A
+	;; (which have nothing more in this pattern) scrap the return address, start the next pattern,
+	;; and jump back to the beginning of the tick so that its first row isn't held up
+SongEndOfPat:	ADD SP, 2
+		CALL PlayNextPat
 		JP RunSndTick
 
+;;; A run of empty rows: nothing happens on this tick, or on the next (count - 1)
+SongWait:	CALL PopOpcode
+		DEC A
+		LD [SongWaitTicks], A
+	;; the same trick again - scrap the return address so the channels don't tick
+		ADD SP, 2
+		RET
+
 SongSetRate:	CALL PopOpcode
 		LD [SongRate], A
+IF DEF(GBSOUND_ROW_MASK)
+	;; the row's mask comes next
+		JP TickSongCtrl
+ELSE
 		RET
+ENDC
 
 ;;; A - index into the wave table
 LoadWave:	LD H, Waves >> 8
@@ -924,3 +1739,4 @@ CmdTblSongCtrl:	DW SongSetRate
 		DW SongStop
 		DW SongEndOfPat
 		DW SongJmpFrame
+		DW SongWait